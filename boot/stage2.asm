@@ -1,11 +1,25 @@
 [org 0x7E00]
 [bits 16]
 
-%define KERNEL_OFFSET 0x1000
-%define KERNEL_SEGMENT 0x0000
-%define KERNEL_SECTORS 32 
+; The kernel is loaded at 64KB. Conventional memory up to the stack at
+; 0x80000-0x90000 leaves room for the image and its BSS, and nothing we
+; still need (stage 2 itself, its GDT and page tables) sits above 0x10000.
+%define KERNEL_OFFSET 0x10000
+%define KERNEL_SEGMENT 0x1000
+%define KERNEL_LBA 33
+%define KERNEL_SECTORS 256
+%define KERNEL_CHUNK_SECTORS 64
 %define VGA_THIRD_LINE_OFFSET 480          
 
+; The BIOS memory map is handed to the kernel in a boot info block in
+; free conventional memory between the relocated MBR and the real mode
+; stack. The layout must match boot_info in kernel/include/boot_info.h.
+%define BOOT_INFO_ADDR 0x1000
+%define BOOT_INFO_MAGIC 0x464E4942
+%define E820_MAX_ENTRIES 128
+%define E820_ENTRY_SIZE 24
+%define E820_SMAP 0x534D4150
+
 start_stage2:
     mov [boot_drive], dl
     
@@ -21,6 +35,10 @@ start_stage2:
     je .no_long_mode
 
     call enable_a20
+
+    ; INT 15h is gone once we leave real mode, so the memory map
+    ; has to be collected now, together with the kernel load.
+    call detect_memory
     
     mov bx, loading_kernel_str
     call print16_string
@@ -29,21 +47,29 @@ start_stage2:
     ; Loading the 64-bit kernel
     ; We use BIOS int 0x13 which is slow but reliable for 
     ; fetching the initial kernel payload before we lose BIOS access.
-    mov ax, KERNEL_SEGMENT
-    mov es, ax
-    mov bx, KERNEL_OFFSET
-    
-    mov ah, 0x02               
-    mov al, KERNEL_SECTORS     
-    mov ch, 0                  
-    mov cl, 34                    ; Starting sector (skipping bootloader)
-    mov dh, 0                  
+    ; The extended read (AH=0x42) takes an LBA instead of CHS. A transfer
+    ; must not cross a 64KB segment, so we read 32KB chunks and move the
+    ; destination segment forward after each one.
+    mov cx, KERNEL_SECTORS / KERNEL_CHUNK_SECTORS
+
+.load_chunk:
+    push cx
+    mov word [dap_sectors], KERNEL_CHUNK_SECTORS  ; BIOS overwrites it with the count read
+    mov si, kernel_dap
+    mov ah, 0x42
     mov dl, [boot_drive]
     int 0x13
-    
+    pop cx
+
     jc .disk_error
 
-    mov ax, [KERNEL_OFFSET]
+    add word [dap_segment], (KERNEL_CHUNK_SECTORS * 512) / 16
+    add dword [dap_lba], KERNEL_CHUNK_SECTORS
+    loop .load_chunk
+
+    mov ax, KERNEL_SEGMENT
+    mov es, ax
+    mov ax, [es:0]
     cmp ax, 0
     je .disk_error
     
@@ -109,6 +135,53 @@ check_long_mode:
     mov ax, 0
     ret
 
+; Walks the BIOS E820 map into the boot info block. EBX carries the
+; continuation value between calls and returns to zero after the last
+; entry. Some BIOSes report the end with CF instead, and a CF on the
+; very first call means there is no E820 at all, leaving the count at 0.
+detect_memory:
+    pushad
+    xor ax, ax
+    mov es, ax
+
+    mov dword [BOOT_INFO_ADDR], BOOT_INFO_MAGIC
+    mov dword [BOOT_INFO_ADDR + 4], 0
+    mov di, BOOT_INFO_ADDR + 8
+    xor ebx, ebx
+
+.next_entry:
+    ; Older BIOSes only fill 20 bytes, preset the ACPI 3.0 "valid" bit
+    mov dword [es:di + 20], 1
+    mov eax, 0xE820
+    mov ecx, E820_ENTRY_SIZE
+    mov edx, E820_SMAP
+    int 0x15
+    jc .done
+
+    cmp eax, E820_SMAP
+    jne .done
+
+    ; Skip empty entries and the ones ACPI 3.0 marks as invalid
+    mov eax, [es:di + 8]
+    or eax, [es:di + 12]
+    jz .skip_entry
+
+    test dword [es:di + 20], 1
+    jz .skip_entry
+
+    add di, E820_ENTRY_SIZE
+    inc dword [BOOT_INFO_ADDR + 4]
+    cmp dword [BOOT_INFO_ADDR + 4], E820_MAX_ENTRIES
+    jae .done
+
+.skip_entry:
+    test ebx, ebx
+    jnz .next_entry
+
+.done:
+    popad
+    ret
+
 enable_a20:
     pusha
     in al, 0x92
@@ -208,7 +281,9 @@ long_mode_start:
     mov rbp, 0x90000
     mov rsp, rbp
 
-    ; Final jump into the 64-bit C kernel
+    ; Final jump into the 64-bit C kernel, the boot info block is
+    ; its first argument (RDI in the System V calling convention)
+    mov rdi, BOOT_INFO_ADDR
     mov rax, KERNEL_OFFSET
     jmp rax
 
@@ -231,6 +306,15 @@ no_long_mode_str: db 'Error: CPU does not support 64-bit long mode', 0
 boot_drive: db 0
 cursor_pos: dd 0       
 
+; Disk address packet for the extended read
+kernel_dap:
+    db 0x10                       ; Packet size
+    db 0
+dap_sectors: dw 0
+dap_offset: dw 0
+dap_segment: dw KERNEL_SEGMENT
+dap_lba: dq KERNEL_LBA
+
 ; Memory reserved for page tables (must be 4KB aligned)
 align 4096
 pml4_table: times 4096 db 0   
@@ -0,0 +1,115 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+// The BIOS stores the EBDA segment here; the RSDP may be in its first KiB
+#define ACPI_EBDA_SEGMENT_PTR 0x40E
+#define ACPI_BIOS_AREA_START 0xE0000
+#define ACPI_BIOS_AREA_END 0x100000
+
+typedef struct
+{
+    char signature[8];          // "RSD PTR ", on a 16 byte boundary
+    uint8_t checksum;           // Covers the ACPI 1.0 part, the first 20 bytes
+    char oem_id[6];
+    uint8_t revision;           // 0 for ACPI 1.0, 2 and up add the XSDT
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;  // Covers all length bytes
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp;
+
+// Common header of every system description table
+typedef struct
+{
+    char signature[4];
+    uint32_t length;            // Including this header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header;
+
+// PCI Express memory mapped configuration table, allocations follow it
+typedef struct
+{
+    acpi_sdt_header header;
+    uint64_t reserved;
+} __attribute__((packed)) acpi_mcfg;
+
+typedef struct
+{
+    uint64_t base_address;      // ECAM base, bus 0 even if start_bus is higher
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed)) acpi_mcfg_allocation;
+
+// ACPI generic address structure, how a register block is reached
+typedef struct
+{
+    uint8_t address_space;      // 0 = system memory, 1 = system I/O
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} __attribute__((packed)) acpi_gas;
+
+// High Precision Event Timer description table
+typedef struct
+{
+    acpi_sdt_header header;
+    uint32_t event_timer_block_id;
+    acpi_gas address;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+} __attribute__((packed)) acpi_hpet;
+
+// Multiple APIC description table, variable length entries follow it
+typedef struct
+{
+    acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_madt_entry;
+
+#define ACPI_MADT_LOCAL_APIC 0
+#define ACPI_MADT_LAPIC_ENABLED (1 << 0)
+#define ACPI_MADT_LAPIC_ONLINE_CAPABLE (1 << 1)
+
+typedef struct
+{
+    acpi_madt_entry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_local_apic;
+
+#define ACPI_MADT_IOAPIC 1
+
+typedef struct
+{
+    acpi_madt_entry entry;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;          // First global system interrupt it handles
+} __attribute__((packed)) acpi_madt_ioapic;
+
+void acpi_init(void);
+const acpi_sdt_header *acpi_find_table(const char *signature);
+
+#endif
\ No newline at end of file
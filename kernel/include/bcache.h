@@ -0,0 +1,57 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_BLOCK_SECTORS (BCACHE_BLOCK_SIZE / BLOCK_SECTOR_SIZE)
+
+// The cache sizes itself to this fraction of free RAM at boot
+#define BCACHE_MEMORY_SHARE 4
+#define BCACHE_MIN_BUFFERS 1024
+#define BCACHE_HASH_SIZE 256
+
+// Blocks one bcache_read pins at a time, also sizes its stack array
+#define BCACHE_READ_BATCH 64
+
+#define BCACHE_VALID (1 << 0)	// Data matches (or is newer than) the disk
+#define BCACHE_DIRTY (1 << 1)	// Data must be written back before reuse
+#define BCACHE_BUSY (1 << 2)	// A read or write-back is in flight
+
+typedef struct bcache_buf bcache_buf;
+
+/**
+ * One cached block of BCACHE_BLOCK_SIZE bytes. The last block of a
+ * device may be shorter, sectors says how much of it exists on disk.
+ * A buffer stays put while refcount is non-zero; once released it is
+ * only kept around for the next hit until the LRU reclaims it.
+ */
+struct bcache_buf
+{
+	block_device *dev;
+	uint64_t block;				// Index in BCACHE_BLOCK_SIZE units
+	uint32_t sectors;
+	uint64_t data;				// Physical address, identity mapped
+	uint32_t refcount;
+	uint32_t flags;
+	block_request req;			// I/O currently filling or writing the buffer
+	bcache_buf *hash_next;
+	bcache_buf *lru_prev;		// Towards the most recently used end
+	bcache_buf *lru_next;
+};
+
+void bcache_init(void);
+
+bcache_buf *bcache_get(block_device *dev, uint64_t block);
+void bcache_release(bcache_buf *buf);
+void bcache_mark_dirty(bcache_buf *buf);
+
+int bcache_read(block_device *dev, uint64_t lba, uint32_t count, void *dest);
+int bcache_write(block_device *dev, uint64_t lba, uint32_t count, const void *src);
+int bcache_flush(block_device *dev);
+
+void bcache_print_stats(void);
+
+#endif
\ No newline at end of file
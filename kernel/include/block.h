@@ -0,0 +1,126 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLOCK_SECTOR_SIZE 512
+
+// Client requests merged into one dispatch, each becomes one segment
+#define BLOCK_MAX_SEGMENTS 16
+
+// Readahead window bounds in sectors (128 KiB to 2 MiB)
+#define BLOCK_RA_MIN_SECTORS 256
+#define BLOCK_RA_MAX_SECTORS 4096
+
+typedef enum
+{
+	BLOCK_PENDING,
+	BLOCK_DONE,
+	BLOCK_ERROR,
+} block_status;
+
+typedef struct block_request block_request;
+typedef struct block_dispatch block_dispatch;
+typedef struct block_device block_device;
+typedef void (*block_callback)(block_request *req);
+
+/**
+ * One client I/O against a block device: count sectors starting at lba,
+ * to or from a physically contiguous buffer. Like ahci_request, the
+ * caller owns the memory and must keep it valid until status leaves PENDING.
+ */
+struct block_request
+{
+	uint64_t lba;
+	uint32_t count;
+	uint64_t buf;
+	bool write;
+	volatile block_status status;
+	block_callback callback;
+	void *ctx;
+	block_request *next;		// Link inside a dispatch or the backlog
+};
+
+/**
+ * What the queue hands to the driver: a run of client requests with
+ * contiguous LBAs and the same direction, issued as a single command.
+ * The requests are kept in LBA order.
+ */
+struct block_dispatch
+{
+	block_device *dev;
+	uint64_t lba;
+	uint32_t count;
+	bool write;
+	uint16_t nr_requests;
+	block_request *head;
+	block_request *tail;
+	block_dispatch *next;		// Queue or free list link
+};
+
+typedef struct
+{
+	// Starts one dispatch; the driver calls block_complete when it finishes
+	int (*submit)(block_device *dev, block_dispatch *unit);
+
+	// Blocks until at least one in-flight dispatch has completed
+	void (*wait)(block_device *dev);
+
+	// Makes completed writes durable (drive write cache), may be NULL
+	int (*flush)(block_device *dev);
+} block_ops;
+
+struct block_device
+{
+	char name[8];
+	uint64_t sectors;
+	bool rotational;			// Sort by LBA instead of dispatching FIFO
+	uint32_t max_sectors;		// Largest single dispatch the driver accepts
+	uint16_t max_segments;
+	uint8_t max_inflight;
+	const block_ops *ops;
+	void *driver;
+
+	// Driver-owned fields end here, the rest belongs to the block layer
+	uint8_t inflight;
+	uint32_t plugged;
+	uint64_t head_lba;			// Where the last dispatch ended (elevator position)
+	block_dispatch *queue_head;
+	block_dispatch *queue_tail;
+	block_request *backlog_head;	// Requests that could not get a dispatch unit
+	block_request *backlog_tail;
+	block_device *next;			// Registration list
+
+	// Sequential stream detection for readahead
+	uint64_t seq_next;			// LBA right after the last read
+	uint32_t ra_window;			// Current window in sectors, 0 while access is random
+	uint64_t ra_end;			// End of everything readahead has requested
+
+	uint64_t requests;
+	uint64_t front_merges;
+	uint64_t back_merges;
+	uint64_t dispatches;
+	uint64_t ra_sectors;
+};
+
+void block_init(void);
+int block_register(block_device *dev);
+int block_device_count(void);
+block_device *block_get(int index);
+
+int block_submit(block_device *dev, block_request *req);
+void block_complete(block_dispatch *unit, bool success);
+bool block_request_done(block_request *req);
+int block_wait(block_device *dev, block_request *req);
+int block_flush(block_device *dev);
+void block_plug(block_device *dev);
+void block_unplug(block_device *dev);
+bool block_readahead(block_device *dev, uint64_t lba, uint32_t count, uint64_t *ra_lba, uint32_t *ra_count);
+
+int block_read(block_device *dev, uint64_t lba, uint32_t count, uint64_t buf);
+int block_write(block_device *dev, uint64_t lba, uint32_t count, uint64_t buf);
+
+void block_print_stats(block_device *dev);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef BOOT_INFO_H
+#define BOOT_INFO_H
+
+#include <stdint.h>
+
+// Must match the definitions at the top of boot/stage2.asm
+#define BOOT_INFO_MAGIC 0x464E4942
+#define E820_MAX_ENTRIES 128
+
+#define E820_USABLE 1
+#define E820_RESERVED 2
+#define E820_ACPI_RECLAIMABLE 3
+#define E820_ACPI_NVS 4
+#define E820_BAD 5
+
+typedef struct
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi_attributes;
+} __attribute__((packed)) e820_entry;
+
+/**
+ * What stage2 learned from the BIOS before leaving real mode. It lives
+ * in conventional memory below 1 MiB, which the kernel never allocates,
+ * so the pointer stays valid for the kernel's lifetime.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t e820_count;
+    e820_entry e820[E820_MAX_ENTRIES];
+} __attribute__((packed)) boot_info;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,70 @@
+/**
+ * Like the port I/O helpers in ports.h, these wrap single x86
+ * instructions (MSRs, CPUID, interrupt flag control) that C cannot
+ * express on its own.
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+#define RFLAGS_IF (1ULL << 9)
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t low;
+    uint32_t high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t low;
+    uint32_t high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Code that shares state with an interrupt handler must keep that
+ * handler out while it works. Saving RFLAGS instead of blindly
+ * re-enabling lets these sections nest and run before the IDT is up.
+ */
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & RFLAGS_IF)
+    {
+        __asm__ __volatile__("sti" : : : "memory");
+    }
+}
+
+/**
+ * Sleeps until the next interrupt. STI only takes effect after the
+ * following instruction, so an interrupt that became pending while
+ * we checked our wake condition with IF clear still ends the HLT.
+ */
+static inline void cpu_idle(void)
+{
+    __asm__ __volatile__("sti; hlt; cli" : : : "memory");
+}
+
+#endif
\ No newline at end of file
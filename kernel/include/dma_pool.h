@@ -0,0 +1,39 @@
+#ifndef DMA_POOL_H
+#define DMA_POOL_H
+
+#include <stdint.h>
+
+// Objects a new slab is sized for, slabs are at least one page
+#define DMA_POOL_SLAB_OBJECTS 16
+
+// Highest address reachable by a device without 64-bit addressing
+#define DMA_LIMIT_32BIT 0x100000000ULL
+
+/**
+ * Fixed-size, aligned, physically contiguous objects for device
+ * structures. Slabs come from the frame allocator aligned to their own
+ * size, so an object at a multiple of the (alignment rounded) object
+ * size is aligned too. Free objects are linked through their first
+ * eight bytes, which makes both alloc and free O(1).
+ */
+typedef struct
+{
+	const char *name;
+	uint32_t size;				// Object size rounded up to the alignment
+	uint32_t slab_order;
+	uint64_t limit;				// Every object ends at or below this address
+	uint64_t free_head;			// Physical address, 0 when the pool is empty
+
+	uint32_t slabs;
+	uint32_t objects;
+	uint32_t objects_free;
+	uint64_t allocs;
+	uint64_t frees;
+} dma_pool;
+
+int dma_pool_init(dma_pool *pool, const char *name, uint32_t size, uint32_t align, uint64_t limit, uint32_t reserve);
+uint64_t dma_pool_alloc(dma_pool *pool);
+void dma_pool_free(dma_pool *pool, uint64_t phys);
+void dma_pool_print_stats(const dma_pool *pool);
+
+#endif
\ No newline at end of file
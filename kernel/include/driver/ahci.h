@@ -2,7 +2,10 @@
 #define AHCI_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "pci.h"
+#include "spinlock.h"
+#include "timer.h"
 
 #define PCI_CLASS_MASS_STORAGE 0x01
 #define PCI_SUBCLASS_SATA 0x06
@@ -10,14 +13,38 @@
 
 #define GHC_AE (1 << 31)
 #define GHC_HR (1 << 0)
+#define GHC_IE (1 << 1)
+#define GHC_MRSM (1 << 2)	// HBA fell back to a single MSI message
 #define HOST_CAP_64 (1 << 31)
+#define HOST_CAP_SNCQ (1 << 30)
+#define HOST_CAP_SSS (1 << 27)
+#define HOST_CAP_NCS_SHIFT 8
+#define HOST_CAP_NCS_MASK 0x1F
+#define HOST_CAP_CCCS (1 << 7)
+
+// Command completion coalescing control (CCC_CTL)
+#define CCC_CTL_EN (1 << 0)
+#define CCC_CTL_INT_SHIFT 3
+#define CCC_CTL_INT_MASK 0x1F
+#define CCC_CTL_CC_SHIFT 8
+#define CCC_CTL_TV_SHIFT 16
 
 #define PxCMD_ST (1 << 0)
 #define PxCMD_FR (1 << 14)
 #define PxCMD_FRE (1 << 4)
 #define PxCMD_CR (1 << 15)
+#define PxCMD_SUD (1 << 1)
 #define PxSTSS (2 << 0)
 #define PxIS_TFES (1 << 30) 
+#define PxIS_DHRS (1 << 0)
+#define PxIS_SDBS (1 << 3)
+#define PxIS_IFS (1 << 27)
+#define PxIS_HBDS (1 << 28)
+#define PxIS_HBFS (1 << 29)
+
+// PxIE bits mirror PxIS: D2H Register FIS, Set Device Bits FIS and errors
+#define AHCI_PxIE_ERRORS (PxIS_IFS | PxIS_HBDS | PxIS_HBFS | PxIS_TFES)
+#define AHCI_PxIE_DEFAULT (PxIS_DHRS | PxIS_SDBS | AHCI_PxIE_ERRORS)
 
 #define AHCI_DEV_NULL 0
 #define AHCI_DEV_SATA 1
@@ -27,13 +54,53 @@
 #define HBA_PORT_DET_PRESENT 3
 #define HBA_PORT_DET_IDLE 4
 #define HBA_PORT_IPM_ACTIVE 1
-#define AHCI_BASE 0x400000 
 
 #define ATA_DEV_BUSY 0x80
 #define ATA_DEV_DRQ 0x08     
 #define ATA_CMD_READ_DMA_EX 0x25
 #define ATA_CMD_WRITE_DMA_EX 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
 #define ATA_CMD_IDENTIFY 0xEC
+#define ATA_DEVICE_LBA (1 << 6)
+
+// IDENTIFY DEVICE word offsets used by the driver
+#define ATA_IDENT_SERIAL 10
+#define ATA_IDENT_FIRMWARE 23
+#define ATA_IDENT_MODEL 27
+#define ATA_IDENT_QUEUE_DEPTH 75
+#define ATA_IDENT_SATA_CAP 76
+#define ATA_IDENT_LBA48_SECTORS 100
+#define ATA_IDENT_ROTATION_RATE 217
+#define ATA_SATA_CAP_NCQ (1 << 8)
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+// 248 PRDT entries make a command table exactly one 4KB page
+#define AHCI_MAX_PRDT 248
+#define AHCI_CMD_TBL_SIZE 4096
+#define AHCI_CMD_LIST_SIZE 1024
+#define AHCI_FIS_SIZE 256
+#define AHCI_CMD_TBL_ALIGN 128
+#define AHCI_PRDT_MAX_BYTES 0x400000
+#define AHCI_MAX_SECTORS 65536
+#define AHCI_SECTOR_SIZE 512
+
+// Upper bound on the adaptive poll window
+#define AHCI_POLL_WINDOW_MAX_NS 50000
+
+// GHC.HR must self-clear within 1 s, PxCMD.CR/FR within 500 ms (AHCI 1.3, 10.4.2 and 10.1.2)
+#define AHCI_RESET_TIMEOUT_MS 1000
+#define AHCI_ENGINE_TIMEOUT_MS 500
+#define AHCI_LINK_TIMEOUT_MS 10
+#define AHCI_COMMAND_TIMEOUT_MS 1000
+
+// A queued I/O still outstanding after this long is aborted by port recovery
+#define AHCI_IO_TIMEOUT_MS 30000
+
+// Requests that found no free slot wait here, must be a power of two
+#define AHCI_RING_SIZE 64
 
 #define SATA_SIG_ATA 0x00000101  
 #define SATA_SIG_ATAPI 0xEB140101  
@@ -165,13 +232,142 @@ typedef struct tagHBA_CMD_TBL
 	uint8_t acmd[16];	
 	uint8_t rsv[48];	
 
-	HBA_PRDT_ENTRY prdt_entry[1];	
+	HBA_PRDT_ENTRY prdt_entry[AHCI_MAX_PRDT];	
 } HBA_CMD_TBL __attribute__(());
 
+/**
+ * One physically contiguous piece of a scatter-gather transfer.
+ * Both the address and the length must be even, the PRDT only
+ * describes word aligned, word sized data.
+ */
+typedef struct
+{
+	uint64_t phys;
+	uint32_t len;
+} ahci_iovec;
+
+typedef enum
+{
+	AHCI_COMPLETION_POLL,		// Spin on PxCI/PxSACT, PxIE stays off
+	AHCI_COMPLETION_IRQ,		// Halt until the MSI
+	AHCI_COMPLETION_ADAPTIVE,	// Poll for about one service time, then halt
+} ahci_completion_mode;
+
+typedef enum
+{
+	AHCI_REQ_PENDING,
+	AHCI_REQ_DONE,
+	AHCI_REQ_ERROR,
+} ahci_status;
+
+typedef struct ahci_request ahci_request;
+typedef void (*ahci_callback)(ahci_request *req);
+
+/**
+ * Descriptor for one asynchronous transfer. The caller owns the memory
+ * and fills lba/count/buf/write (plus an optional callback and context)
+ * before ahci_submit; the driver owns it until status leaves PENDING.
+ * A scattered buffer is described by iov/iovcnt instead of buf, and the
+ * segments must add up to count sectors. A flush request carries no data
+ * and ignores every transfer field.
+ */
+struct ahci_request
+{
+	uint64_t lba;
+	uint32_t count;
+	uint64_t buf;
+	const ahci_iovec *iov;
+	uint16_t iovcnt;
+	bool write;
+	bool flush;				// FLUSH CACHE EXT instead of a transfer
+	volatile ahci_status status;
+	ahci_callback callback;
+	void *ctx;
+	ahci_request *next;		// Wait queue link while no slot is free
+};
+
+/**
+ * Cell of a port's submission ring. seq tells producers and the consumer
+ * whose turn the cell is, see ahci_ring_push.
+ */
+typedef struct
+{
+	volatile uint32_t seq;
+	ahci_request *req;
+} ahci_ring_cell;
+
+/**
+ * Software state for one implemented port. The HBA registers only tell us
+ * which slots the hardware still owns; this records which slots we handed
+ * out, so a slot whose bit dropped out of PxSACT/PxCI can be reaped exactly once.
+ * Submitters claim slots and push to the ring without the lock; it covers
+ * completion, the overflow list and the configuration fields.
+ */
+typedef struct
+{
+	spinlock lock;
+	HBA_PORT *port;
+	int port_no;
+	bool present;
+	bool irq_capable;		// MSI is set up for the controller
+	uint8_t vector;			// Vector the port's completions arrive on
+	uint32_t cpu;			// Index of the CPU that vector is delivered to
+	uint8_t claims;			// Block devices built on the port, see ahci_port_claim
+	bool irq_armed;			// PxIE currently enabled
+	bool ccc;				// Completions are coalesced into the CCC interrupt
+	ahci_completion_mode mode;
+	bool ncq;				// HBA (CAP.SNCQ) and device (IDENTIFY word 76) both queue
+	uint8_t queue_depth;	// Commands we keep in flight, 1 without NCQ
+	uint32_t slots_all;		// Every slot below queue_depth
+	volatile uint32_t slots_free;		// Claimable slots, taken and returned atomically
+	volatile uint32_t slots_issuing;	// Claimed, PxCI not written yet
+	volatile uint32_t slots_busy;		// Slots issued to the HBA and not yet reaped
+	volatile uint32_t slots_failed;		// Reaped slots that completed with an error
+	volatile uint32_t slots_nonqueued;	// Busy slots holding a non-queued command
+	ahci_request *slot_req[AHCI_MAX_SLOTS];
+	uint64_t slot_issued[AHCI_MAX_SLOTS];	// ktime_ns at issue, for service time
+	ktimer timeout;			// Pending while slots are busy, fires for the oldest
+	ahci_ring_cell ring[AHCI_RING_SIZE];
+	volatile uint32_t ring_head;	// Next cell a producer claims
+	uint32_t ring_tail;		// Next cell the completion side takes
+	ahci_request *wait_head;	// Overflow behind a full ring
+	ahci_request *wait_tail;
+	uint64_t cmd_list;		// From the DMA pools, see ahci_port_alloc
+	uint64_t fis_area;
+	uint64_t cmd_tables[AHCI_MAX_SLOTS];	// One per usable slot, reused by every command
+	uint64_t sectors;
+	uint16_t rotation_rate;	// IDENTIFY word 217, 1 = non-rotating
+	uint64_t commands_completed;
+	uint64_t poll_completions;	// Requests completed from a polling path
+	uint64_t irq_completions;	// Requests completed by the interrupt handler
+	uint64_t sleeps;			// Waits that had to halt for an interrupt
+	uint64_t timeouts;			// Recoveries forced by a command timeout
+	uint64_t direct_issues;		// Submissions that claimed a slot straight away
+	uint64_t slot_retries;		// Slot claims lost to another CPU and retried
+	uint64_t ring_retries;		// Ring cells lost to another CPU and retried
+	uint64_t ring_spills;		// Submissions that found the ring full
+	uint64_t service_ns;	// Moving average of issue-to-completion time
+} ahci_port;
+
 void ahci_init(pci_device *ahci_dev);
 void ahci_probe_port(HBA_MEM *hba_mem, int port_no);
 void ahci_rebase_port(HBA_PORT *port, int port_no);
-int find_cmdslot(HBA_PORT *port);
+ahci_port *ahci_get_port(int port_no);
+int ahci_build_prdt(HBA_CMD_TBL *table, const ahci_iovec *iov, int iovcnt);
+int ahci_submit(ahci_port *ap, ahci_request *req);
+int ahci_poll(ahci_port *ap);
+bool ahci_request_done(ahci_request *req);
+int ahci_wait(ahci_port *ap, ahci_request *req);
+int ahci_flush(ahci_port *ap);
+int ahci_set_completion_mode(ahci_port *ap, ahci_completion_mode mode);
+void ahci_port_claim(ahci_port *ap);
+int ahci_port_set_cpu(ahci_port *ap, uint32_t cpu);
+void ahci_print_stats(ahci_port *ap);
+int ahci_ccc_enable(uint32_t ports, uint8_t completions, uint16_t timeout_ms);
+void ahci_ccc_disable(void);
+void ahci_print_interrupt_stats(void);
+void ahci_smp_benchmark(void);
+void ahci_ccc_benchmark(void);
 int ahci_read(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint64_t buf);
 int ahci_write(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint64_t buf);
 int ahci_identify(HBA_PORT *port, uint16_t *buf);
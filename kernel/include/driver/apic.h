@@ -0,0 +1,67 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+
+// The local APIC base is relocatable through this MSR; bit 11 enables it.
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+// ICR delivery modes, level and status bits
+#define LAPIC_ICR_FIXED (0 << 8)
+#define LAPIC_ICR_INIT (5 << 8)
+#define LAPIC_ICR_STARTUP (6 << 8)
+#define LAPIC_ICR_PENDING (1 << 12)
+#define LAPIC_ICR_ASSERT (1 << 14)
+#define LAPIC_ICR_LEVEL (1 << 15)
+
+// LVT timer mode in bits 18:17; every LVT entry masks with bit 16
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_TIMER_ONESHOT (0 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+// Writing a TSC value arms the timer in TSC-deadline mode, 0 disarms it
+#define IA32_TSC_DEADLINE_MSR 0x6E0
+#define CPUID_TSC_DEADLINE (1 << 24)
+
+// Used when the MADT lists no IOAPIC for GSI 0
+#define IOAPIC_DEFAULT_BASE 0xFEC00000
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REG_REDTBL 0x10
+#define IOAPIC_REDTBL_MASKED (1 << 16)
+
+// MSI messages are memory writes into this window (Intel SDM 10.11.1).
+#define MSI_ADDRESS_BASE 0xFEE00000
+
+void apic_init(void);
+void lapic_enable(void);
+void lapic_send_ipi(uint8_t apic_id, uint32_t command);
+void lapic_eoi(void);
+uint8_t lapic_id(void);
+void ioapic_route(uint8_t gsi, uint8_t vector, uint8_t apic_id, bool masked);
+void lapic_timer_init(uint8_t vector);
+void lapic_timer_arm(uint64_t deadline_ns);
+void lapic_timer_disarm(void);
+
+#endif
\ No newline at end of file
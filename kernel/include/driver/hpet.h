@@ -0,0 +1,25 @@
+#ifndef HPET_H
+#define HPET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HPET_GENERAL_CAPABILITIES 0x000
+#define HPET_GENERAL_CONFIG 0x010
+#define HPET_MAIN_COUNTER 0x0F0
+
+// The top half of the capabilities register is the tick period in femtoseconds
+#define HPET_CAP_PERIOD_SHIFT 32
+#define HPET_CAP_COUNTER_64BIT (1 << 13)
+#define HPET_CONFIG_ENABLE (1 << 0)
+
+// The spec caps the period at 100 ns
+#define HPET_MAX_PERIOD_FS 100000000ULL
+#define HPET_REGISTER_SIZE 0x400
+
+bool hpet_init(void);
+bool hpet_available(void);
+uint64_t hpet_read_counter(void);
+uint64_t hpet_period_fs(void);
+
+#endif
@@ -7,31 +7,98 @@
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA 0xCFC
 
+// Legacy config space; ECAM extends every function to 4 KiB
+#define PCI_CONFIG_SPACE_SIZE 0x100
+#define PCI_EXT_CONFIG_SPACE_SIZE 0x1000
+
 #define PCI_VENDOR_ID 0x00
 #define PCI_DEVICE_ID 0x02
 #define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
 #define PCI_REVISION_ID 0x08
 #define PCI_PROG_IF 0x09
 #define PCI_SUBCLASS 0x0A
 #define PCI_CLASS_CODE 0x0B
 #define PCI_HEADER_TYPE 0x0E
 #define PCI_BAR0 0x10
+#define PCI_PRIMARY_BUS 0x18
+#define PCI_SECONDARY_BUS 0x19
+#define PCI_SUBORDINATE_BUS 0x1A
+#define PCI_CAPABILITY_LIST 0x34
 #define PCI_INTERRUPT_LINE 0x3C
 #define PCI_INTERRUPT_PIN 0x3D
 
 #define PCI_COMMAND_IO (1 << 0)
 #define PCI_COMMAND_MEMORY (1 << 1)
 #define PCI_COMMAND_BUS_MASTER (1 << 2)
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+
+#define PCI_STATUS_CAP_LIST (1 << 4)
+
+// Bit 7 of the header type marks a multi-function device
+#define PCI_HEADER_TYPE_MASK 0x7F
+#define PCI_HEADER_TYPE_MULTIFUNCTION 0x80
+#define PCI_HEADER_TYPE_NORMAL 0x00
+#define PCI_HEADER_TYPE_BRIDGE 0x01
+
+// A type 1 header only has room for two BARs before the bus numbers
+#define PCI_NORMAL_BAR_COUNT 6
+#define PCI_BRIDGE_BAR_COUNT 2
+
+#define PCI_CAP_ID_PM 0x01
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_PCIE 0x10
+#define PCI_CAP_ID_MSIX 0x11
+
+// Power management: PMCSR holds the D-state in its bottom two bits
+#define PCI_PM_CTRL 0x04
+#define PCI_PM_CTRL_STATE_MASK 0x03
+#define PCI_PM_D0 0
+#define PCI_PM_D3HOT 3
+
+#define PCI_MSI_CONTROL 0x02
+#define PCI_MSI_ADDRESS_LOW 0x04
+#define PCI_MSI_ADDRESS_HIGH 0x08
+#define PCI_MSI_DATA_32 0x08
+#define PCI_MSI_DATA_64 0x0C
+#define PCI_MSI_CONTROL_ENABLE (1 << 0)
+#define PCI_MSI_CONTROL_MMC_SHIFT 1
+#define PCI_MSI_CONTROL_MMC_MASK (7 << 1)
+#define PCI_MSI_CONTROL_MME_SHIFT 4
+#define PCI_MSI_CONTROL_MME_MASK (7 << 4)
+#define PCI_MSI_CONTROL_64BIT (1 << 7)
+
+#define PCI_MSIX_CONTROL 0x02
+#define PCI_MSIX_TABLE 0x04
+#define PCI_MSIX_PBA 0x08
+#define PCI_MSIX_CONTROL_SIZE_MASK 0x7FF
+#define PCI_MSIX_CONTROL_FUNCTION_MASK (1 << 14)
+#define PCI_MSIX_CONTROL_ENABLE (1 << 15)
+#define PCI_MSIX_BIR_MASK 0x07
+
+// Every MSI-X table entry is four dwords
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_ENTRY_ADDRESS_LOW 0x00
+#define PCI_MSIX_ENTRY_ADDRESS_HIGH 0x04
+#define PCI_MSIX_ENTRY_DATA 0x08
+#define PCI_MSIX_ENTRY_VECTOR_CONTROL 0x0C
+#define PCI_MSIX_ENTRY_MASKED (1 << 0)
 
 #define PCI_CLASS_MASS_STORAGE 0x01
+#define PCI_CLASS_BRIDGE 0x06
+#define PCI_SUBCLASS_HOST_BRIDGE 0x00
+#define PCI_SUBCLASS_PCI_BRIDGE 0x04
 #define PCI_SUBCLASS_SATA 0x06
 #define PCI_PROG_IF_AHCI 0x01
 
 #define PCI_BAR_TYPE_IO 0x01
+#define PCI_BAR_MEM_TYPE_MASK 0x06
+#define PCI_BAR_MEM_TYPE_64 0x04
+#define PCI_BAR_PREFETCHABLE 0x08
 #define PCI_BAR_MMIO_MASK 0xFFFFFFF0
 #define PCI_BAR_IO_MASK 0xFFFFFFFC
 
-typedef struct 
+typedef struct pci_device
 {
     uint16_t vendor_id;
     uint16_t device_id;
@@ -45,27 +112,60 @@ typedef struct
     uint8_t header_type;
     uint8_t interrupt_line;
     uint8_t interrupt_pin;
-    uint32_t bar[6];
+    uint8_t bar_count;          // 6 for devices, 2 for PCI-to-PCI bridges
+    uint8_t secondary_bus;      // Bridges only, the bus behind the bridge
+    uint8_t subordinate_bus;    // Bridges only, the highest bus below it
+    uint32_t bar[6];            // Raw values, a 64-bit BAR takes two
+    uint8_t cap_pm;             // Capability offsets, 0 when absent
+    uint8_t cap_msi;
+    uint8_t cap_msix;
+    uint8_t cap_pcie;
+    uintptr_t msix_table;       // Mapped MSI-X table once MSI-X is enabled
+    uint16_t msix_entries;
+    struct pci_device *next;
 } pci_device;
 
-uint32_t pci_config_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
-uint16_t pci_config_read_word(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
-uint8_t pci_config_read_byte(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
+// One memory mapped configuration window from the ACPI MCFG table
+typedef struct
+{
+    uint64_t base;              // Address of bus 0, device 0, function 0
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+} pci_ecam_region;
+
+uint32_t pci_config_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset);
+uint16_t pci_config_read_word(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset);
+uint8_t pci_config_read_byte(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset);
 
-void pci_config_write_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value);
-void pci_config_write_word(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint16_t value);
-void pci_config_write_byte(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint8_t value);
+void pci_config_write_dword(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint32_t value);
+void pci_config_write_word(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint16_t value);
+void pci_config_write_byte(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint8_t value);
 
 bool pci_device_exists(uint8_t bus, uint8_t device, uint8_t function);
 
 void pci_read_device_info(uint8_t bus, uint8_t device, uint8_t function, pci_device *dev);
 
-uint32_t pci_get_bar_size(pci_device *dev, uint8_t bar_num);
+bool pci_bar_is_64bit(pci_device *dev, uint8_t bar_num);
+uint64_t pci_get_bar_address(pci_device *dev, uint8_t bar_num);
+uint64_t pci_get_bar_size(pci_device *dev, uint8_t bar_num);
 
 void pci_enable_bus_mastering(pci_device *dev);
 void pci_enable_memory_space(pci_device *dev);
 void pci_enable_io_space(pci_device *dev);
 
+uint8_t pci_find_capability(pci_device *dev, uint8_t cap_id);
+void pci_read_capabilities(pci_device *dev);
+bool pci_set_power_state(pci_device *dev, uint8_t state);
+
+bool pci_enable_msi(pci_device *dev, uint8_t vector, uint8_t apic_id);
+int pci_alloc_msi(pci_device *dev, int count, uint8_t apic_id, uint8_t *first_vector);
+bool pci_msi_route(pci_device *dev, uint8_t apic_id);
+bool pci_msi_single(pci_device *dev);
+int pci_alloc_msix(pci_device *dev, int count, uint8_t apic_id, uint8_t *vectors);
+bool pci_msix_route(pci_device *dev, uint16_t entry, uint8_t vector, uint8_t apic_id);
+void pci_msix_mask(pci_device *dev, uint16_t entry, bool masked);
+
 pci_device* pci_find_device(uint16_t vendor_id, uint16_t device_id);
 pci_device* pci_find_device_by_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if);
 
@@ -7,15 +7,27 @@
 // This is where you load the value to count.
 #define PIT_CHANNEL_0 0x40 
 
+// Channel 2 can be gated and read back through port 0x61 without an IRQ
+#define PIT_CHANNEL_2 0x42
+
 // I/O Port for sending mode/command instructions to PIT chip
 // This is where you define how to count.
 #define PIT_COMMAND 0x43 
 
+// Bit 0 gates channel 2, bit 1 connects it to the speaker, bit 5 is its OUT pin
+#define PIT_PORT_B 0x61
+#define PIT_PORT_B_GATE2 (1 << 0)
+#define PIT_PORT_B_SPEAKER (1 << 1)
+#define PIT_PORT_B_OUT2 (1 << 5)
+
 // The internal oscillator frequency is 1.193182 MHz. 
 // It is derived from the master clock of the original IBM PC (14.31818 MHz divided by 12).
 // This value is used to convert human-readable milliseconds into raw ticks.
 #define PIT_BASE_FREQ 1193182 
 
-void pit_wait(uint32_t ms);
+// Upper bound on the TSC rate, sizes the timeout of pit_measure_tsc
+#define PIT_MAX_TSC_HZ 10000000000ULL
+
+uint64_t pit_measure_tsc(uint16_t ticks);
 
 #endif
\ No newline at end of file
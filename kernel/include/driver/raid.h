@@ -0,0 +1,37 @@
+#ifndef RAID_H
+#define RAID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+#include "driver/ahci.h"
+
+#define RAID_MAX_MEMBERS 8
+
+// Dispatches a RAID device keeps in flight, each holds one slot per member
+#define RAID_MAX_INFLIGHT 32
+
+// Stripe unit bounds in sectors (4 KiB to 2 MiB), a power of two
+#define RAID0_MIN_CHUNK_SECTORS 8
+#define RAID0_MAX_CHUNK_SECTORS 4096
+#define RAID0_DEFAULT_CHUNK_SECTORS 128
+
+// Chunks one dispatch covers on each member, bounds the largest dispatch
+#define RAID0_CHUNKS_PER_CHILD 8
+
+// Level raid_init assembles over all SATA ports, EXTRA_CFLAGS=-DRAID_INIT_LEVEL=1 mirrors
+#ifndef RAID_INIT_LEVEL
+#define RAID_INIT_LEVEL 0
+#endif
+
+// A child gets one segment per chunk (one more when the dispatch starts
+// mid-chunk) and one per parent segment boundary inside its chunks
+#define RAID_CHILD_SEGMENTS (RAID0_CHUNKS_PER_CHILD + BLOCK_MAX_SEGMENTS)
+
+block_device *raid0_create(ahci_port **members, int count, uint32_t chunk_sectors);
+block_device *raid1_create(ahci_port **members, int count);
+void raid_init(void);
+void raid_print_stats(block_device *dev);
+void raid_benchmark(void);
+
+#endif
\ No newline at end of file
@@ -20,5 +20,6 @@ void serial_print(const char* str);
 void serial_print_hex(uint32_t value);
 void serial_print_hex8(uint8_t value);
 void serial_print_hex16(uint16_t value);
+void serial_print_dec(uint64_t value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,72 @@
+#ifndef IDT_H
+#define IDT_H
+
+#include <stdint.h>
+
+#define IDT_ENTRIES 256
+
+// Selector of the 64-bit code segment set up by stage2 (gdt64_code)
+#define KERNEL_CODE_SELECTOR 0x08
+
+// 0x8E: Present | Ring 0 | 64-bit interrupt gate (IF cleared on entry)
+#define IDT_INTERRUPT_GATE 0x8E
+
+// Vectors 0-31 are reserved for CPU exceptions
+#define IDT_EXCEPTION_COUNT 32
+
+// The legacy 8259 PICs are remapped here and masked, so a spurious
+// interrupt from them cannot be mistaken for a CPU exception.
+#define PIC_VECTOR_BASE 0x20
+
+// Vectors handed out to MSI/MSI-X by idt_alloc_vectors. Higher vectors
+// have higher priority at the LAPIC, the top is left to fixed users.
+#define IDT_IRQ_VECTOR_BASE 0x40
+#define IDT_IRQ_VECTOR_END 0xF0
+
+#define LAPIC_TIMER_VECTOR 0xF0
+#define SMP_WAKE_VECTOR 0xF1
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+typedef struct
+{
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t zero;
+} __attribute__((packed)) idt_entry;
+
+typedef struct
+{
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) idt_pointer;
+
+/**
+ * Register state pushed by the common stub in interrupts.asm, lowest
+ * address first. The CPU pushed everything from rip onwards.
+ */
+typedef struct
+{
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t error_code;
+    uint64_t rip;
+    uint64_t cs;
+    uint64_t rflags;
+    uint64_t rsp;
+    uint64_t ss;
+} interrupt_frame;
+
+typedef void (*interrupt_handler)(interrupt_frame *frame);
+
+void idt_init(void);
+void idt_register_handler(uint8_t vector, interrupt_handler handler);
+int idt_alloc_vectors(int count);
+void idt_free_vectors(uint8_t first, int count);
+void isr_dispatch(interrupt_frame *frame);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef KTIME_H
+#define KTIME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+// Assumed TSC rate until ktime_init has measured the real one
+#define KTIME_DEFAULT_TSC_HZ 1000000000ULL
+
+// Length of one calibration run, and how many runs to take the best of
+#define KTIME_CALIBRATE_MS 10
+#define KTIME_CALIBRATE_RUNS 3
+
+// CPUID 0x80000007 EDX: the TSC ticks at a constant rate in every P/C-state
+#define CPUID_INVARIANT_TSC (1 << 8)
+
+void ktime_init(void);
+uint64_t ktime_ns(void);
+uint64_t ktime_tsc_hz(void);
+uint64_t ktime_cycles_to_ns(uint64_t cycles);
+uint64_t ktime_ns_to_cycles(uint64_t ns);
+uint64_t ktime_ns_to_tsc(uint64_t ns);
+
+void ndelay(uint64_t ns);
+void udelay(uint64_t us);
+void mdelay(uint64_t ms);
+
+/**
+ * Timeouts are absolute ktime_ns values. Polling loops take a deadline
+ * once and compare against it, so a loop that does more work per
+ * iteration does not wait longer than one that does less.
+ */
+static inline uint64_t ktime_deadline(uint64_t timeout_ns)
+{
+    return ktime_ns() + timeout_ns;
+}
+
+static inline bool ktime_expired(uint64_t deadline)
+{
+    return ktime_ns() >= deadline;
+}
+
+#endif
\ No newline at end of file
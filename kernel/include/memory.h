@@ -4,9 +4,29 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define HUGE_PAGE_SIZE 0x200000
+
+// Caching behaviour of a mapping, selected through the PAT
+typedef enum
+{
+	MEM_WB,			// Write-back, normal RAM
+	MEM_WT,			// Write-through
+	MEM_WC,			// Write-combining, uncached but writes are buffered
+	MEM_UC_MINUS,	// Uncached, a write-combining MTRR can still override it
+	MEM_UC,			// Strongly uncached, device registers
+} mem_type;
+
+void mem_init(void);
+void mem_init_ap(void);
 void *memset(void *dest, int value, size_t count);
+void *memcpy(void *dest, const void *src, size_t count);
+void *memmove(void *dest, const void *src, size_t count);
+int memcmp(const void *a, const void *b, size_t count);
+void mem_benchmark(void);
+void map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags, mem_type type);
 void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
 void map_huge_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
-void map_mmio_region(uint64_t physical_addr, uint64_t size);
+void map_mmio_region(uint64_t physical_addr, uint64_t size, mem_type type);
+void map_ram_region(uint64_t physical_addr, uint64_t size, mem_type type);
 
 #endif
\ No newline at end of file
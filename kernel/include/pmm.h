@@ -0,0 +1,33 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PMM_PAGE_SIZE 4096
+#define PMM_PAGE_SHIFT 12
+
+// Order n is 2^n contiguous pages aligned to its own size, 4 KiB up to 4 MiB
+#define PMM_MAX_ORDER 10
+
+// Stage2 identity maps this much, memory above it is added once mapped
+#define PMM_BOOT_MAPPED 0x40000000ULL
+
+typedef struct
+{
+    uint64_t base;
+    uint64_t length;
+} pmm_region;
+
+void pmm_init(const pmm_region *regions, int count);
+void pmm_add_region(uint64_t base, uint64_t length);
+
+uint64_t pmm_alloc(unsigned int order);
+uint64_t pmm_alloc_below(unsigned int order, uint64_t limit);
+void pmm_free(uint64_t phys, unsigned int order);
+unsigned int pmm_order_for(size_t size);
+
+uint64_t pmm_free_pages(void);
+void pmm_print_stats(void);
+
+#endif
\ No newline at end of file
@@ -68,6 +68,12 @@ static inline uint32_t mmio_read32(uintptr_t base, uint32_t offset)
     return *((volatile uint32_t*)(base + offset));
 }
 
+static inline uint64_t mmio_read64(uintptr_t base, uint32_t offset)
+{
+    __asm__ __volatile__("" : : : "memory");
+    return *((volatile uint64_t*)(base + offset));
+}
+
 static inline void mmio_write32(uintptr_t base, uint32_t offset, uint32_t value)
 {
     // Writing to a volatile pointer ensures the 
@@ -79,4 +85,10 @@ static inline void mmio_write32(uintptr_t base, uint32_t offset, uint32_t value)
     __asm__ __volatile__("" : : : "memory");
 }
 
+static inline void mmio_write64(uintptr_t base, uint32_t offset, uint64_t value)
+{
+    *((volatile uint64_t*)(base + offset)) = value;
+    __asm__ __volatile__("" : : : "memory");
+}
+
 #endif
\ No newline at end of file
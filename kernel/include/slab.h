@@ -0,0 +1,59 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "spinlock.h"
+
+// kmalloc size classes are powers of two from 16 bytes up to 1 KiB
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 10
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// Slabs a named cache is sized for: it takes the smallest order holding this many objects
+#define KMEM_MIN_OBJECTS 8
+
+// Completely free slabs a cache keeps instead of returning them to the frame allocator
+#define KMEM_EMPTY_SLABS_KEPT 1
+
+typedef struct kmem_slab kmem_slab;
+typedef struct kmem_cache kmem_cache;
+
+/**
+ * A cache of equally sized objects. Slabs are blocks from the frame
+ * allocator, aligned to their own size, with this header at the start
+ * and the objects behind it, so finding an object's slab is a mask.
+ * Slabs with free objects sit on the partial list, the others on full.
+ */
+struct kmem_cache
+{
+	const char *name;
+	uint32_t object_size;		// Requested size rounded up to the alignment
+	uint32_t slab_order;
+	uint32_t objects_per_slab;
+	uint32_t first_offset;		// Where the first object starts within a slab
+	spinlock lock;				// Guards the slab lists and counters
+	kmem_slab *partial;
+	kmem_slab *full;
+	uint32_t empty_slabs;
+
+	uint64_t slabs;
+	uint64_t active_objects;
+	uint64_t allocs;
+	uint64_t frees;
+	kmem_cache *next;			// All caches, for statistics
+};
+
+void kmem_init(void);
+
+kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align);
+void *kmem_cache_alloc(kmem_cache *cache);
+void kmem_cache_free(kmem_cache *cache, void *object);
+
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+void kmem_print_stats(void);
+
+#endif
\ No newline at end of file
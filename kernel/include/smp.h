@@ -0,0 +1,61 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+#define SMP_MAX_CPUS 16
+
+// APs start in real mode at the SIPI vector times 4 KiB. This page sits
+// between the boot info block and the real mode stack, both long dead.
+#define SMP_TRAMPOLINE_BASE 0x2000
+
+// 16 KiB kernel stack per AP
+#define SMP_AP_STACK_ORDER 2
+
+// INIT-SIPI-SIPI timing from the Intel SDM (8.4.4.1)
+#define SMP_INIT_DELAY_MS 10
+#define SMP_SIPI_DELAY_US 200
+#define SMP_AP_TIMEOUT_MS 100
+
+// GS points at the running CPU's cpu_info
+#define IA32_GS_BASE_MSR 0xC0000101
+#define IA32_EFER_MSR 0xC0000080
+#define EFER_LMA (1 << 10)
+
+typedef void (*smp_work_fn)(void *arg);
+
+typedef struct cpu_info cpu_info;
+
+/**
+ * Per-CPU data area. Each CPU reaches its own through GS, so nothing
+ * here needs a lock unless another CPU touches it too, like the work
+ * slot smp_run_on fills in.
+ */
+struct cpu_info
+{
+    cpu_info *self;             // Must stay first, this_cpu() loads it from gs:0
+    uint32_t index;             // 0 is the BSP
+    uint8_t apic_id;
+    volatile bool online;
+    uint64_t stack;             // Base of the AP's stack, 0 on the BSP
+    spinlock work_lock;
+    smp_work_fn volatile work;  // Run by the idle loop, cleared when taken
+    void *work_arg;
+};
+
+static inline cpu_info *this_cpu(void)
+{
+    cpu_info *cpu;
+    __asm__ __volatile__("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void smp_init_bsp(void);
+void smp_init(void);
+uint32_t smp_cpu_count(void);
+cpu_info *smp_cpu(uint32_t index);
+int smp_run_on(uint32_t index, smp_work_fn fn, void *arg);
+
+#endif
\ No newline at end of file
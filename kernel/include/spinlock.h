@@ -0,0 +1,60 @@
+/**
+ * Once more than one CPU runs kernel code, masking interrupts only keeps
+ * the local CPU out. State shared between CPUs is guarded by these locks;
+ * the irqsave variants also keep out interrupt handlers on the local CPU,
+ * which would otherwise deadlock spinning on a lock their CPU holds.
+ */
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+typedef struct
+{
+    volatile uint32_t locked;
+} spinlock;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock_init(spinlock *lock)
+{
+    lock->locked = 0;
+}
+
+/**
+ * Test-and-test-and-set: while the lock is held, waiters only read it,
+ * so the cache line stays shared instead of bouncing between CPUs on
+ * every attempted XCHG.
+ */
+static inline void spin_lock(spinlock *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED) != 0)
+        {
+            __asm__ __volatile__("pause");
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock *lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock *lock)
+{
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock *lock, uint64_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Timers that can be pending at once, the heap is a fixed array
+#define TIMER_MAX_PENDING 256
+
+typedef struct ktimer ktimer;
+typedef void (*ktimer_callback)(ktimer *timer);
+
+/**
+ * A one-shot timeout. The owner keeps the memory and sets callback and
+ * ctx; a zeroed ktimer is a valid idle timer. The callback runs from the
+ * timer interrupt of the CPU that added it, with interrupts disabled,
+ * and may re-add its own timer.
+ */
+struct ktimer
+{
+    uint64_t deadline;          // ktime_ns at which it fires
+    ktimer_callback callback;
+    void *ctx;
+    uint32_t heap_pos;          // 1-based position in the heap, 0 when idle
+    uint32_t cpu;               // Index of the CPU whose heap holds it
+};
+
+void timer_init(void);
+void timer_init_ap(void);
+int timer_add(ktimer *timer, uint64_t deadline);
+bool timer_cancel(ktimer *timer);
+bool timer_pending(const ktimer *timer);
+uint32_t timer_count(void);
+
+#endif
\ No newline at end of file
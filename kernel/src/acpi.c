@@ -0,0 +1,174 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "acpi.h"
+#include "memory.h"
+#include "pmm.h"
+#include "driver/serial.h"
+
+static const acpi_sdt_header *acpi_root;
+
+// The XSDT holds 64-bit table pointers, the RSDT 32-bit ones
+static uint32_t acpi_entry_size;
+
+static bool acpi_checksum_ok(const void *data, uint32_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint8_t sum = 0;
+
+    for (uint32_t i = 0; i < length; i++)
+    {
+        sum += bytes[i];
+    }
+
+    return sum == 0;
+}
+
+/**
+ * @brief Makes sure a firmware range is mapped before reading it.
+ * Only RAM the allocator owns is mapped above the stage2 identity map,
+ * but tables usually sit in reclaimable regions, so map them on demand.
+ */
+static void acpi_map(uint64_t phys, uint64_t length)
+{
+    if (phys + length > PMM_BOOT_MAPPED)
+    {
+        map_ram_region(phys, length, MEM_WB);
+    }
+}
+
+/**
+ * @brief Maps a table and checks its length and checksum.
+ * @return The table, or NULL if it is corrupt.
+ */
+static const acpi_sdt_header *acpi_map_table(uint64_t phys)
+{
+    acpi_map(phys, sizeof(acpi_sdt_header));
+
+    const acpi_sdt_header *table = (const acpi_sdt_header *)(uintptr_t)phys;
+
+    if (table->length < sizeof(acpi_sdt_header))
+    {
+        return NULL;
+    }
+
+    acpi_map(phys, table->length);
+
+    return acpi_checksum_ok(table, table->length) ? table : NULL;
+}
+
+static const acpi_rsdp *acpi_scan(uint64_t start, uint64_t end)
+{
+    for (uint64_t addr = start; addr + sizeof(acpi_rsdp) <= end; addr += 16)
+    {
+        const acpi_rsdp *rsdp = (const acpi_rsdp *)(uintptr_t)addr;
+
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(rsdp, 20))
+        {
+            return rsdp;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Finds the RSDP and the root table it points to.
+ * Legacy BIOSes put the RSDP either in the first KiB of the EBDA or in
+ * the BIOS area below 1 MiB. The XSDT is preferred when the revision
+ * has one, it is the only root that can point above 4 GiB.
+ */
+void acpi_init(void)
+{
+    uint16_t ebda_segment;
+    const acpi_rsdp *rsdp = NULL;
+
+    // GCC treats pointers into the first page as null dereferences, so read the BDA in asm
+    __asm__ __volatile__("movw (%1), %0" : "=r"(ebda_segment) : "r"((uintptr_t)ACPI_EBDA_SEGMENT_PTR));
+
+    uint64_t ebda = (uint64_t)ebda_segment << 4;
+
+    acpi_root = NULL;
+
+    if (ebda != 0)
+    {
+        rsdp = acpi_scan(ebda, ebda + 1024);
+    }
+
+    if (rsdp == NULL)
+    {
+        rsdp = acpi_scan(ACPI_BIOS_AREA_START, ACPI_BIOS_AREA_END);
+    }
+
+    if (rsdp == NULL)
+    {
+        serial_print("ACPI: No RSDP found\n");
+        return;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0 && acpi_checksum_ok(rsdp, rsdp->length))
+    {
+        acpi_root = acpi_map_table(rsdp->xsdt_address);
+        acpi_entry_size = sizeof(uint64_t);
+    }
+
+    if (acpi_root == NULL)
+    {
+        acpi_root = acpi_map_table(rsdp->rsdt_address);
+        acpi_entry_size = sizeof(uint32_t);
+    }
+
+    if (acpi_root == NULL)
+    {
+        serial_print("ACPI: Root table is corrupt\n");
+        return;
+    }
+
+    serial_print(acpi_entry_size == sizeof(uint64_t) ? "ACPI: Using XSDT at " : "ACPI: Using RSDT at ");
+    serial_print_hex((uint32_t)(uintptr_t)acpi_root);
+    serial_print("\n");
+}
+
+/**
+ * @brief Looks up a table by its four character signature.
+ * @return The first valid table with that signature, or NULL.
+ */
+const acpi_sdt_header *acpi_find_table(const char *signature)
+{
+    if (acpi_root == NULL)
+    {
+        return NULL;
+    }
+
+    const uint8_t *entries = (const uint8_t *)acpi_root + sizeof(acpi_sdt_header);
+    uint32_t count = (acpi_root->length - sizeof(acpi_sdt_header)) / acpi_entry_size;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t phys = 0;
+
+        // Entries follow a 36 byte header, so XSDT pointers are unaligned
+        memcpy(&phys, entries + i * acpi_entry_size, acpi_entry_size);
+
+        if (phys == 0)
+        {
+            continue;
+        }
+
+        acpi_map(phys, sizeof(acpi_sdt_header));
+
+        if (memcmp(((const acpi_sdt_header *)(uintptr_t)phys)->signature, signature, 4) != 0)
+        {
+            continue;
+        }
+
+        const acpi_sdt_header *table = acpi_map_table(phys);
+
+        if (table != NULL)
+        {
+            return table;
+        }
+    }
+
+    return NULL;
+}
\ No newline at end of file
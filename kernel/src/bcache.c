@@ -0,0 +1,661 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bcache.h"
+#include "block.h"
+#include "memory.h"
+#include "pmm.h"
+#include "slab.h"
+#include "driver/serial.h"
+
+static kmem_cache *bcache_buf_cache;
+static uint64_t bcache_nr_buffers;
+static bcache_buf *bcache_hash_table[BCACHE_HASH_SIZE];
+
+// Most recently used at the head, eviction candidates at the tail
+static bcache_buf *lru_head;
+static bcache_buf *lru_tail;
+
+static uint64_t bcache_hits;
+static uint64_t bcache_misses;
+static uint64_t bcache_evictions;
+static uint64_t bcache_writebacks;
+static uint64_t bcache_readahead_blocks;
+
+/**
+ * @brief Spreads (device, block) keys over the hash buckets.
+ * Neighbouring blocks of one device are the common case, the
+ * multiplicative mix keeps them from piling into adjacent buckets.
+ */
+static uint32_t bcache_hash(block_device *dev, uint64_t block)
+{
+    uint64_t key = block ^ ((uint64_t)(uintptr_t)dev << 16);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (BCACHE_HASH_SIZE - 1);
+}
+
+static void lru_remove(bcache_buf *buf)
+{
+    if (buf->lru_prev != NULL)
+    {
+        buf->lru_prev->lru_next = buf->lru_next;
+    }
+    else
+    {
+        lru_head = buf->lru_next;
+    }
+
+    if (buf->lru_next != NULL)
+    {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    }
+    else
+    {
+        lru_tail = buf->lru_prev;
+    }
+}
+
+static void lru_push_front(bcache_buf *buf)
+{
+    buf->lru_prev = NULL;
+    buf->lru_next = lru_head;
+
+    if (lru_head != NULL)
+    {
+        lru_head->lru_prev = buf;
+    }
+    else
+    {
+        lru_tail = buf;
+    }
+
+    lru_head = buf;
+}
+
+static void lru_push_back(bcache_buf *buf)
+{
+    buf->lru_next = NULL;
+    buf->lru_prev = lru_tail;
+
+    if (lru_tail != NULL)
+    {
+        lru_tail->lru_next = buf;
+    }
+    else
+    {
+        lru_head = buf;
+    }
+
+    lru_tail = buf;
+}
+
+static void hash_insert(bcache_buf *buf)
+{
+    uint32_t bucket = bcache_hash(buf->dev, buf->block);
+
+    buf->hash_next = bcache_hash_table[bucket];
+    bcache_hash_table[bucket] = buf;
+}
+
+static void hash_remove(bcache_buf *buf)
+{
+    bcache_buf **link = &bcache_hash_table[bcache_hash(buf->dev, buf->block)];
+
+    while (*link != NULL && *link != buf)
+    {
+        link = &(*link)->hash_next;
+    }
+
+    if (*link != NULL)
+    {
+        *link = buf->hash_next;
+    }
+
+    buf->hash_next = NULL;
+}
+
+static bcache_buf *bcache_find(block_device *dev, uint64_t block)
+{
+    bcache_buf *buf = bcache_hash_table[bcache_hash(dev, block)];
+
+    while (buf != NULL && (buf->dev != dev || buf->block != block))
+    {
+        buf = buf->hash_next;
+    }
+
+    return buf;
+}
+
+/**
+ * @brief Hands a buffer's read or write-back to the block layer.
+ * The buffer is BUSY until bcache_io_wait has seen the result.
+ */
+static int bcache_io_submit(bcache_buf *buf, bool write)
+{
+    buf->req.lba = buf->block * BCACHE_BLOCK_SECTORS;
+    buf->req.count = buf->sectors;
+    buf->req.buf = buf->data;
+    buf->req.write = write;
+    buf->req.callback = NULL;
+    buf->req.ctx = buf;
+
+    if (block_submit(buf->dev, &buf->req) != 0)
+    {
+        return -1;
+    }
+
+    buf->flags |= BCACHE_BUSY;
+
+    return 0;
+}
+
+/**
+ * @brief Waits for a buffer's I/O and applies its outcome.
+ * A finished read makes the data valid, a finished write-back makes it
+ * clean. A failed write leaves the buffer dirty so it is retried later.
+ * @return 0 on success or if nothing was in flight, -1 on a device error.
+ */
+static int bcache_io_wait(bcache_buf *buf)
+{
+    if (!(buf->flags & BCACHE_BUSY))
+    {
+        return 0;
+    }
+
+    int result = block_wait(buf->dev, &buf->req);
+
+    buf->flags &= ~BCACHE_BUSY;
+
+    if (result != 0)
+    {
+        return -1;
+    }
+
+    if (buf->req.write)
+    {
+        buf->flags &= ~BCACHE_DIRTY;
+        bcache_writebacks++;
+    }
+    else
+    {
+        buf->flags |= BCACHE_VALID;
+    }
+
+    return 0;
+}
+
+static int bcache_io_sync(bcache_buf *buf, bool write)
+{
+    if (bcache_io_submit(buf, write) != 0)
+    {
+        return -1;
+    }
+
+    return bcache_io_wait(buf);
+}
+
+/**
+ * @brief Takes the least recently used buffer nobody holds.
+ * Dirty victims are written back first, this is the lazy half of the
+ * write-back policy. A victim whose write-back fails keeps its data
+ * and the search moves on to the next one. Readahead that finished
+ * without anyone waiting for it is reaped on the way.
+ * @return A detached buffer, or NULL if every buffer is in use.
+ */
+static bcache_buf *bcache_evict(void)
+{
+    for (bcache_buf *buf = lru_tail; buf != NULL; buf = buf->lru_prev)
+    {
+        if ((buf->flags & BCACHE_BUSY) && block_request_done(&buf->req))
+        {
+            bcache_io_wait(buf);
+        }
+
+        if (buf->refcount != 0 || (buf->flags & BCACHE_BUSY))
+        {
+            continue;
+        }
+
+        if ((buf->flags & BCACHE_DIRTY) && bcache_io_sync(buf, true) != 0)
+        {
+            continue;
+        }
+
+        if (buf->dev != NULL)
+        {
+            hash_remove(buf);
+
+            if (buf->flags & BCACHE_VALID)
+            {
+                bcache_evictions++;
+            }
+        }
+
+        buf->dev = NULL;
+        buf->flags = 0;
+
+        return buf;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Claims a buffer for a block that is not cached yet.
+ * The caller decides where it goes in the LRU and whether to read it.
+ */
+static bcache_buf *bcache_attach(block_device *dev, uint64_t block)
+{
+    bcache_buf *buf = bcache_evict();
+
+    if (buf == NULL)
+    {
+        serial_print("Warning: Buffer cache exhausted\n");
+        return NULL;
+    }
+
+    uint64_t left = dev->sectors - block * BCACHE_BLOCK_SECTORS;
+
+    buf->dev = dev;
+    buf->block = block;
+    buf->sectors = left < BCACHE_BLOCK_SECTORS ? (uint32_t)left : BCACHE_BLOCK_SECTORS;
+    hash_insert(buf);
+
+    return buf;
+}
+
+/**
+ * @brief Finds or allocates the buffer for a block and takes a reference.
+ * With fill set a miss starts reading the block but does not wait for it,
+ * so several holds can be batched before the first bcache_settle.
+ */
+static bcache_buf *bcache_hold(block_device *dev, uint64_t block, bool fill)
+{
+    bcache_buf *buf = bcache_find(dev, block);
+
+    if (buf != NULL)
+    {
+        bcache_hits++;
+    }
+    else
+    {
+        bcache_misses++;
+
+        buf = bcache_attach(dev, block);
+
+        if (buf == NULL)
+        {
+            return NULL;
+        }
+
+        if (fill)
+        {
+            bcache_io_submit(buf, false);
+        }
+    }
+
+    buf->refcount++;
+    lru_remove(buf);
+    lru_push_front(buf);
+
+    return buf;
+}
+
+/**
+ * @brief Waits for a held buffer's I/O and, with fill set, makes sure it
+ * ends up valid, reading it again if an earlier read failed.
+ * @return 0 on success, -1 on a device error.
+ */
+static int bcache_settle(bcache_buf *buf, bool fill)
+{
+    bcache_io_wait(buf);
+
+    if (fill && !(buf->flags & BCACHE_VALID))
+    {
+        return bcache_io_sync(buf, false);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Synchronous hold for callers working one block at a time.
+ * Without fill the caller is about to overwrite the whole block,
+ * reading it first would be wasted I/O.
+ */
+static bcache_buf *bcache_lookup(block_device *dev, uint64_t block, bool fill)
+{
+    if (block * BCACHE_BLOCK_SECTORS >= dev->sectors)
+    {
+        return NULL;
+    }
+
+    bcache_buf *buf = bcache_hold(dev, block, fill);
+
+    if (buf != NULL && bcache_settle(buf, fill) != 0)
+    {
+        bcache_release(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+/**
+ * @brief Starts asynchronous reads for the uncached blocks of a range.
+ * The buffers go in unreferenced at the recent end of the LRU, a reader
+ * that arrives later finds them in flight or already valid.
+ */
+static void bcache_prefetch(block_device *dev, uint64_t lba, uint32_t count)
+{
+    uint64_t last = (lba + count - 1) / BCACHE_BLOCK_SECTORS;
+
+    for (uint64_t block = lba / BCACHE_BLOCK_SECTORS; block <= last; block++)
+    {
+        if (bcache_find(dev, block) != NULL)
+        {
+            continue;
+        }
+
+        bcache_buf *buf = bcache_attach(dev, block);
+
+        if (buf == NULL)
+        {
+            return;
+        }
+
+        lru_remove(buf);
+        lru_push_front(buf);
+
+        if (bcache_io_submit(buf, false) == 0)
+        {
+            bcache_readahead_blocks++;
+        }
+    }
+}
+
+void bcache_init(void)
+{
+    lru_head = NULL;
+    lru_tail = NULL;
+
+    for (int i = 0; i < BCACHE_HASH_SIZE; i++)
+    {
+        bcache_hash_table[i] = NULL;
+    }
+
+    uint64_t wanted = pmm_free_pages() / BCACHE_MEMORY_SHARE;
+
+    if (wanted < BCACHE_MIN_BUFFERS)
+    {
+        wanted = BCACHE_MIN_BUFFERS;
+    }
+
+    bcache_buf_cache = kmem_cache_create("bcache_buf", sizeof(bcache_buf), sizeof(void *));
+    bcache_nr_buffers = 0;
+
+    while (bcache_buf_cache != NULL && bcache_nr_buffers < wanted)
+    {
+        bcache_buf *buf = kmem_cache_alloc(bcache_buf_cache);
+
+        if (buf == NULL)
+        {
+            break;
+        }
+
+        uint64_t data = pmm_alloc(pmm_order_for(BCACHE_BLOCK_SIZE));
+
+        if (data == 0)
+        {
+            kmem_cache_free(bcache_buf_cache, buf);
+            break;
+        }
+
+        buf->dev = NULL;
+        buf->data = data;
+        buf->refcount = 0;
+        buf->flags = 0;
+        buf->hash_next = NULL;
+        lru_push_back(buf);
+
+        bcache_nr_buffers++;
+    }
+
+    serial_print("Buffer cache: ");
+    serial_print_dec(bcache_nr_buffers);
+    serial_print(" buffers of ");
+    serial_print_dec(BCACHE_BLOCK_SIZE);
+    serial_print(" bytes\n");
+}
+
+/**
+ * @brief Returns a referenced buffer holding a block's current data.
+ * The buffer stays valid until bcache_release.
+ * @return The buffer, or NULL on a read error, past the device end or
+ * when every buffer is referenced.
+ */
+bcache_buf *bcache_get(block_device *dev, uint64_t block)
+{
+    return bcache_lookup(dev, block, true);
+}
+
+/**
+ * @brief Drops a reference. A buffer that failed to fill is retired at
+ * once so the next lookup retries the read instead of hitting it.
+ */
+void bcache_release(bcache_buf *buf)
+{
+    if (buf->refcount > 0)
+    {
+        buf->refcount--;
+    }
+
+    if (buf->refcount == 0 && !(buf->flags & (BCACHE_VALID | BCACHE_BUSY)))
+    {
+        hash_remove(buf);
+        buf->dev = NULL;
+        lru_remove(buf);
+        lru_push_back(buf);
+    }
+}
+
+/**
+ * @brief Records that the caller modified a held buffer.
+ * Nothing is written yet; that happens on eviction or bcache_flush.
+ */
+void bcache_mark_dirty(bcache_buf *buf)
+{
+    buf->flags |= BCACHE_VALID | BCACHE_DIRTY;
+}
+
+/**
+ * @brief Copies sectors from the cache, reading missing blocks from disk.
+ * The read also drives readahead: when the block layer sees a sequential
+ * stream, the next window is prefetched under the same plug as the
+ * blocks missing here, so it overlaps with the copy out.
+ * @return 0 on success, -1 if out of range or on a device error.
+ */
+int bcache_read(block_device *dev, uint64_t lba, uint32_t count, void *dest)
+{
+    if (count == 0 || lba + count > dev->sectors)
+    {
+        return -1;
+    }
+
+    uint64_t ra_lba;
+    uint32_t ra_count;
+    bool ahead = block_readahead(dev, lba, count, &ra_lba, &ra_count);
+
+    uint8_t *out = (uint8_t *)dest;
+    int result = 0;
+
+    while (count > 0 && result == 0)
+    {
+        bcache_buf *held[BCACHE_READ_BATCH];
+        uint64_t first = lba / BCACHE_BLOCK_SECTORS;
+        uint64_t last = (lba + count - 1) / BCACHE_BLOCK_SECTORS;
+        uint32_t nr = 0;
+
+        if (last - first >= BCACHE_READ_BATCH)
+        {
+            last = first + BCACHE_READ_BATCH - 1;
+        }
+
+        // Submit every missing block before waiting for any of them
+        block_plug(dev);
+
+        for (uint64_t block = first; block <= last; block++)
+        {
+            held[nr] = bcache_hold(dev, block, true);
+
+            if (held[nr] == NULL)
+            {
+                result = -1;
+                break;
+            }
+
+            nr++;
+        }
+
+        if (ahead)
+        {
+            bcache_prefetch(dev, ra_lba, ra_count);
+            ahead = false;
+        }
+
+        block_unplug(dev);
+
+        for (uint32_t i = 0; i < nr; i++)
+        {
+            bcache_buf *buf = held[i];
+
+            if (result == 0 && bcache_settle(buf, true) == 0)
+            {
+                uint32_t offset = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+                uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+
+                if (n > count)
+                {
+                    n = count;
+                }
+
+                memcpy(out, (const void *)(uintptr_t)(buf->data + offset * BLOCK_SECTOR_SIZE), n * BLOCK_SECTOR_SIZE);
+
+                out += n * BLOCK_SECTOR_SIZE;
+                lba += n;
+                count -= n;
+            }
+            else
+            {
+                result = -1;
+            }
+
+            bcache_release(buf);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Copies sectors into the cache and marks them dirty.
+ * Blocks that are only partly overwritten are read first.
+ * @return 0 on success, -1 if out of range or on a device error.
+ */
+int bcache_write(block_device *dev, uint64_t lba, uint32_t count, const void *src)
+{
+    if (count == 0 || lba + count > dev->sectors)
+    {
+        return -1;
+    }
+
+    const uint8_t *in = (const uint8_t *)src;
+
+    while (count > 0)
+    {
+        uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+        uint32_t offset = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+        uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+
+        if (n > count)
+        {
+            n = count;
+        }
+
+        // A short last block counts as whole once every sector it has is covered
+        bool whole = offset == 0 && (n == BCACHE_BLOCK_SECTORS || lba + n == dev->sectors);
+
+        bcache_buf *buf = bcache_lookup(dev, block, !whole);
+
+        if (buf == NULL)
+        {
+            return -1;
+        }
+
+        memcpy((void *)(uintptr_t)(buf->data + offset * BLOCK_SECTOR_SIZE), in, n * BLOCK_SECTOR_SIZE);
+        bcache_mark_dirty(buf);
+        bcache_release(buf);
+
+        in += n * BLOCK_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Writes back every dirty block of a device and flushes its cache.
+ * The write-backs are submitted under one plug so that runs of
+ * neighbouring dirty blocks merge into large commands. FLUSH CACHE EXT
+ * is only sent once they have all completed.
+ * @return 0 on success, -1 if any write-back or the flush failed.
+ */
+int bcache_flush(block_device *dev)
+{
+    int result = 0;
+
+    block_plug(dev);
+
+    for (bcache_buf *buf = lru_head; buf != NULL; buf = buf->lru_next)
+    {
+        if (buf->dev == dev && (buf->flags & BCACHE_DIRTY) && !(buf->flags & BCACHE_BUSY))
+        {
+            if (bcache_io_submit(buf, true) != 0)
+            {
+                result = -1;
+            }
+        }
+    }
+
+    block_unplug(dev);
+
+    for (bcache_buf *buf = lru_head; buf != NULL; buf = buf->lru_next)
+    {
+        if (buf->dev == dev && bcache_io_wait(buf) != 0)
+        {
+            result = -1;
+        }
+    }
+
+    if (block_flush(dev) != 0)
+    {
+        result = -1;
+    }
+
+    return result;
+}
+
+void bcache_print_stats(void)
+{
+    serial_print("Buffer cache: ");
+    serial_print_dec(bcache_hits);
+    serial_print(" hits, ");
+    serial_print_dec(bcache_misses);
+    serial_print(" misses, ");
+    serial_print_dec(bcache_evictions);
+    serial_print(" evictions, ");
+    serial_print_dec(bcache_writebacks);
+    serial_print(" writebacks, ");
+    serial_print_dec(bcache_readahead_blocks);
+    serial_print(" blocks read ahead\n");
+}
\ No newline at end of file
@@ -0,0 +1,626 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "block.h"
+#include "cpu.h"
+#include "slab.h"
+#include "driver/serial.h"
+
+static block_device *block_devices;
+static block_device *block_devices_tail;
+static int block_devices_registered;
+
+static kmem_cache *dispatch_cache;
+
+// A request larger than the device's max_sectors, issued as parts
+typedef struct
+{
+    block_request *parent;
+    volatile uint32_t pending;  // Parts still in flight
+    volatile bool failed;
+    block_request parts[];
+} block_split;
+
+void block_init(void)
+{
+    dispatch_cache = kmem_cache_create("block_dispatch", sizeof(block_dispatch), sizeof(void *));
+
+    block_devices = NULL;
+    block_devices_tail = NULL;
+    block_devices_registered = 0;
+}
+
+/**
+ * @brief Makes a driver's device visible to block layer clients.
+ * The driver fills in geometry, limits and ops; the queue state is reset here.
+ * @return The device index.
+ */
+int block_register(block_device *dev)
+{
+    dev->inflight = 0;
+    dev->plugged = 0;
+    dev->head_lba = 0;
+    dev->queue_head = NULL;
+    dev->queue_tail = NULL;
+    dev->backlog_head = NULL;
+    dev->backlog_tail = NULL;
+    dev->seq_next = 0;
+    dev->ra_window = 0;
+    dev->ra_end = 0;
+    dev->requests = 0;
+    dev->front_merges = 0;
+    dev->back_merges = 0;
+    dev->dispatches = 0;
+    dev->ra_sectors = 0;
+
+    dev->next = NULL;
+
+    if (block_devices_tail != NULL)
+    {
+        block_devices_tail->next = dev;
+    }
+    else
+    {
+        block_devices = dev;
+    }
+
+    block_devices_tail = dev;
+
+    serial_print("Block device ");
+    serial_print(dev->name);
+    serial_print(": ");
+    serial_print_dec(dev->sectors * BLOCK_SECTOR_SIZE / (1024 * 1024));
+    serial_print(dev->rotational ? " MiB, rotational, LBA sorted\n" : " MiB, non-rotational, FIFO\n");
+
+    return block_devices_registered++;
+}
+
+int block_device_count(void)
+{
+    return block_devices_registered;
+}
+
+block_device *block_get(int index)
+{
+    if (index < 0)
+    {
+        return NULL;
+    }
+
+    block_device *dev = block_devices;
+
+    for (int i = 0; dev != NULL && i < index; i++)
+    {
+        dev = dev->next;
+    }
+
+    return dev;
+}
+
+/**
+ * @brief Tries to fold a request into a queued dispatch.
+ * A back merge appends a request that starts where a dispatch ends, a
+ * front merge prepends one that ends where it starts. Both turn two ATA
+ * commands into one as long as the driver's size limits allow it.
+ */
+static bool block_try_merge(block_device *dev, block_request *req)
+{
+    for (block_dispatch *unit = dev->queue_head; unit != NULL; unit = unit->next)
+    {
+        if (unit->write != req->write || unit->nr_requests >= dev->max_segments ||
+            unit->count + req->count > dev->max_sectors)
+        {
+            continue;
+        }
+
+        if (unit->lba + unit->count == req->lba)
+        {
+            unit->tail->next = req;
+            unit->tail = req;
+            unit->count += req->count;
+            unit->nr_requests++;
+            dev->back_merges++;
+            return true;
+        }
+
+        if (req->lba + req->count == unit->lba)
+        {
+            req->next = unit->head;
+            unit->head = req;
+            unit->lba = req->lba;
+            unit->count += req->count;
+            unit->nr_requests++;
+            dev->front_merges++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Adds a new dispatch to the queue in elevator order.
+ * Rotational devices keep the queue sorted by LBA so dispatch can sweep
+ * across the platter. Solid state devices have no seek cost, for them
+ * arrival order is the fairest order.
+ */
+static void block_insert(block_device *dev, block_dispatch *unit)
+{
+    unit->next = NULL;
+
+    if (dev->queue_head == NULL)
+    {
+        dev->queue_head = unit;
+        dev->queue_tail = unit;
+        return;
+    }
+
+    if (!dev->rotational || unit->lba >= dev->queue_tail->lba)
+    {
+        dev->queue_tail->next = unit;
+        dev->queue_tail = unit;
+        return;
+    }
+
+    block_dispatch **link = &dev->queue_head;
+
+    while ((*link)->lba <= unit->lba)
+    {
+        link = &(*link)->next;
+    }
+
+    unit->next = *link;
+    *link = unit;
+}
+
+/**
+ * @brief Queues a request, merging it or giving it a dispatch of its own.
+ * @return false if no memory was left for a dispatch unit.
+ */
+static bool block_enqueue(block_device *dev, block_request *req)
+{
+    req->next = NULL;
+
+    if (block_try_merge(dev, req))
+    {
+        return true;
+    }
+
+    block_dispatch *unit = kmem_cache_alloc(dispatch_cache);
+
+    if (unit == NULL)
+    {
+        return false;
+    }
+
+    unit->dev = dev;
+    unit->lba = req->lba;
+    unit->count = req->count;
+    unit->write = req->write;
+    unit->nr_requests = 1;
+    unit->head = req;
+    unit->tail = req;
+
+    block_insert(dev, unit);
+
+    return true;
+}
+
+/**
+ * @brief Picks the next dispatch to hand to the driver.
+ * For rotational devices this is C-LOOK: the first dispatch at or after
+ * the head position, wrapping to the lowest LBA once the sweep runs out.
+ * Sweeping in one direction only keeps waiting times bounded at both ends.
+ */
+static block_dispatch *block_next(block_device *dev)
+{
+    block_dispatch **link = &dev->queue_head;
+    block_dispatch *prev = NULL;
+
+    if (dev->rotational)
+    {
+        while (*link != NULL && (*link)->lba < dev->head_lba)
+        {
+            prev = *link;
+            link = &(*link)->next;
+        }
+
+        if (*link == NULL)
+        {
+            link = &dev->queue_head;
+            prev = NULL;
+        }
+    }
+
+    block_dispatch *unit = *link;
+    *link = unit->next;
+
+    if (dev->queue_tail == unit)
+    {
+        dev->queue_tail = prev;
+    }
+
+    dev->head_lba = unit->lba + unit->count;
+
+    return unit;
+}
+
+static void block_finish(block_dispatch *unit, bool success)
+{
+    block_request *req = unit->head;
+
+    while (req != NULL)
+    {
+        // The callback may reuse the request, read the link first
+        block_request *next = req->next;
+
+        req->status = success ? BLOCK_DONE : BLOCK_ERROR;
+
+        if (req->callback != NULL)
+        {
+            req->callback(req);
+        }
+
+        req = next;
+    }
+
+    kmem_cache_free(dispatch_cache, unit);
+}
+
+static void block_kick(block_device *dev)
+{
+    while (dev->inflight < dev->max_inflight && dev->queue_head != NULL)
+    {
+        block_dispatch *unit = block_next(dev);
+
+        dev->inflight++;
+        dev->dispatches++;
+
+        if (dev->ops->submit(dev, unit) != 0)
+        {
+            dev->inflight--;
+            block_finish(unit, false);
+        }
+    }
+}
+
+static void block_queue_run(block_device *dev)
+{
+    if (dev->plugged == 0)
+    {
+        block_kick(dev);
+    }
+}
+
+static void block_split_done(block_request *part)
+{
+    block_split *split = (block_split *)part->ctx;
+
+    if (part->status != BLOCK_DONE)
+    {
+        split->failed = true;
+    }
+
+    // Parts on a RAID device complete on whichever CPU a member's
+    // interrupt is steered to, like raid_child_done
+    if (__atomic_sub_fetch(&split->pending, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    block_request *parent = split->parent;
+
+    parent->status = split->failed ? BLOCK_ERROR : BLOCK_DONE;
+    kfree(split);
+
+    if (parent->callback != NULL)
+    {
+        parent->callback(parent);
+    }
+}
+
+/**
+ * @brief Issues a request the driver cannot take in one dispatch.
+ * It is cut into max_sectors parts that are queued like any other
+ * request, the client's request completes when the last part does.
+ * @return 0 if the parts were queued, -1 if there was no memory for them.
+ */
+static int block_submit_split(block_device *dev, block_request *req)
+{
+    uint32_t nr_parts = (req->count + dev->max_sectors - 1) / dev->max_sectors;
+    block_split *split = kmalloc(sizeof(block_split) + nr_parts * sizeof(block_request));
+
+    if (split == NULL)
+    {
+        req->status = BLOCK_ERROR;
+        return -1;
+    }
+
+    split->parent = req;
+    split->pending = nr_parts;
+    split->failed = false;
+    req->status = BLOCK_PENDING;
+
+    for (uint32_t i = 0; i < nr_parts; i++)
+    {
+        block_request *part = &split->parts[i];
+        uint32_t offset = i * dev->max_sectors;
+
+        part->lba = req->lba + offset;
+        part->count = req->count - offset < dev->max_sectors ? req->count - offset : dev->max_sectors;
+        part->buf = req->buf + (uint64_t)offset * BLOCK_SECTOR_SIZE;
+        part->write = req->write;
+        part->callback = block_split_done;
+        part->ctx = split;
+
+        // Every part lies inside the validated request, so none is refused
+        block_submit(dev, part);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Queues a request on a device and returns without waiting.
+ * While the device is plugged or all its command slots are busy, requests
+ * collect in the queue where neighbours can merge before they are dispatched.
+ * Requests larger than the device's max_sectors are split into parts.
+ * @return 0 if the request was accepted, -1 if it is out of range or
+ * misaligned, or too large and there was no memory to split it.
+ */
+int block_submit(block_device *dev, block_request *req)
+{
+    if (req->count == 0 || req->lba + req->count > dev->sectors || (req->buf & 1))
+    {
+        req->status = BLOCK_ERROR;
+        return -1;
+    }
+
+    if (req->count > dev->max_sectors)
+    {
+        return block_submit_split(dev, req);
+    }
+
+    // Completions run from the interrupt handler and touch the same queue
+    uint64_t flags = irq_save();
+
+    req->status = BLOCK_PENDING;
+    dev->requests++;
+
+    // Once requests wait for a dispatch unit, later ones queue behind them
+    if (dev->backlog_head != NULL || !block_enqueue(dev, req))
+    {
+        req->next = NULL;
+
+        if (dev->backlog_tail != NULL)
+        {
+            dev->backlog_tail->next = req;
+        }
+        else
+        {
+            dev->backlog_head = req;
+        }
+
+        dev->backlog_tail = req;
+    }
+
+    block_queue_run(dev);
+
+    irq_restore(flags);
+
+    return 0;
+}
+
+/**
+ * @brief Called by the driver when a dispatch finishes.
+ * Completes every merged request, then retries the backlog now that
+ * a unit has been freed and dispatches more work.
+ */
+void block_complete(block_dispatch *unit, bool success)
+{
+    block_device *dev = unit->dev;
+
+    uint64_t flags = irq_save();
+
+    dev->inflight--;
+    block_finish(unit, success);
+
+    while (dev->backlog_head != NULL)
+    {
+        block_request *req = dev->backlog_head;
+        block_request *next = req->next;
+
+        if (!block_enqueue(dev, req))
+        {
+            break;
+        }
+
+        dev->backlog_head = next;
+
+        if (next == NULL)
+        {
+            dev->backlog_tail = NULL;
+        }
+    }
+
+    block_queue_run(dev);
+
+    irq_restore(flags);
+}
+
+bool block_request_done(block_request *req)
+{
+    return req->status != BLOCK_PENDING;
+}
+
+/**
+ * @brief Waits for a request, dispatching anything still held back.
+ * A plugged queue is started here too, waiting on it would never end.
+ * @return 0 on success, -1 on a device error.
+ */
+int block_wait(block_device *dev, block_request *req)
+{
+    while (!block_request_done(req))
+    {
+        uint64_t flags = irq_save();
+        block_kick(dev);
+        irq_restore(flags);
+
+        if (!block_request_done(req))
+        {
+            dev->ops->wait(dev);
+        }
+    }
+
+    return req->status == BLOCK_DONE ? 0 : -1;
+}
+
+/**
+ * @brief Asks the device to make completed writes durable.
+ * Only writes that have completed are covered; callers wait for their
+ * writes first. Devices without a volatile cache have no flush op.
+ * @return 0 on success, -1 on a device error.
+ */
+int block_flush(block_device *dev)
+{
+    if (dev->ops->flush == NULL)
+    {
+        return 0;
+    }
+
+    return dev->ops->flush(dev);
+}
+
+/**
+ * @brief Holds dispatch back while a caller submits a batch.
+ * Requests submitted between block_plug and block_unplug can merge with
+ * each other even when the device has idle command slots. Plugs nest.
+ */
+void block_plug(block_device *dev)
+{
+    uint64_t flags = irq_save();
+    dev->plugged++;
+    irq_restore(flags);
+}
+
+void block_unplug(block_device *dev)
+{
+    uint64_t flags = irq_save();
+
+    if (dev->plugged > 0)
+    {
+        dev->plugged--;
+    }
+
+    block_queue_run(dev);
+
+    irq_restore(flags);
+}
+
+/**
+ * @brief Feeds a read into the device's stream detector.
+ * A read that starts where the previous one ended opens a readahead
+ * window, or keeps it open; anything else halves it and closes it once
+ * it drops below the minimum. New readahead is only asked for when the
+ * reader has used up half of what is already in flight, and every such
+ * batch doubles the window so long scans quickly reach full size.
+ * @return true with the range to prefetch in ra_lba/ra_count, false if none.
+ */
+bool block_readahead(block_device *dev, uint64_t lba, uint32_t count, uint64_t *ra_lba, uint32_t *ra_count)
+{
+    uint64_t end = lba + count;
+    bool sequential = lba == dev->seq_next;
+
+    dev->seq_next = end;
+
+    if (!sequential)
+    {
+        dev->ra_window >>= 1;
+
+        if (dev->ra_window < BLOCK_RA_MIN_SECTORS)
+        {
+            dev->ra_window = 0;
+        }
+
+        dev->ra_end = end;
+        return false;
+    }
+
+    if (dev->ra_window == 0)
+    {
+        dev->ra_window = BLOCK_RA_MIN_SECTORS;
+    }
+    else if (dev->ra_end > end && dev->ra_end - end >= dev->ra_window / 2)
+    {
+        return false;
+    }
+
+    uint64_t start = dev->ra_end > end ? dev->ra_end : end;
+    uint64_t stop = end + dev->ra_window;
+
+    if (stop > dev->sectors)
+    {
+        stop = dev->sectors;
+    }
+
+    if (dev->ra_window < BLOCK_RA_MAX_SECTORS)
+    {
+        dev->ra_window <<= 1;
+    }
+
+    if (start >= stop)
+    {
+        return false;
+    }
+
+    dev->ra_end = stop;
+    dev->ra_sectors += stop - start;
+
+    *ra_lba = start;
+    *ra_count = (uint32_t)(stop - start);
+
+    return true;
+}
+
+static int block_rw(block_device *dev, uint64_t lba, uint32_t count, uint64_t buf, bool write)
+{
+    block_request req = {0};
+
+    req.lba = lba;
+    req.count = count;
+    req.buf = buf;
+    req.write = write;
+
+    if (block_submit(dev, &req) != 0)
+    {
+        return -1;
+    }
+
+    return block_wait(dev, &req);
+}
+
+int block_read(block_device *dev, uint64_t lba, uint32_t count, uint64_t buf)
+{
+    return block_rw(dev, lba, count, buf, false);
+}
+
+int block_write(block_device *dev, uint64_t lba, uint32_t count, uint64_t buf)
+{
+    return block_rw(dev, lba, count, buf, true);
+}
+
+void block_print_stats(block_device *dev)
+{
+    serial_print(dev->name);
+    serial_print(": ");
+    serial_print_dec(dev->requests);
+    serial_print(" requests, ");
+    serial_print_dec(dev->dispatches);
+    serial_print(" dispatched, ");
+    serial_print_dec(dev->front_merges);
+    serial_print(" front merges, ");
+    serial_print_dec(dev->back_merges);
+    serial_print(" back merges, ");
+    serial_print_dec(dev->ra_sectors);
+    serial_print(" sectors read ahead\n");
+}
\ No newline at end of file
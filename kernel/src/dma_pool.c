@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "dma_pool.h"
+#include "pmm.h"
+#include "driver/serial.h"
+
+/**
+ * @brief Carves a new slab into objects and puts them on the free list.
+ * Slabs are never given back; a pool only grows to its peak use.
+ * @return 0 on success, -1 if no memory below the pool's limit is left.
+ */
+static int dma_pool_grow(dma_pool *pool)
+{
+    uint64_t slab = pmm_alloc_below(pool->slab_order, pool->limit);
+
+    if (slab == 0)
+    {
+        return -1;
+    }
+
+    uint32_t count = (uint32_t)(((uint64_t)PMM_PAGE_SIZE << pool->slab_order) / pool->size);
+
+    // Link back to front so the pool hands out the slab in address order
+    for (uint32_t i = count; i > 0; i--)
+    {
+        uint64_t object = slab + (uint64_t)(i - 1) * pool->size;
+
+        *(uint64_t *)(uintptr_t)object = pool->free_head;
+        pool->free_head = object;
+    }
+
+    pool->slabs++;
+    pool->objects += count;
+    pool->objects_free += count;
+
+    return 0;
+}
+
+/**
+ * @brief Sets up a pool and reserves slabs for its expected use.
+ * @param align Power of two up to the page size.
+ * @param limit Objects are placed below it, DMA_LIMIT_32BIT for devices
+ * that cannot address more.
+ * @param reserve Objects to allocate slabs for right away.
+ * @return 0 on success, -1 if the reservation could not be met.
+ */
+int dma_pool_init(dma_pool *pool, const char *name, uint32_t size, uint32_t align, uint64_t limit, uint32_t reserve)
+{
+    // The free list link lives inside each object
+    if (size < sizeof(uint64_t))
+    {
+        size = sizeof(uint64_t);
+    }
+
+    pool->name = name;
+    pool->size = (size + align - 1) & ~(align - 1);
+    pool->slab_order = pmm_order_for((uint64_t)pool->size * DMA_POOL_SLAB_OBJECTS);
+    pool->limit = limit;
+    pool->free_head = 0;
+    pool->slabs = 0;
+    pool->objects = 0;
+    pool->objects_free = 0;
+    pool->allocs = 0;
+    pool->frees = 0;
+
+    // Very large objects get the biggest slab there is
+    if (pool->slab_order > PMM_MAX_ORDER)
+    {
+        pool->slab_order = PMM_MAX_ORDER;
+    }
+
+    while (pool->objects < reserve)
+    {
+        if (dma_pool_grow(pool) != 0)
+        {
+            serial_print("Warning: DMA pool ");
+            serial_print(name);
+            serial_print(" could not reserve its objects\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Takes an object off the free list, growing the pool if empty.
+ * The contents are undefined, callers clear what the device reads.
+ * @return The object's physical (identity mapped) address, or 0.
+ */
+uint64_t dma_pool_alloc(dma_pool *pool)
+{
+    if (pool->free_head == 0 && dma_pool_grow(pool) != 0)
+    {
+        return 0;
+    }
+
+    uint64_t object = pool->free_head;
+
+    pool->free_head = *(uint64_t *)(uintptr_t)object;
+    pool->objects_free--;
+    pool->allocs++;
+
+    return object;
+}
+
+void dma_pool_free(dma_pool *pool, uint64_t phys)
+{
+    *(uint64_t *)(uintptr_t)phys = pool->free_head;
+    pool->free_head = phys;
+    pool->objects_free++;
+    pool->frees++;
+}
+
+void dma_pool_print_stats(const dma_pool *pool)
+{
+    serial_print("DMA pool ");
+    serial_print(pool->name);
+    serial_print(": ");
+    serial_print_dec(pool->objects - pool->objects_free);
+    serial_print(" of ");
+    serial_print_dec(pool->objects);
+    serial_print(" objects in use, ");
+    serial_print_dec(pool->slabs);
+    serial_print(" slabs, ");
+    serial_print_dec(pool->allocs);
+    serial_print(" allocs, ");
+    serial_print_dec(pool->frees);
+    serial_print(" frees\n");
+}
\ No newline at end of file
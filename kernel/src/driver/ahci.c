@@ -0,0 +1,2497 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "kernel.h"
+#include "block.h"
+#include "cpu.h"
+#include "dma_pool.h"
+#include "slab.h"
+#include "idt.h"
+#include "ktime.h"
+#include "memory.h"
+#include "pmm.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "driver/ahci.h"
+#include "driver/apic.h"
+#include "driver/pci.h"
+#include "driver/serial.h"
+
+static HBA_MEM *hba;
+static pci_device *ahci_pci;
+static ahci_port ahci_ports[AHCI_MAX_PORTS];
+
+// Command lists, received FIS areas and command tables for every port
+static dma_pool ahci_list_pool;
+static dma_pool ahci_fis_pool;
+static dma_pool ahci_table_pool;
+
+// Number of command slots the HBA implements (CAP.NCS + 1).
+static uint8_t ahci_cmd_slots;
+static bool ahci_hba_ncq;
+
+// IS bit the HBA uses for the coalesced interrupt, and the ports it covers
+static uint8_t ahci_ccc_int;
+static uint32_t ahci_ccc_ports;
+
+// Vector of every MSI/MSI-X message and the IS bits it reports. With a
+// single message it stands for every port.
+static uint8_t ahci_msg_vector[AHCI_MAX_PORTS];
+static uint32_t ahci_msg_ports[AHCI_MAX_PORTS];
+static int ahci_msg_count;
+static bool ahci_msix;
+
+static uint64_t ahci_interrupts;
+static uint64_t ahci_ccc_interrupts;
+
+// IDENTIFY data lands here by DMA, the kernel is identity mapped.
+static uint16_t identify_buf[256];
+
+static HBA_CMD_HEADER *ahci_cmd_header(HBA_PORT *port, int slot)
+{
+    return (HBA_CMD_HEADER *)(uintptr_t)port->clb + slot;
+}
+
+static HBA_CMD_TBL *ahci_cmd_table(HBA_CMD_HEADER *header)
+{
+    return (HBA_CMD_TBL *)(uintptr_t)header->ctba;
+}
+
+static int ahci_count_slots(uint32_t mask)
+{
+    int count = 0;
+
+    // We build without libgcc, so __builtin_popcount is not available
+    while (mask)
+    {
+        mask &= mask - 1;
+        count++;
+    }
+
+    return count;
+}
+
+static uint64_t ata_identify_sectors(uint16_t *identify)
+{
+    return (uint64_t)identify[ATA_IDENT_LBA48_SECTORS] |
+           ((uint64_t)identify[ATA_IDENT_LBA48_SECTORS + 1] << 16) |
+           ((uint64_t)identify[ATA_IDENT_LBA48_SECTORS + 2] << 32) |
+           ((uint64_t)identify[ATA_IDENT_LBA48_SECTORS + 3] << 48);
+}
+
+static ahci_port *ahci_port_from_hba(HBA_PORT *port)
+{
+    return &ahci_ports[port - hba->ports];
+}
+
+ahci_port *ahci_get_port(int port_no)
+{
+    if (port_no < 0 || port_no >= AHCI_MAX_PORTS || !ahci_ports[port_no].present)
+    {
+        return NULL;
+    }
+
+    return &ahci_ports[port_no];
+}
+
+static int ahci_check_type(HBA_PORT *port)
+{
+    uint32_t ssts = port->ssts;
+    uint8_t ipm = (ssts >> 8) & 0x0F;
+    uint8_t det = ssts & 0x0F;
+
+    if (det != HBA_PORT_DET_PRESENT || ipm != HBA_PORT_IPM_ACTIVE)
+    {
+        return AHCI_DEV_NULL;
+    }
+
+    switch (port->sig)
+    {
+        case SATA_SIG_ATAPI:
+            return AHCI_DEV_SATAPI;
+        case SATA_SIG_SEMB:
+            return AHCI_DEV_SEMB;
+        case SATA_SIG_PM:
+            return AHCI_DEV_PM;
+        default:
+            return AHCI_DEV_SATA;
+    }
+}
+
+/**
+ * @brief Stops the command list and FIS receive engines of a port.
+ * The HBA owns PxCLB and PxFB while PxCMD.ST/FRE are set, so they must
+ * be stopped (and PxCMD.CR/FR observed clear) before rebasing or recovery.
+ */
+static void ahci_stop_cmd(HBA_PORT *port)
+{
+    port->cmd &= ~PxCMD_ST;
+    port->cmd &= ~PxCMD_FRE;
+
+    uint64_t deadline = ktime_deadline(AHCI_ENGINE_TIMEOUT_MS * NSEC_PER_MSEC);
+
+    while (!ktime_expired(deadline))
+    {
+        if (!(port->cmd & (PxCMD_FR | PxCMD_CR)))
+        {
+            return;
+        }
+    }
+
+    serial_print("AHCI: port engine did not stop\n");
+}
+
+static void ahci_start_cmd(HBA_PORT *port)
+{
+    // Wait until the previous command list run has fully wound down
+    uint64_t deadline = ktime_deadline(AHCI_ENGINE_TIMEOUT_MS * NSEC_PER_MSEC);
+
+    while ((port->cmd & PxCMD_CR) && !ktime_expired(deadline));
+
+    port->cmd |= PxCMD_FRE;
+    port->cmd |= PxCMD_ST;
+}
+
+/**
+ * @brief Gives the device time to accept a new command.
+ * A command may only be issued once the device has dropped BSY and DRQ
+ * in its task file, otherwise the HBA silently queues it behind garbage.
+ */
+static bool ahci_wait_ready(HBA_PORT *port)
+{
+    uint64_t deadline = ktime_deadline(AHCI_COMMAND_TIMEOUT_MS * NSEC_PER_MSEC);
+
+    while (!ktime_expired(deadline))
+    {
+        if (!(port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)))
+        {
+            return true;
+        }
+    }
+
+    serial_print("AHCI: port is hung\n");
+    return false;
+}
+
+/**
+ * @brief Brings a port back after a task file error.
+ * Any error aborts every outstanding queued command, so all busy slots are
+ * reported as failed. Stopping ST clears PxCI and PxSACT for us. PxCI must
+ * not be written while ST is off, so the free slots are held back and any
+ * submitter still writing its command gets to finish first.
+ */
+static void ahci_port_recover(ahci_port *ap)
+{
+    HBA_PORT *port = ap->port;
+    uint32_t held = __atomic_exchange_n(&ap->slots_free, 0, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&ap->slots_issuing, __ATOMIC_SEQ_CST) != 0)
+    {
+        __asm__ __volatile__("pause");
+    }
+
+    ahci_stop_cmd(port);
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    ahci_start_cmd(port);
+
+    __atomic_fetch_or(&ap->slots_failed, ap->slots_busy, __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&ap->slots_free, held, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Gives a port its command list, FIS area and command tables.
+ * Everything comes from the controller's DMA pools and stays with the
+ * port, so each slot's table is reused by every command issued on it
+ * and slots the port never uses get none. Called again once IDENTIFY
+ * has settled the queue depth to cover the extra NCQ slots.
+ * @return The number of slots from 0 up that have a command table.
+ */
+static int ahci_port_alloc(ahci_port *ap, int slots)
+{
+    if (ap->cmd_list == 0)
+    {
+        ap->cmd_list = dma_pool_alloc(&ahci_list_pool);
+    }
+
+    if (ap->fis_area == 0)
+    {
+        ap->fis_area = dma_pool_alloc(&ahci_fis_pool);
+    }
+
+    if (ap->cmd_list == 0 || ap->fis_area == 0)
+    {
+        return 0;
+    }
+
+    HBA_CMD_HEADER *header = (HBA_CMD_HEADER *)(uintptr_t)ap->cmd_list;
+
+    for (int slot = 0; slot < slots; slot++)
+    {
+        if (ap->cmd_tables[slot] != 0)
+        {
+            continue;
+        }
+
+        uint64_t ctba = dma_pool_alloc(&ahci_table_pool);
+
+        if (ctba == 0)
+        {
+            return slot;
+        }
+
+        memset((void *)(uintptr_t)ctba, 0, 128);
+        ap->cmd_tables[slot] = ctba;
+        header[slot].ctba = (uint32_t)ctba;
+        header[slot].ctbau = (uint32_t)(ctba >> 32);
+    }
+
+    return slots;
+}
+
+void ahci_rebase_port(HBA_PORT *port, int port_no)
+{
+    ahci_port *ap = &ahci_ports[port_no];
+
+    ahci_stop_cmd(port);
+
+    // The HBA reads the 1KB command list and writes the 256 byte FIS area
+    uint64_t clb = ap->cmd_list;
+    port->clb = (uint32_t)clb;
+    port->clbu = (uint32_t)(clb >> 32);
+    memset((void *)(uintptr_t)clb, 0, AHCI_CMD_LIST_SIZE);
+
+    uint64_t fb = ap->fis_area;
+    port->fb = (uint32_t)fb;
+    port->fbu = (uint32_t)(fb >> 32);
+    memset((void *)(uintptr_t)fb, 0, AHCI_FIS_SIZE);
+
+    HBA_CMD_HEADER *header = (HBA_CMD_HEADER *)(uintptr_t)clb;
+
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+    {
+        uint64_t ctba = ap->cmd_tables[slot];
+        header[slot].prdtl = 0;
+        header[slot].ctba = (uint32_t)ctba;
+        header[slot].ctbau = (uint32_t)(ctba >> 32);
+
+        if (ctba != 0)
+        {
+            memset((void *)(uintptr_t)ctba, 0, 128);
+        }
+    }
+
+    ahci_start_cmd(port);
+}
+
+/**
+ * @brief Claims a command slot without taking the port lock.
+ * slots_free only has bits below the queue depth, and a slot goes back
+ * into it once its completion was reaped. A queued command takes the
+ * lowest free bit with bsf and a locked and; a submitter that lost that
+ * bit to another CPU looks again. A non-queued command must have the
+ * device to itself, so it takes every slot at once or none at all and
+ * issues in slot 0.
+ * @return The slot to issue in, or -1 if none could be claimed.
+ */
+static int ahci_claim_slot(ahci_port *ap, bool exclusive)
+{
+    if (exclusive)
+    {
+        uint32_t all = ap->slots_all;
+
+        if (__atomic_compare_exchange_n(&ap->slots_free, &all, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            return 0;
+        }
+
+        return -1;
+    }
+
+    for (;;)
+    {
+        uint32_t free = __atomic_load_n(&ap->slots_free, __ATOMIC_ACQUIRE);
+
+        if (free == 0)
+        {
+            return -1;
+        }
+
+        int slot = __builtin_ctz(free);
+        uint32_t bit = 1U << slot;
+
+        if (__atomic_fetch_and(&ap->slots_free, ~bit, __ATOMIC_SEQ_CST) & bit)
+        {
+            return slot;
+        }
+
+        __atomic_fetch_add(&ap->slot_retries, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Gives back what ahci_claim_slot took for this slot
+static void ahci_release_slot(ahci_port *ap, int slot)
+{
+    uint32_t bit = 1U << slot;
+    uint32_t release = bit;
+
+    if (ap->slots_nonqueued & bit)
+    {
+        __atomic_fetch_and(&ap->slots_nonqueued, ~bit, __ATOMIC_RELAXED);
+        release = ap->slots_all;
+    }
+
+    __atomic_fetch_or(&ap->slots_free, release, __ATOMIC_SEQ_CST);
+}
+
+static void ahci_arm_timeout(ahci_port *ap)
+{
+    timer_add(&ap->timeout, ktime_ns() + AHCI_IO_TIMEOUT_MS * NSEC_PER_MSEC);
+}
+
+/**
+ * @brief Builds a command table's PRDT from a list of physical segments.
+ * Physically adjacent segments are merged into one entry and anything
+ * larger than 4MB (dbc holds byte count - 1 in 22 bits) is split, so a
+ * large or fragmented buffer still goes out as a single ATA command.
+ * Passing a NULL table only counts the entries the list would need.
+ * @return The number of PRDT entries, or -1 if a segment is misaligned or the list needs more than AHCI_MAX_PRDT.
+ */
+int ahci_build_prdt(HBA_CMD_TBL *table, const ahci_iovec *iov, int iovcnt)
+{
+    int entries = 0;
+    uint64_t start = 0;
+    uint64_t length = 0;
+
+    for (int i = 0; i <= iovcnt; i++)
+    {
+        // Extend the pending entry while segments stay contiguous
+        if (i < iovcnt)
+        {
+            if ((iov[i].phys | iov[i].len) & 1)
+            {
+                return -1;
+            }
+
+            if (length > 0 && start + length == iov[i].phys)
+            {
+                length += iov[i].len;
+                continue;
+            }
+        }
+
+        // Emit the pending run, then start a new one at this segment
+        while (length > 0)
+        {
+            if (entries >= AHCI_MAX_PRDT)
+            {
+                return -1;
+            }
+
+            uint64_t chunk = length > AHCI_PRDT_MAX_BYTES ? AHCI_PRDT_MAX_BYTES : length;
+
+            if (table != NULL)
+            {
+                HBA_PRDT_ENTRY *prd = &table->prdt_entry[entries];
+
+                prd->dba = (uint32_t)start;
+                prd->dbau = (uint32_t)(start >> 32);
+                prd->rsv0 = 0;
+                prd->dbc = (uint32_t)(chunk - 1);
+                prd->rsv1 = 0;
+                prd->i = 0;
+            }
+
+            entries++;
+            start += chunk;
+            length -= chunk;
+        }
+
+        if (i < iovcnt)
+        {
+            start = iov[i].phys;
+            length = iov[i].len;
+        }
+    }
+
+    return entries;
+}
+
+static int ahci_request_prdt(HBA_CMD_TBL *table, ahci_request *req)
+{
+    if (req->iov != NULL)
+    {
+        return ahci_build_prdt(table, req->iov, req->iovcnt);
+    }
+
+    ahci_iovec seg = { req->buf, req->count * AHCI_SECTOR_SIZE };
+    return ahci_build_prdt(table, &seg, 1);
+}
+
+/**
+ * @brief Builds and issues one request without waiting for it.
+ * With NCQ the command is READ/WRITE FPDMA QUEUED: the sector count moves
+ * to the feature registers and the slot number becomes the queue tag in
+ * count bits 7:3. The slot is marked in PxSACT before PxCI, as the spec
+ * requires, so the HBA tracks it until the device posts a Set Device Bits FIS.
+ * Without NCQ we fall back to READ/WRITE DMA EXT at queue depth 1.
+ *
+ * Runs without the port lock. The claimed slot's command table is ours
+ * alone, and while the slot is marked in slots_issuing the reaper leaves
+ * it alone even though PxCI does not show it yet. If the device never
+ * becomes ready the command is not sent: the slot is marked busy and
+ * failed without writing PxCI, so the reaper fails the request and hands
+ * the slots back under the port lock, where no recovery can be running.
+ * @return The slot the command was issued in, or -1 if none is free.
+ */
+static int ahci_issue(ahci_port *ap, ahci_request *req)
+{
+    HBA_PORT *port = ap->port;
+    bool queued = ap->ncq && !req->flush;
+
+    // A device must never see queued and non-queued commands at once:
+    // a flush waits for the queue to drain, and blocks it until done.
+    int slot = ahci_claim_slot(ap, !queued);
+
+    if (slot == -1)
+    {
+        return -1;
+    }
+
+    uint32_t bit = 1U << slot;
+
+    __atomic_fetch_or(&ap->slots_issuing, bit, __ATOMIC_SEQ_CST);
+
+    HBA_CMD_HEADER *header = ahci_cmd_header(port, slot);
+    HBA_CMD_TBL *table = ahci_cmd_table(header);
+
+    header->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+    header->w = req->write ? 1 : 0;
+    header->prdtl = req->flush ? 0 : (uint16_t)ahci_request_prdt(table, req);
+    header->prdbc = 0;
+
+    FIS_REG_H2D *fis = (FIS_REG_H2D *)table->cfis;
+    memset(fis, 0, sizeof(FIS_REG_H2D));
+
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->c = 1;
+
+    if (req->flush)
+    {
+        fis->command = ATA_CMD_FLUSH_CACHE_EXT;
+    }
+    else
+    {
+        fis->device = ATA_DEVICE_LBA;
+
+        fis->lba0 = (uint8_t)req->lba;
+        fis->lba1 = (uint8_t)(req->lba >> 8);
+        fis->lba2 = (uint8_t)(req->lba >> 16);
+        fis->lba3 = (uint8_t)(req->lba >> 24);
+        fis->lba4 = (uint8_t)(req->lba >> 32);
+        fis->lba5 = (uint8_t)(req->lba >> 40);
+    }
+
+    // A count of 65536 is encoded as 0 in both command forms
+    if (queued)
+    {
+        fis->command = req->write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        fis->featurel = (uint8_t)req->count;
+        fis->featureh = (uint8_t)(req->count >> 8);
+        fis->countl = (uint8_t)(slot << 3);
+    }
+    else
+    {
+        if (!req->flush)
+        {
+            fis->command = req->write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
+            fis->countl = (uint8_t)req->count;
+            fis->counth = (uint8_t)(req->count >> 8);
+        }
+
+        __atomic_fetch_or(&ap->slots_nonqueued, bit, __ATOMIC_RELAXED);
+    }
+
+    // Non-queued commands must not be sent while the device is busy
+    bool ready = queued || ahci_wait_ready(port);
+
+    if (ready)
+    {
+        __atomic_fetch_and(&ap->slots_failed, ~bit, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_or(&ap->slots_failed, bit, __ATOMIC_RELAXED);
+    }
+
+    ap->slot_req[slot] = req;
+    ap->slot_issued[slot] = ktime_ns();
+    __atomic_fetch_or(&ap->slots_busy, bit, __ATOMIC_SEQ_CST);
+
+    // PxSACT and PxCI only set the bits written, other CPUs' slots are safe
+    if (ready)
+    {
+        if (queued)
+        {
+            port->sact = bit;
+        }
+
+        port->ci = bit;
+    }
+
+    __atomic_fetch_and(&ap->slots_issuing, ~bit, __ATOMIC_SEQ_CST);
+
+    // One timer per port, only ever armed for the oldest command
+    if (!timer_pending(&ap->timeout))
+    {
+        ahci_arm_timeout(ap);
+    }
+
+    return slot;
+}
+
+/**
+ * @brief Collects every slot that finished since the last call.
+ * A queued command is done once its PxSACT bit is cleared by the device,
+ * a non-queued one once its PxCI bit is cleared by the HBA. A slot we
+ * issued with neither bit set has therefore completed. PxIS is cleared
+ * on every path, polled or not, so stale status never masks a new MSI.
+ * Called with the port locked; the slots stay claimed until the caller
+ * is done with their request and releases them.
+ * @return Bitmask of reaped slots; failed ones are also set in slots_failed.
+ */
+static uint32_t ahci_port_reap(ahci_port *ap)
+{
+    HBA_PORT *port = ap->port;
+
+    // Acknowledge before reading PxSACT/PxCI: a completion that lands
+    // after this point sets PxIS again and raises a fresh interrupt.
+    uint32_t is = port->is;
+    port->is = is;
+
+    if (is & PxIS_TFES)
+    {
+        serial_print("AHCI: task file error on port ");
+        serial_print_hex8((uint8_t)ap->port_no);
+        serial_print("\n");
+        ahci_port_recover(ap);
+    }
+
+    // Busy first, issuing second, hardware last: a slot seen busy here is
+    // either still marked issuing or had PxCI written before we read it
+    uint32_t busy = __atomic_load_n(&ap->slots_busy, __ATOMIC_SEQ_CST);
+    uint32_t issuing = __atomic_load_n(&ap->slots_issuing, __ATOMIC_SEQ_CST);
+    uint32_t done = busy & ~issuing & ~(port->sact | port->ci);
+
+    __atomic_fetch_and(&ap->slots_busy, ~done, __ATOMIC_SEQ_CST);
+    ap->commands_completed += ahci_count_slots(done);
+
+    return done;
+}
+
+/**
+ * @brief Appends a request to the port's submission ring without locking.
+ * A bounded multi-producer queue after Dmitry Vyukov's: the cell for
+ * position pos is free for a producer while its seq equals pos, and
+ * holds a request for the consumer once seq is pos + 1. Producers only
+ * compete for ring_head, a loser retries at the position it lost to.
+ * @return false if the ring is full.
+ */
+static bool ahci_ring_push(ahci_port *ap, ahci_request *req)
+{
+    uint32_t pos = __atomic_load_n(&ap->ring_head, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        ahci_ring_cell *cell = &ap->ring[pos & (AHCI_RING_SIZE - 1)];
+        int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff < 0)
+        {
+            return false;
+        }
+
+        if (diff == 0)
+        {
+            // On failure pos is reloaded with the current head
+            if (__atomic_compare_exchange_n(&ap->ring_head, &pos, pos + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->req = req;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+                return true;
+            }
+        }
+        else
+        {
+            pos = __atomic_load_n(&ap->ring_head, __ATOMIC_RELAXED);
+        }
+
+        __atomic_fetch_add(&ap->ring_retries, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// The single consumer runs under the port lock, ring_tail is its own
+static ahci_request *ahci_ring_peek(ahci_port *ap)
+{
+    ahci_ring_cell *cell = &ap->ring[ap->ring_tail & (AHCI_RING_SIZE - 1)];
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != ap->ring_tail + 1)
+    {
+        return NULL;
+    }
+
+    return cell->req;
+}
+
+static void ahci_ring_pop(ahci_port *ap)
+{
+    ahci_ring_cell *cell = &ap->ring[ap->ring_tail & (AHCI_RING_SIZE - 1)];
+
+    __atomic_store_n(&cell->seq, ap->ring_tail + AHCI_RING_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&ap->ring_tail, ap->ring_tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool ahci_queue_empty(ahci_port *ap)
+{
+    return __atomic_load_n(&ap->ring_head, __ATOMIC_SEQ_CST) == __atomic_load_n(&ap->ring_tail, __ATOMIC_SEQ_CST) &&
+           __atomic_load_n(&ap->wait_head, __ATOMIC_SEQ_CST) == NULL;
+}
+
+/**
+ * @brief Parks a request that found no free slot.
+ * It goes into the ring unless that is full or something already
+ * overflowed, in which case it joins the locked overflow list so it
+ * cannot overtake what is queued there.
+ */
+static void ahci_queue_push(ahci_port *ap, ahci_request *req)
+{
+    if (__atomic_load_n(&ap->wait_head, __ATOMIC_SEQ_CST) == NULL && ahci_ring_push(ap, req))
+    {
+        return;
+    }
+
+    __atomic_fetch_add(&ap->ring_spills, 1, __ATOMIC_RELAXED);
+
+    spin_lock(&ap->lock);
+
+    if (ap->wait_tail != NULL)
+    {
+        ap->wait_tail->next = req;
+    }
+    else
+    {
+        __atomic_store_n(&ap->wait_head, req, __ATOMIC_SEQ_CST);
+    }
+
+    ap->wait_tail = req;
+
+    spin_unlock(&ap->lock);
+}
+
+/**
+ * @brief Moves waiting requests into slots as they become free.
+ * Runs with the port locked, as the ring's only consumer. The ring is
+ * drained before the overflow list, which only fills while the ring is
+ * full. We stop at the first request that does not fit rather than
+ * letting later ones overtake it.
+ */
+static void ahci_start_waiting(ahci_port *ap)
+{
+    for (;;)
+    {
+        ahci_request *req = ahci_ring_peek(ap);
+        bool from_ring = req != NULL;
+
+        if (!from_ring)
+        {
+            req = ap->wait_head;
+        }
+
+        if (req == NULL || ahci_issue(ap, req) == -1)
+        {
+            return;
+        }
+
+        if (from_ring)
+        {
+            ahci_ring_pop(ap);
+            continue;
+        }
+
+        __atomic_store_n(&ap->wait_head, req->next, __ATOMIC_SEQ_CST);
+
+        if (ap->wait_head == NULL)
+        {
+            ap->wait_tail = NULL;
+        }
+    }
+}
+
+/**
+ * @brief Checks a request before it is queued.
+ * Rejects what can never fit a command table here, so that ahci_issue
+ * only returns -1 for lack of a free slot. A device that stays busy
+ * fails the request from its slot instead, see ahci_issue.
+ * @return 0 if the request can be issued, -1 if it is malformed.
+ */
+static int ahci_validate(ahci_port *ap, ahci_request *req)
+{
+    if (req->flush)
+    {
+        req->write = false;
+    }
+    else if (req->count == 0 || req->count > AHCI_MAX_SECTORS || req->lba + req->count > ap->sectors)
+    {
+        req->status = AHCI_REQ_ERROR;
+        return -1;
+    }
+
+    if (req->flush)
+    {
+        // No data phase, nothing to validate
+    }
+    else if (req->iov != NULL)
+    {
+        uint64_t bytes = 0;
+
+        for (int i = 0; i < req->iovcnt; i++)
+        {
+            bytes += req->iov[i].len;
+        }
+
+        if (bytes != (uint64_t)req->count * AHCI_SECTOR_SIZE)
+        {
+            req->status = AHCI_REQ_ERROR;
+            return -1;
+        }
+    }
+
+    if (!req->flush && ahci_request_prdt(NULL, req) < 0)
+    {
+        req->status = AHCI_REQ_ERROR;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Completes finished requests and refills the freed slots.
+ * Runs both from ahci_poll and from the interrupt handler, with the port
+ * locked. Callbacks run from here with interrupts disabled and the lock
+ * dropped, so they may submit follow-up requests but must not wait for
+ * them.
+ * @return The number of requests completed by this call.
+ */
+static int ahci_complete(ahci_port *ap, bool from_irq)
+{
+    uint32_t done = ahci_port_reap(ap);
+    uint64_t now = ktime_ns();
+    int completed = 0;
+
+    for (int slot = 0; done != 0; slot++, done >>= 1)
+    {
+        if (!(done & 1))
+        {
+            continue;
+        }
+
+        ahci_request *req = ap->slot_req[slot];
+        bool failed = (ap->slots_failed & (1U << slot)) != 0;
+        uint64_t service = now - ap->slot_issued[slot];
+
+        // Everything about the slot is read, submitters may have it back
+        ap->slot_req[slot] = NULL;
+        ahci_release_slot(ap, slot);
+
+        if (req == NULL)
+        {
+            continue;
+        }
+
+        req->status = failed ? AHCI_REQ_ERROR : AHCI_REQ_DONE;
+        completed++;
+
+        // Moving average with weight 1/8 follows the device without
+        // letting a single slow command blow up the poll window.
+        ap->service_ns = ap->service_ns - (ap->service_ns >> 3) + (service >> 3);
+
+        if (req->callback != NULL)
+        {
+            spin_unlock(&ap->lock);
+            req->callback(req);
+            spin_lock(&ap->lock);
+        }
+    }
+
+    if (from_irq)
+    {
+        ap->irq_completions += completed;
+    }
+    else
+    {
+        ap->poll_completions += completed;
+    }
+
+    ahci_start_waiting(ap);
+
+    // A waiting request whose device never became ready sits failed in a
+    // slot the HBA never saw, complete it now rather than at the timeout
+    uint32_t unsent = ap->slots_busy & ap->slots_failed & ~ap->slots_issuing & ~(ap->port->sact | ap->port->ci);
+
+    if (unsent != 0)
+    {
+        completed += ahci_complete(ap, from_irq);
+    }
+
+    // An idle port keeps no timer pending. A submitter issuing at the same
+    // time either finds the timer cancelled or is seen busy here.
+    if (__atomic_load_n(&ap->slots_busy, __ATOMIC_SEQ_CST) == 0)
+    {
+        timer_cancel(&ap->timeout);
+
+        if (__atomic_load_n(&ap->slots_busy, __ATOMIC_SEQ_CST) != 0 && !timer_pending(&ap->timeout))
+        {
+            ahci_arm_timeout(ap);
+        }
+    }
+
+    return completed;
+}
+
+/**
+ * @brief Aborts the port's commands once the oldest has run too long.
+ * The timer is armed for the oldest command at issue time. When it fires
+ * that command may long be done, so finished slots are reaped first and
+ * the timer moves on to whichever command is now the oldest. Only when
+ * that one is overdue is the port recovered, which fails every busy slot.
+ */
+static void ahci_timeout(ktimer *timer)
+{
+    ahci_port *ap = (ahci_port *)timer->ctx;
+
+    spin_lock(&ap->lock);
+    ahci_complete(ap, false);
+
+    if (ap->slots_busy == 0)
+    {
+        spin_unlock(&ap->lock);
+        return;
+    }
+
+    uint64_t oldest = ~0ULL;
+
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+    {
+        if ((ap->slots_busy & (1U << slot)) && ap->slot_issued[slot] < oldest)
+        {
+            oldest = ap->slot_issued[slot];
+        }
+    }
+
+    uint64_t deadline = oldest + AHCI_IO_TIMEOUT_MS * NSEC_PER_MSEC;
+
+    if (!ktime_expired(deadline))
+    {
+        timer_add(timer, deadline);
+        spin_unlock(&ap->lock);
+        return;
+    }
+
+    serial_print("AHCI: command timeout on port ");
+    serial_print_hex8((uint8_t)ap->port_no);
+    serial_print("\n");
+
+    ap->timeouts++;
+    ahci_port_recover(ap);
+    ahci_complete(ap, false);
+
+    spin_unlock(&ap->lock);
+}
+
+/**
+ * @brief Queues a request on a port and returns without waiting for it.
+ * The request is issued straight away if a command slot is free and
+ * otherwise parked in the port's submission ring until a completion
+ * frees one. Neither path takes the port lock, so CPUs submitting to
+ * the same port do not wait for each other. The request and its buffer
+ * must stay valid until it completes.
+ * @return 0 if the request was accepted, -1 if it is malformed.
+ */
+int ahci_submit(ahci_port *ap, ahci_request *req)
+{
+    if (ahci_validate(ap, req) != 0)
+    {
+        return -1;
+    }
+
+    req->status = AHCI_REQ_PENDING;
+    req->next = NULL;
+
+    // Our own completion interrupt must not spin on a lock taken below
+    uint64_t flags = irq_save();
+
+    // Keep submission order: only bypass the queue when nothing waits
+    if (ahci_queue_empty(ap))
+    {
+        int slot = ahci_issue(ap, req);
+
+        if (slot != -1)
+        {
+            __atomic_fetch_add(&ap->direct_issues, 1, __ATOMIC_RELAXED);
+
+            // A completion that arrived while the slot was still marked
+            // issuing was skipped by the reaper, and its interrupt is spent
+            if (!((ap->port->sact | ap->port->ci) & (1U << slot)))
+            {
+                spin_lock(&ap->lock);
+                ahci_complete(ap, false);
+                spin_unlock(&ap->lock);
+            }
+
+            irq_restore(flags);
+            return 0;
+        }
+    }
+
+    ahci_queue_push(ap, req);
+
+    // A completion that freed a slot just before the push found the
+    // queue empty, nobody else would issue this request
+    if (__atomic_load_n(&ap->slots_free, __ATOMIC_SEQ_CST) != 0)
+    {
+        spin_lock(&ap->lock);
+        ahci_start_waiting(ap);
+        spin_unlock(&ap->lock);
+    }
+
+    irq_restore(flags);
+
+    return 0;
+}
+
+int ahci_poll(ahci_port *ap)
+{
+    uint64_t flags = spin_lock_irqsave(&ap->lock);
+    int completed = ahci_complete(ap, false);
+    spin_unlock_irqrestore(&ap->lock, flags);
+
+    return completed;
+}
+
+bool ahci_request_done(ahci_request *req)
+{
+    return req->status != AHCI_REQ_PENDING;
+}
+
+static void ahci_write_ie(ahci_port *ap)
+{
+    // Ports under CCC only report errors themselves, their completions
+    // arrive through the coalesced interrupt
+    if (!ap->irq_armed)
+    {
+        ap->port->ie = 0;
+    }
+    else
+    {
+        ap->port->ie = ap->ccc ? AHCI_PxIE_ERRORS : AHCI_PxIE_DEFAULT;
+    }
+}
+
+static void ahci_arm_irq(ahci_port *ap, bool armed)
+{
+    if (ap->irq_armed != armed)
+    {
+        ap->irq_armed = armed;
+        ahci_write_ie(ap);
+    }
+}
+
+/**
+ * @brief Spins on the port for about the time a command usually takes.
+ * For small transfers on fast devices the command is often done before
+ * an interrupt could even be delivered. The window is twice the observed
+ * average service time, capped so a slow device cannot turn this into
+ * the busy wait it replaces.
+ */
+static void ahci_poll_window(ahci_port *ap, ahci_request *req)
+{
+    uint64_t window = ap->service_ns * 2;
+
+    if (window > AHCI_POLL_WINDOW_MAX_NS)
+    {
+        window = AHCI_POLL_WINDOW_MAX_NS;
+    }
+
+    ahci_arm_irq(ap, false);
+
+    uint64_t deadline = ktime_deadline(window);
+
+    while (!ahci_request_done(req) && !ktime_expired(deadline))
+    {
+        ahci_complete(ap, false);
+    }
+
+    // Re-arm even if req finished, requests nobody waits on still need
+    // their interrupt; reap what completed while PxIE was off
+    ahci_arm_irq(ap, true);
+    ahci_complete(ap, false);
+}
+
+/**
+ * @brief Waits until a particular request completes.
+ * How depends on the port's completion mode: POLL spins on PxCI/PxSACT,
+ * IRQ halts the CPU until the MSI, and ADAPTIVE first polls for a short
+ * window and only then arms PxIE and halts. The completion check runs
+ * with interrupts off so a completion landing between the check and the
+ * HLT still wakes us. Without interrupts we always poll, and so does a
+ * CPU the port's interrupt is not delivered to.
+ * @return 0 on success, -1 on a device error.
+ */
+int ahci_wait(ahci_port *ap, ahci_request *req)
+{
+    uint64_t flags = spin_lock_irqsave(&ap->lock);
+    bool can_sleep = ap->mode != AHCI_COMPLETION_POLL && ap->irq_capable && (flags & RFLAGS_IF) &&
+                     ap->cpu == this_cpu()->index;
+
+    if (can_sleep && ap->mode == AHCI_COMPLETION_ADAPTIVE)
+    {
+        ahci_poll_window(ap, req);
+    }
+
+    while (!ahci_request_done(req))
+    {
+        if (!can_sleep)
+        {
+            ahci_complete(ap, false);
+            continue;
+        }
+
+        // Anything that finished while PxIE was off raised no interrupt
+        ahci_arm_irq(ap, true);
+        ahci_complete(ap, false);
+
+        // Interrupts stay off until the HLT, so the lock can go first
+        if (!ahci_request_done(req))
+        {
+            ap->sleeps++;
+            spin_unlock(&ap->lock);
+            cpu_idle();
+            spin_lock(&ap->lock);
+        }
+    }
+
+    spin_unlock_irqrestore(&ap->lock, flags);
+
+    return req->status == AHCI_REQ_DONE ? 0 : -1;
+}
+
+/**
+ * @brief Changes how completions on a port are detected.
+ * Takes effect with the next wait. Polling leaves PxIE off so the device
+ * never interrupts; the interrupt modes need the controller's MSI.
+ * Background completions (callbacks with no waiter) are only delivered
+ * by interrupt in IRQ and ADAPTIVE mode, in POLL mode the owner has to
+ * call ahci_poll.
+ * @return 0 on success, -1 if the port cannot take interrupts.
+ */
+int ahci_set_completion_mode(ahci_port *ap, ahci_completion_mode mode)
+{
+    if (mode != AHCI_COMPLETION_POLL && !ap->irq_capable)
+    {
+        return -1;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&ap->lock);
+
+    ap->mode = mode;
+    ahci_arm_irq(ap, mode != AHCI_COMPLETION_POLL);
+
+    spin_unlock_irqrestore(&ap->lock, flags);
+
+    return 0;
+}
+
+/**
+ * @brief Records that a block device now completes through this port.
+ * The block layer only masks interrupts on the CPU it runs on, so the
+ * port's callbacks must keep arriving there: a claimed port can no
+ * longer be steered with ahci_port_set_cpu.
+ */
+void ahci_port_claim(ahci_port *ap)
+{
+    uint64_t flags = spin_lock_irqsave(&ap->lock);
+    ap->claims++;
+    spin_unlock_irqrestore(&ap->lock, flags);
+}
+
+// Only MSI-X gives each port a message of its own that can be steered alone
+static bool ahci_per_port_msgs(void)
+{
+    return ahci_msix && ahci_msg_count >= 2;
+}
+
+/**
+ * @brief Moves the one message every port shares to another CPU.
+ * All ports are locked in port order while it moves, and it only moves
+ * if none of them backs a block device.
+ * @return 0 on success, -1 if a port is claimed or routing failed.
+ */
+static int ahci_shared_set_cpu(cpu_info *target)
+{
+    uint64_t flags = irq_save();
+    bool claimed = false;
+    bool routed = false;
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        if (ahci_ports[i].present)
+        {
+            spin_lock(&ahci_ports[i].lock);
+            claimed |= ahci_ports[i].claims != 0;
+        }
+    }
+
+    if (!claimed)
+    {
+        if (ahci_msix)
+        {
+            routed = pci_msix_route(ahci_pci, 0, ahci_msg_vector[0], target->apic_id);
+        }
+        else
+        {
+            routed = pci_msi_route(ahci_pci, target->apic_id);
+        }
+    }
+
+    for (int i = AHCI_MAX_PORTS - 1; i >= 0; i--)
+    {
+        if (ahci_ports[i].present)
+        {
+            if (routed)
+            {
+                ahci_ports[i].cpu = target->index;
+            }
+
+            spin_unlock(&ahci_ports[i].lock);
+        }
+    }
+
+    irq_restore(flags);
+
+    return routed ? 0 : -1;
+}
+
+/**
+ * @brief Steers a port's completion interrupts to another CPU.
+ * With a message per port under MSI-X only this port moves. Otherwise
+ * the ports share one message (MSI messages all share one address), and
+ * every port moves with it. Waiters on other CPUs still work, they poll
+ * instead of halting for an interrupt that would not reach them.
+ * @return 0 on success, -1 if the CPU is not online, the port (or with a
+ * shared message, any port) backs a block device or routing failed.
+ */
+int ahci_port_set_cpu(ahci_port *ap, uint32_t cpu)
+{
+    cpu_info *target = smp_cpu(cpu);
+
+    if (target == NULL || !ap->irq_capable)
+    {
+        return -1;
+    }
+
+    if (!ahci_per_port_msgs())
+    {
+        return ahci_shared_set_cpu(target);
+    }
+
+    uint64_t flags = spin_lock_irqsave(&ap->lock);
+
+    if (ap->claims != 0)
+    {
+        spin_unlock_irqrestore(&ap->lock, flags);
+        return -1;
+    }
+
+    bool routed = pci_msix_route(ahci_pci, (uint16_t)ap->port_no, ap->vector, target->apic_id);
+
+    if (routed)
+    {
+        ap->cpu = cpu;
+    }
+
+    spin_unlock_irqrestore(&ap->lock, flags);
+
+    return routed ? 0 : -1;
+}
+
+void ahci_print_stats(ahci_port *ap)
+{
+    static const char *mode_names[] = { "poll", "interrupt", "adaptive" };
+
+    serial_print("Port ");
+    serial_print_hex8((uint8_t)ap->port_no);
+    serial_print(" (");
+    serial_print(mode_names[ap->mode]);
+    serial_print("): ");
+    serial_print_dec(ap->commands_completed);
+    serial_print(" commands, ");
+    serial_print_dec(ap->poll_completions);
+    serial_print(" reaped by polling, ");
+    serial_print_dec(ap->irq_completions);
+    serial_print(" by interrupt, ");
+    serial_print_dec(ap->sleeps);
+    serial_print(" sleeps, ");
+    serial_print_dec(ap->timeouts);
+    serial_print(" timeouts, avg service ");
+    serial_print_dec(ap->service_ns / NSEC_PER_USEC);
+    serial_print(" us\n");
+
+    serial_print("  Submission: ");
+    serial_print_dec(ap->direct_issues);
+    serial_print(" issued directly, ");
+    serial_print_dec(ap->slot_retries);
+    serial_print(" slot retries, ");
+    serial_print_dec(ap->ring_retries);
+    serial_print(" ring retries, ");
+    serial_print_dec(ap->ring_spills);
+    serial_print(" ring overflows\n");
+}
+
+static int ahci_rw(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint64_t buf, bool write)
+{
+    ahci_request req = {0};
+
+    req.lba = ((uint64_t)starth << 32) | startl;
+    req.count = count;
+    req.buf = buf;
+    req.write = write;
+
+    ahci_port *ap = ahci_port_from_hba(port);
+
+    if (ahci_submit(ap, &req) != 0)
+    {
+        return -1;
+    }
+
+    return ahci_wait(ap, &req);
+}
+
+/**
+ * @brief Writes the drive's volatile write cache to media.
+ * FLUSH CACHE EXT is non-queued, so it waits for queued commands to drain
+ * and holds back later ones until the drive reports the cache clean.
+ * @return 0 on success, -1 on a device error.
+ */
+int ahci_flush(ahci_port *ap)
+{
+    ahci_request req = {0};
+
+    req.flush = true;
+
+    if (ahci_submit(ap, &req) != 0)
+    {
+        return -1;
+    }
+
+    return ahci_wait(ap, &req);
+}
+
+int ahci_read(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint64_t buf)
+{
+    return ahci_rw(port, startl, starth, count, buf, false);
+}
+
+int ahci_write(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint64_t buf)
+{
+    return ahci_rw(port, startl, starth, count, buf, true);
+}
+
+static int ahci_identify_slot(HBA_PORT *port, int slot, uint16_t *buf)
+{
+    HBA_CMD_HEADER *header = ahci_cmd_header(port, slot);
+    HBA_CMD_TBL *table = ahci_cmd_table(header);
+
+    header->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+    header->w = 0;
+    ahci_iovec seg = { (uint64_t)(uintptr_t)buf, 512 };
+    header->prdtl = (uint16_t)ahci_build_prdt(table, &seg, 1);
+    header->prdbc = 0;
+
+    FIS_REG_H2D *fis = (FIS_REG_H2D *)table->cfis;
+    memset(fis, 0, sizeof(FIS_REG_H2D));
+
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->c = 1;
+    fis->command = ATA_CMD_IDENTIFY;
+
+    if (!ahci_wait_ready(port))
+    {
+        return -1;
+    }
+
+    port->ci = 1U << slot;
+
+    uint64_t deadline = ktime_deadline(AHCI_COMMAND_TIMEOUT_MS * NSEC_PER_MSEC);
+
+    while (!ktime_expired(deadline))
+    {
+        if (port->is & PxIS_TFES)
+        {
+            ahci_port_recover(ahci_port_from_hba(port));
+            return -1;
+        }
+
+        if (!(port->ci & (1U << slot)))
+        {
+            return 0;
+        }
+    }
+
+    serial_print("AHCI: IDENTIFY timed out\n");
+    return -1;
+}
+
+/**
+ * IDENTIFY is only sent while probing, before the port is handed out,
+ * and bypasses the request machinery. It still claims every slot so it
+ * can never meet another command.
+ */
+int ahci_identify(HBA_PORT *port, uint16_t *buf)
+{
+    ahci_port *ap = ahci_port_from_hba(port);
+    int slot = ahci_claim_slot(ap, true);
+
+    if (slot == -1)
+    {
+        return -1;
+    }
+
+    int result = ahci_identify_slot(port, slot, buf);
+
+    __atomic_fetch_or(&ap->slots_free, ap->slots_all, __ATOMIC_SEQ_CST);
+
+    return result;
+}
+
+/**
+ * @brief Copies an ATA string out of IDENTIFY data.
+ * ATA strings store two characters per word with the first character in
+ * the high byte, and are padded with spaces rather than NUL terminated.
+ * @param length The field length in words; dst must hold length * 2 + 1 bytes.
+ */
+void ata_extract_string(char *dst, uint16_t *src, int start, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        dst[i * 2] = (char)(src[start + i] >> 8);
+        dst[i * 2 + 1] = (char)(src[start + i] & 0xFF);
+    }
+
+    int end = length * 2;
+
+    while (end > 0 && dst[end - 1] == ' ')
+    {
+        end--;
+    }
+
+    dst[end] = '\0';
+}
+
+void ata_print_identify(uint16_t *identify_buf)
+{
+    char model[41];
+    char serial[21];
+    char firmware[9];
+
+    ata_extract_string(model, identify_buf, ATA_IDENT_MODEL, 20);
+    ata_extract_string(serial, identify_buf, ATA_IDENT_SERIAL, 10);
+    ata_extract_string(firmware, identify_buf, ATA_IDENT_FIRMWARE, 4);
+
+    uint64_t sectors = ata_identify_sectors(identify_buf);
+
+    serial_print("Model: ");
+    serial_print(model);
+    serial_print("\nSerial: ");
+    serial_print(serial);
+    serial_print("\nFirmware: ");
+    serial_print(firmware);
+    serial_print("\nCapacity: ");
+    serial_print_dec(sectors * AHCI_SECTOR_SIZE / (1024 * 1024));
+    serial_print(" MiB\nNCQ: ");
+
+    if (identify_buf[ATA_IDENT_SATA_CAP] & ATA_SATA_CAP_NCQ)
+    {
+        serial_print("supported, depth ");
+        serial_print_dec((identify_buf[ATA_IDENT_QUEUE_DEPTH] & 0x1F) + 1);
+    }
+    else
+    {
+        serial_print("not supported");
+    }
+
+    serial_print("\nRotation rate: ");
+
+    if (identify_buf[ATA_IDENT_ROTATION_RATE] == 1)
+    {
+        serial_print("non-rotating");
+    }
+    else
+    {
+        serial_print_dec(identify_buf[ATA_IDENT_ROTATION_RATE]);
+    }
+
+    serial_print("\n");
+}
+
+/**
+ * @brief Picks the command set and queue depth for a freshly identified drive.
+ * NCQ needs support on both sides of the link: CAP.SNCQ on the HBA and
+ * IDENTIFY word 76 bit 8 on the device. The usable depth is the smaller of
+ * the HBA's command slots and the device's queue depth (word 75 + 1).
+ */
+static void ahci_configure_queue(ahci_port *ap, uint16_t *identify)
+{
+    ap->ncq = ahci_hba_ncq && (identify[ATA_IDENT_SATA_CAP] & ATA_SATA_CAP_NCQ);
+    ap->queue_depth = 1;
+
+    if (ap->ncq)
+    {
+        uint8_t device_depth = (identify[ATA_IDENT_QUEUE_DEPTH] & 0x1F) + 1;
+        ap->queue_depth = device_depth < ahci_cmd_slots ? device_depth : ahci_cmd_slots;
+    }
+
+    // Short of DMA memory, run with the slots that got a table
+    ap->queue_depth = (uint8_t)ahci_port_alloc(ap, ap->queue_depth);
+    ap->slots_all = ap->queue_depth == AHCI_MAX_SLOTS ? 0xFFFFFFFF : (1U << ap->queue_depth) - 1;
+    ap->slots_free = ap->slots_all;
+
+    serial_print(ap->ncq ? "Using FPDMA QUEUED, depth " : "Using DMA EXT, depth ");
+    serial_print_dec(ap->queue_depth);
+    serial_print("\n");
+}
+
+void ahci_probe_port(HBA_MEM *hba_mem, int port_no)
+{
+    HBA_PORT *port = &hba_mem->ports[port_no];
+    ahci_port *ap = &ahci_ports[port_no];
+    int type = ahci_check_type(port);
+
+    serial_print("Port ");
+    serial_print_hex8((uint8_t)port_no);
+
+    switch (type)
+    {
+        case AHCI_DEV_SATA:
+            serial_print(": SATA drive found\n");
+            break;
+        case AHCI_DEV_SATAPI:
+            serial_print(": SATAPI drive found, not supported\n");
+            return;
+        case AHCI_DEV_SEMB:
+            serial_print(": SEMB drive found, not supported\n");
+            return;
+        case AHCI_DEV_PM:
+            serial_print(": port multiplier found, not supported\n");
+            return;
+        default:
+            serial_print(": no drive\n");
+            return;
+    }
+
+    spin_lock_init(&ap->lock);
+    ap->port = port;
+    ap->port_no = port_no;
+    ap->cpu = 0;
+    ap->queue_depth = 1;
+    ap->slots_all = 1;
+    ap->slots_free = 1;
+    ap->slots_issuing = 0;
+    ap->slots_busy = 0;
+    ap->slots_failed = 0;
+    ap->slots_nonqueued = 0;
+    ap->ring_head = 0;
+    ap->ring_tail = 0;
+    ap->wait_head = NULL;
+    ap->wait_tail = NULL;
+
+    for (uint32_t i = 0; i < AHCI_RING_SIZE; i++)
+    {
+        ap->ring[i].seq = i;
+    }
+    ap->irq_capable = false;
+    ap->irq_armed = false;
+    ap->ccc = false;
+    ap->mode = AHCI_COMPLETION_POLL;
+    ap->timeout.callback = ahci_timeout;
+    ap->timeout.ctx = ap;
+
+    if (ahci_port_alloc(ap, 1) < 1)
+    {
+        serial_print("No DMA memory for the port\n");
+        return;
+    }
+
+    ahci_rebase_port(port, port_no);
+
+    if (ahci_identify(port, identify_buf) != 0)
+    {
+        serial_print("IDENTIFY failed\n");
+        return;
+    }
+
+    ata_print_identify(identify_buf);
+
+    ap->sectors = ata_identify_sectors(identify_buf);
+    ap->rotation_rate = identify_buf[ATA_IDENT_ROTATION_RATE];
+    ahci_configure_queue(ap, identify_buf);
+    ap->present = true;
+}
+
+/**
+ * @brief Handles one of the controller's MSI messages.
+ * IS.IPS says which ports need service; the CCC bit stands for every
+ * port under coalescing. With a message per port only the ports behind
+ * this vector are looked at, so ports interrupting on other vectors are
+ * not reaped twice. ahci_port_reap clears each port's PxIS before
+ * reading its slots, and IS is cleared last, as the spec requires.
+ */
+static void ahci_irq_handler(interrupt_frame *frame)
+{
+    uint32_t mine = 0;
+
+    for (int msg = 0; msg < ahci_msg_count; msg++)
+    {
+        if (ahci_msg_vector[msg] == (uint8_t)frame->vector)
+        {
+            mine = ahci_msg_ports[msg];
+            break;
+        }
+    }
+
+    uint32_t pending = hba->is & mine;
+    uint32_t service = pending;
+
+    ahci_interrupts++;
+
+    if (ahci_ccc_ports != 0 && (pending & (1U << ahci_ccc_int)))
+    {
+        service = (service & ~(1U << ahci_ccc_int)) | ahci_ccc_ports;
+        ahci_ccc_interrupts++;
+    }
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        if (!(service & (1U << i)))
+        {
+            continue;
+        }
+
+        if (ahci_ports[i].present)
+        {
+            spin_lock(&ahci_ports[i].lock);
+            ahci_complete(&ahci_ports[i], true);
+            spin_unlock(&ahci_ports[i].lock);
+        }
+        else if (hba->pi & (1U << i))
+        {
+            hba->ports[i].is = 0xFFFFFFFF;
+        }
+    }
+
+    hba->is = pending;
+}
+
+/**
+ * @brief Coalesces command completions on a set of ports into one interrupt.
+ * Under a deep NCQ queue every Set Device Bits FIS would otherwise cost an
+ * MSI. With CCC the HBA counts completions on the given ports and raises
+ * a single interrupt once `completions` have accumulated or `timeout_ms`
+ * has passed since the first one, whichever comes first. CCC_CTL may only
+ * be reprogrammed while disabled.
+ * @return 0 on success, -1 if the HBA lacks CCC or the arguments are out of range.
+ */
+int ahci_ccc_enable(uint32_t ports, uint8_t completions, uint16_t timeout_ms)
+{
+    if (!(hba->cap & HOST_CAP_CCCS) || completions == 0 || timeout_ms == 0)
+    {
+        return -1;
+    }
+
+    uint64_t flags = irq_save();
+
+    hba->ccc_ctl &= ~CCC_CTL_EN;
+
+    ports &= hba->pi;
+    hba->ccc_pts = ports;
+    hba->ccc_ctl = ((uint32_t)timeout_ms << CCC_CTL_TV_SHIFT) | ((uint32_t)completions << CCC_CTL_CC_SHIFT);
+    ahci_ccc_int = (hba->ccc_ctl >> CCC_CTL_INT_SHIFT) & CCC_CTL_INT_MASK;
+    ahci_ccc_ports = ports;
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        ahci_ports[i].ccc = (ports & (1U << i)) != 0;
+
+        if (ahci_ports[i].present)
+        {
+            spin_lock(&ahci_ports[i].lock);
+            ahci_write_ie(&ahci_ports[i]);
+            spin_unlock(&ahci_ports[i].lock);
+        }
+    }
+
+    hba->ccc_ctl |= CCC_CTL_EN;
+
+    irq_restore(flags);
+
+    return 0;
+}
+
+void ahci_ccc_disable(void)
+{
+    if (!(hba->cap & HOST_CAP_CCCS))
+    {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+
+    hba->ccc_ctl &= ~CCC_CTL_EN;
+    hba->ccc_pts = 0;
+    ahci_ccc_ports = 0;
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        ahci_ports[i].ccc = false;
+
+        if (ahci_ports[i].present)
+        {
+            spin_lock(&ahci_ports[i].lock);
+            ahci_write_ie(&ahci_ports[i]);
+            spin_unlock(&ahci_ports[i].lock);
+        }
+    }
+
+    irq_restore(flags);
+}
+
+/**
+ * @brief Reports how many completions each interrupt delivered.
+ * Without coalescing a QD32 workload is close to one interrupt per
+ * command; with CCC the ratio approaches the programmed completion count.
+ */
+void ahci_print_interrupt_stats(void)
+{
+    uint64_t completions = 0;
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        completions += ahci_ports[i].irq_completions;
+    }
+
+    serial_print("AHCI interrupts: ");
+    serial_print_dec(ahci_interrupts);
+    serial_print(" (");
+    serial_print_dec(ahci_ccc_interrupts);
+    serial_print(" coalesced), completions by interrupt: ");
+    serial_print_dec(completions);
+
+    if (ahci_interrupts > 0)
+    {
+        uint64_t ratio = completions * 100 / ahci_interrupts;
+
+        serial_print(", per interrupt: ");
+        serial_print_dec(ratio / 100);
+        serial_print(".");
+        serial_print_dec((ratio % 100) / 10);
+        serial_print_dec(ratio % 10);
+    }
+
+    serial_print("\n");
+}
+
+/**
+ * @brief Asks for one MSI-X or MSI message per port.
+ * Message n then reports port n (AHCI 1.3, 10.6.2.1), and with CAP.CCCS
+ * the coalesced interrupt arrives on the message CCC_CTL.INT names, so
+ * that one is reserved too. If fewer messages were granted than that,
+ * or the HBA set GHC.MRSM, it sends everything as message 0 and the
+ * surplus vectors are given back.
+ * @return The number of messages in use, 0 if the controller has neither.
+ */
+static int ahci_alloc_vectors(pci_device *ahci_dev)
+{
+    // PI of zero means no ports, and __builtin_clz(0) is undefined
+    if (hba->pi == 0)
+    {
+        return 0;
+    }
+
+    int wanted = 32 - __builtin_clz(hba->pi);
+
+    if (hba->cap & HOST_CAP_CCCS)
+    {
+        ahci_ccc_int = (hba->ccc_ctl >> CCC_CTL_INT_SHIFT) & CCC_CTL_INT_MASK;
+
+        if (ahci_ccc_int + 1 > wanted)
+        {
+            wanted = ahci_ccc_int + 1;
+        }
+    }
+
+    bool msix = true;
+    int count = pci_alloc_msix(ahci_dev, wanted, lapic_id(), ahci_msg_vector);
+
+    if (count == 0)
+    {
+        uint8_t first;
+
+        msix = false;
+
+        // MSI grants powers of two and rounds down, so ask for the next one up
+        int msi_wanted = 1;
+
+        while (msi_wanted < wanted)
+        {
+            msi_wanted <<= 1;
+        }
+
+        count = pci_alloc_msi(ahci_dev, msi_wanted, lapic_id(), &first);
+
+        for (int i = 0; i < count; i++)
+        {
+            ahci_msg_vector[i] = first + i;
+        }
+    }
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    ahci_msix = msix;
+
+    if (count < wanted || (hba->ghc & GHC_MRSM))
+    {
+        // Messages 1 and up must be off before their vectors are freed
+        if (!msix)
+        {
+            pci_msi_single(ahci_dev);
+        }
+
+        for (int i = 1; i < count; i++)
+        {
+            if (msix)
+            {
+                pci_msix_mask(ahci_dev, i, true);
+            }
+
+            idt_free_vectors(ahci_msg_vector[i], 1);
+        }
+
+        ahci_msg_ports[0] = 0xFFFFFFFF;
+        return 1;
+    }
+
+    // IS bit n belongs to message n, the CCC bit included
+    for (int i = 0; i < count; i++)
+    {
+        ahci_msg_ports[i] = 1U << i;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Routes AHCI completions through MSI instead of polling.
+ * Ports start out in adaptive mode. If the controller has neither MSI
+ * nor MSI-X they stay in polling mode.
+ */
+static void ahci_enable_interrupts(pci_device *ahci_dev)
+{
+    ahci_msg_count = ahci_alloc_vectors(ahci_dev);
+
+    if (ahci_msg_count == 0)
+    {
+        serial_print("AHCI: no MSI capability, completions are polled\n");
+        return;
+    }
+
+    for (int msg = 0; msg < ahci_msg_count; msg++)
+    {
+        idt_register_handler(ahci_msg_vector[msg], ahci_irq_handler);
+    }
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        ahci_ports[i].vector = ahci_msg_vector[ahci_msg_count > 1 ? i : 0];
+
+        if (!ahci_ports[i].present)
+        {
+            continue;
+        }
+
+        ahci_ports[i].port->is = 0xFFFFFFFF;
+        ahci_ports[i].irq_capable = true;
+        ahci_set_completion_mode(&ahci_ports[i], AHCI_COMPLETION_ADAPTIVE);
+    }
+
+    hba->is = 0xFFFFFFFF;
+    hba->ghc |= GHC_IE;
+
+    serial_print(ahci_dev->msix_table != 0 ? "AHCI: MSI-X enabled, " : "AHCI: MSI enabled, ");
+    serial_print_dec(ahci_msg_count);
+    serial_print(ahci_msg_count > 1 ? " vectors from " : " vector ");
+    serial_print_hex8(ahci_msg_vector[0]);
+    serial_print("\n");
+}
+
+/**
+ * Block layer glue. Each SATA port becomes a block device; every dispatch
+ * it hands us is issued as one AHCI request whose PRDT is built from the
+ * merged client buffers.
+ */
+typedef struct
+{
+    ahci_request hw;
+    block_dispatch *unit;
+    ahci_iovec iov[BLOCK_MAX_SEGMENTS];
+} ahci_block_cmd;
+
+typedef struct
+{
+    block_device bdev;
+    ahci_port *ap;
+    uint32_t cmds_busy;
+    ahci_block_cmd cmds[AHCI_MAX_SLOTS];
+} ahci_disk;
+
+static int ahci_disk_count;
+
+static void ahci_block_done(ahci_request *req)
+{
+    ahci_block_cmd *cmd = (ahci_block_cmd *)req->ctx;
+    ahci_disk *disk = (ahci_disk *)cmd->unit->dev->driver;
+
+    disk->cmds_busy &= ~(1U << (cmd - disk->cmds));
+    block_complete(cmd->unit, req->status == AHCI_REQ_DONE);
+}
+
+static int ahci_block_submit(block_device *dev, block_dispatch *unit)
+{
+    ahci_disk *disk = (ahci_disk *)dev->driver;
+    int index = 0;
+
+    // The block layer never has more in flight than the queue depth
+    while (disk->cmds_busy & (1U << index))
+    {
+        index++;
+    }
+
+    ahci_block_cmd *cmd = &disk->cmds[index];
+    uint16_t iovcnt = 0;
+
+    for (block_request *req = unit->head; req != NULL; req = req->next)
+    {
+        cmd->iov[iovcnt].phys = req->buf;
+        cmd->iov[iovcnt].len = req->count * AHCI_SECTOR_SIZE;
+        iovcnt++;
+    }
+
+    cmd->unit = unit;
+    cmd->hw.lba = unit->lba;
+    cmd->hw.count = unit->count;
+    cmd->hw.buf = 0;
+    cmd->hw.iov = cmd->iov;
+    cmd->hw.iovcnt = iovcnt;
+    cmd->hw.write = unit->write;
+    cmd->hw.flush = false;
+    cmd->hw.callback = ahci_block_done;
+    cmd->hw.ctx = cmd;
+
+    disk->cmds_busy |= 1U << index;
+
+    if (ahci_submit(disk->ap, &cmd->hw) != 0)
+    {
+        disk->cmds_busy &= ~(1U << index);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Waits for any one of the disk's commands.
+ * ahci_wait applies the port's completion mode, so block layer waiters
+ * poll, sleep or do both exactly like direct driver users.
+ */
+static void ahci_block_wait(block_device *dev)
+{
+    ahci_disk *disk = (ahci_disk *)dev->driver;
+    uint32_t busy = disk->cmds_busy;
+
+    if (busy == 0)
+    {
+        ahci_poll(disk->ap);
+        return;
+    }
+
+    int index = 0;
+
+    while (!(busy & (1U << index)))
+    {
+        index++;
+    }
+
+    ahci_wait(disk->ap, &disk->cmds[index].hw);
+}
+
+static int ahci_block_flush(block_device *dev)
+{
+    return ahci_flush(((ahci_disk *)dev->driver)->ap);
+}
+
+static const block_ops ahci_block_ops =
+{
+    .submit = ahci_block_submit,
+    .wait = ahci_block_wait,
+    .flush = ahci_block_flush,
+};
+
+/**
+ * @brief Registers every identified SATA drive with the block layer.
+ * IDENTIFY word 217 decides the elevator: 1 means non-rotating media,
+ * anything else (including 0, not reported) is treated as a spinning disk.
+ */
+static void ahci_register_disks(void)
+{
+#ifdef AHCI_SMP_BENCHMARK
+    // ahci_smp_benchmark steers the ports, block devices would pin them
+    return;
+#endif
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        ahci_port *ap = ahci_get_port(i);
+
+        if (ap == NULL)
+        {
+            continue;
+        }
+
+        ahci_disk *disk = kzalloc(sizeof(ahci_disk));
+
+        if (disk == NULL)
+        {
+            serial_print("Warning: No memory for AHCI disk\n");
+            return;
+        }
+
+        block_device *bdev = &disk->bdev;
+        int name_len = 4;
+
+        disk->ap = ap;
+        disk->cmds_busy = 0;
+
+        bdev->name[0] = 'a';
+        bdev->name[1] = 'h';
+        bdev->name[2] = 'c';
+        bdev->name[3] = 'i';
+
+        if (ahci_disk_count >= 10)
+        {
+            bdev->name[name_len++] = (char)('0' + ahci_disk_count / 10);
+        }
+
+        bdev->name[name_len++] = (char)('0' + ahci_disk_count % 10);
+        bdev->name[name_len] = '\0';
+        bdev->sectors = ap->sectors;
+        bdev->rotational = ap->rotation_rate != 1;
+        bdev->max_sectors = AHCI_MAX_SECTORS;
+        bdev->max_segments = BLOCK_MAX_SEGMENTS;
+        bdev->max_inflight = ap->queue_depth;
+        bdev->ops = &ahci_block_ops;
+        bdev->driver = disk;
+
+        if (block_register(bdev) < 0)
+        {
+            kfree(disk);
+            return;
+        }
+
+        ahci_port_claim(ap);
+        ahci_disk_count++;
+    }
+}
+
+/**
+ * @brief Resets the HBA and waits for the links to come back.
+ * GHC.HR resets every port and must self-clear within one second. With
+ * staggered spin-up (CAP.SSS) the drives stay idle until PxCMD.SUD is set.
+ */
+static bool ahci_reset_hba(HBA_MEM *hba_mem)
+{
+    hba_mem->ghc |= GHC_AE;
+    hba_mem->ghc |= GHC_HR;
+
+    uint64_t deadline = ktime_deadline(AHCI_RESET_TIMEOUT_MS * NSEC_PER_MSEC);
+
+    while (hba_mem->ghc & GHC_HR)
+    {
+        if (ktime_expired(deadline))
+        {
+            serial_print("AHCI: HBA reset timed out\n");
+            return false;
+        }
+    }
+
+    hba_mem->ghc |= GHC_AE;
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        if (!(hba_mem->pi & (1U << i)))
+        {
+            continue;
+        }
+
+        HBA_PORT *port = &hba_mem->ports[i];
+
+        if (hba_mem->cap & HOST_CAP_SSS)
+        {
+            port->cmd |= PxCMD_SUD;
+        }
+
+        // Link establishment (PxSSTS.DET = 3) takes up to 10ms after spin-up
+        deadline = ktime_deadline(AHCI_LINK_TIMEOUT_MS * NSEC_PER_MSEC);
+
+        while ((port->ssts & 0x0F) != HBA_PORT_DET_PRESENT && !ktime_expired(deadline));
+
+        port->serr = 0xFFFFFFFF;
+    }
+
+    return true;
+}
+
+void ahci_init(pci_device *ahci_dev)
+{
+    uint64_t abar = pci_get_bar_address(ahci_dev, 5);
+
+    serial_print("\nABAR: ");
+    serial_print_hex((uint32_t)(abar >> 32));
+    serial_print_hex((uint32_t)abar);
+    serial_print("\n");
+
+    map_mmio_region(abar, pci_get_bar_size(ahci_dev, 5), MEM_UC);
+    hba = (HBA_MEM *)(uintptr_t)abar;
+    ahci_pci = ahci_dev;
+
+    if (!ahci_reset_hba(hba))
+    {
+        return;
+    }
+
+    ahci_cmd_slots = ((hba->cap >> HOST_CAP_NCS_SHIFT) & HOST_CAP_NCS_MASK) + 1;
+    ahci_hba_ncq = (hba->cap & HOST_CAP_SNCQ) != 0;
+
+    serial_print("AHCI version: ");
+    serial_print_hex(hba->vs);
+    serial_print("\nCommand slots: ");
+    serial_print_dec(ahci_cmd_slots);
+    serial_print(ahci_hba_ncq ? ", NCQ supported\n" : ", NCQ not supported\n");
+
+    // Reserve one slot's worth per implemented port, NCQ tables are added per drive
+    uint64_t dma_limit = (hba->cap & HOST_CAP_64) ? ~0ULL : DMA_LIMIT_32BIT;
+    uint32_t ports = (uint32_t)ahci_count_slots(hba->pi);
+
+    if (dma_pool_init(&ahci_list_pool, "ahci-cmd-list", AHCI_CMD_LIST_SIZE, AHCI_CMD_LIST_SIZE, dma_limit, ports) != 0 ||
+        dma_pool_init(&ahci_fis_pool, "ahci-fis", AHCI_FIS_SIZE, AHCI_FIS_SIZE, dma_limit, ports) != 0 ||
+        dma_pool_init(&ahci_table_pool, "ahci-cmd-table", AHCI_CMD_TBL_SIZE, AHCI_CMD_TBL_ALIGN, dma_limit, ports) != 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        if (hba->pi & (1U << i))
+        {
+            ahci_probe_port(hba, i);
+        }
+    }
+
+    ahci_enable_interrupts(ahci_dev);
+    ahci_register_disks();
+}
+
+#define AHCI_BENCH_DEPTH 4
+#define AHCI_BENCH_BYTES (256 * 1024)
+#define AHCI_BENCH_TOTAL (32 * 1024 * 1024)
+
+// One port's sequential read, driven by whichever CPU runs it
+typedef struct
+{
+    ahci_port *ap;
+    uint32_t cpu;
+    uint64_t buf;
+    uint32_t count;
+    uint32_t depth;             // Reads kept in flight, at most AHCI_MAX_SLOTS
+    uint64_t requests;
+    uint64_t issued;
+    uint64_t done;
+    bool failed;
+    uint64_t elapsed;
+    volatile bool finished;
+    ahci_request reqs[AHCI_MAX_SLOTS];
+} ahci_bench_job;
+
+static ahci_bench_job ahci_bench_jobs[AHCI_MAX_PORTS];
+
+/**
+ * @brief Keeps the job's depth of reads in flight and retires the oldest.
+ * Waiting goes through ahci_wait, which sleeps for the interrupt only on
+ * the CPU the port's message is delivered to. Without wait it polls
+ * once, so one CPU can drive several ports side by side.
+ * @return true once every read has completed.
+ */
+static bool ahci_bench_step(ahci_bench_job *job, bool wait)
+{
+    while (job->issued < job->requests && job->issued < job->done + job->depth)
+    {
+        ahci_request *req = &job->reqs[job->issued % job->depth];
+
+        req->lba = job->issued * job->count;
+        req->count = job->count;
+        req->buf = job->buf;
+        req->iov = NULL;
+        req->iovcnt = 0;
+        req->write = false;
+        req->flush = false;
+        req->callback = NULL;
+        req->ctx = NULL;
+
+        if (ahci_submit(job->ap, req) != 0)
+        {
+            job->failed = true;
+            job->requests = job->issued;
+            break;
+        }
+
+        job->issued++;
+    }
+
+    if (job->done == job->issued)
+    {
+        return job->done == job->requests;
+    }
+
+    ahci_request *req = &job->reqs[job->done % job->depth];
+
+    if (wait)
+    {
+        ahci_wait(job->ap, req);
+    }
+    else if (!ahci_request_done(req))
+    {
+        ahci_poll(job->ap);
+    }
+
+    if (ahci_request_done(req))
+    {
+        job->failed |= req->status != AHCI_REQ_DONE;
+        job->done++;
+    }
+
+    return job->done == job->requests;
+}
+
+static void ahci_bench_worker(void *arg)
+{
+    ahci_bench_job *job = (ahci_bench_job *)arg;
+    uint64_t start = ktime_ns();
+
+    while (!ahci_bench_step(job, true))
+    {
+    }
+
+    job->elapsed = ktime_ns() - start;
+    __atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+}
+
+static void ahci_bench_reset(ahci_bench_job *jobs, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t total = AHCI_BENCH_TOTAL / AHCI_SECTOR_SIZE;
+
+        if (total > jobs[i].ap->sectors)
+        {
+            total = jobs[i].ap->sectors;
+        }
+
+        jobs[i].requests = total / jobs[i].count;
+        jobs[i].issued = 0;
+        jobs[i].done = 0;
+        jobs[i].failed = false;
+        jobs[i].elapsed = 0;
+        jobs[i].finished = false;
+    }
+}
+
+static void ahci_bench_report(const char *label, ahci_bench_job *jobs, int count, uint64_t elapsed)
+{
+    uint64_t bytes = 0;
+
+    serial_print(label);
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t job_bytes = jobs[i].done * jobs[i].count * AHCI_SECTOR_SIZE;
+
+        bytes += job_bytes;
+
+        serial_print("  Port ");
+        serial_print_hex8((uint8_t)jobs[i].ap->port_no);
+        serial_print(" on CPU ");
+        serial_print_dec(jobs[i].cpu);
+        serial_print(": ");
+        serial_print_dec(jobs[i].elapsed ? job_bytes * 1000 / jobs[i].elapsed : 0);
+        serial_print(jobs[i].ap->cpu == jobs[i].cpu ? " MB/s, interrupt on this CPU" : " MB/s, interrupt elsewhere, polled");
+        serial_print(jobs[i].failed ? " (with errors)\n" : "\n");
+    }
+
+    serial_print("  All ports: ");
+    serial_print_dec(elapsed ? bytes * 1000 / elapsed : 0);
+    serial_print(" MB/s\n");
+}
+
+/**
+ * @brief Compares driving every SATA port from one CPU with a CPU per port.
+ * First the BSP keeps reads in flight on all ports at once, polling,
+ * then port n is handed to CPU n + 1 with smp_run_on after its interrupt
+ * was steered there. Each port reads AHCI_BENCH_TOTAL bytes from LBA 0.
+ * The second run needs a steerable message per port (MSI-X); with MSI
+ * every message shares one destination and all but one CPU would poll,
+ * so only the first run is measured.
+ * Needs the ports unclaimed, so it is built with
+ * EXTRA_CFLAGS=-DAHCI_SMP_BENCHMARK (no block devices) and run under run-multi.
+ */
+void ahci_smp_benchmark(void)
+{
+    ahci_bench_job *jobs = ahci_bench_jobs;
+    unsigned int order = pmm_order_for(AHCI_BENCH_BYTES);
+    int count = 0;
+
+    for (int i = 0; i < AHCI_MAX_PORTS && count + 1 < (int)smp_cpu_count(); i++)
+    {
+        ahci_port *ap = ahci_get_port(i);
+
+        if (ap == NULL)
+        {
+            continue;
+        }
+
+        uint64_t buf = pmm_alloc(order);
+
+        if (buf == 0)
+        {
+            break;
+        }
+
+        jobs[count].ap = ap;
+        jobs[count].buf = buf;
+        jobs[count].count = AHCI_BENCH_BYTES / AHCI_SECTOR_SIZE;
+        jobs[count].depth = AHCI_BENCH_DEPTH;
+        count++;
+    }
+
+    if (count == 0)
+    {
+        serial_print("AHCI benchmark: needs a SATA port and a free CPU per port\n");
+        return;
+    }
+
+    if (ahci_per_port_msgs())
+    {
+        serial_print("AHCI benchmark: MSI-X, one message per port\n");
+    }
+    else
+    {
+        serial_print(ahci_msg_count > 1 ? "AHCI benchmark: MSI, messages share one CPU\n" :
+                                          "AHCI benchmark: one message for all ports\n");
+    }
+
+    ahci_bench_reset(jobs, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        jobs[i].cpu = 0;
+        ahci_port_set_cpu(jobs[i].ap, 0);
+    }
+
+    int pending = count;
+    uint64_t start = ktime_ns();
+
+    while (pending > 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (!jobs[i].finished && ahci_bench_step(&jobs[i], false))
+            {
+                jobs[i].elapsed = ktime_ns() - start;
+                jobs[i].finished = true;
+                pending--;
+            }
+        }
+    }
+
+    ahci_bench_report("AHCI benchmark, all ports from CPU 0:\n", jobs, count, ktime_ns() - start);
+
+    if (!ahci_per_port_msgs())
+    {
+        serial_print("AHCI benchmark: no message per port, one CPU per port not measured\n");
+
+        for (int i = 0; i < count; i++)
+        {
+            ahci_print_stats(jobs[i].ap);
+            pmm_free(jobs[i].buf, order);
+        }
+
+        return;
+    }
+
+    ahci_bench_reset(jobs, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        jobs[i].cpu = (uint32_t)i + 1;
+        ahci_port_set_cpu(jobs[i].ap, jobs[i].cpu);
+    }
+
+    start = ktime_ns();
+
+    for (int i = 0; i < count; i++)
+    {
+        if (smp_run_on(jobs[i].cpu, ahci_bench_worker, &jobs[i]) != 0)
+        {
+            jobs[i].finished = true;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        while (!__atomic_load_n(&jobs[i].finished, __ATOMIC_ACQUIRE))
+        {
+            __asm__ __volatile__("pause");
+        }
+    }
+
+    ahci_bench_report("AHCI benchmark, one CPU per port:\n", jobs, count, ktime_ns() - start);
+
+    // Which completion paths fired, and how often submitters collided
+    for (int i = 0; i < count; i++)
+    {
+        ahci_print_stats(jobs[i].ap);
+        ahci_port_set_cpu(jobs[i].ap, 0);
+        pmm_free(jobs[i].buf, order);
+    }
+}
+
+#define AHCI_CCC_BENCH_DEPTH 32
+#define AHCI_CCC_BENCH_SECTORS 8
+#define AHCI_CCC_BENCH_READS 8192
+#define AHCI_CCC_BENCH_COMPLETIONS 16
+#define AHCI_CCC_BENCH_TIMEOUT_MS 1
+
+// Runs the QD32 job once from the BSP with fresh interrupt counters
+static void ahci_ccc_bench_run(ahci_bench_job *job, const char *label)
+{
+    ahci_interrupts = 0;
+    ahci_ccc_interrupts = 0;
+
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        ahci_ports[i].irq_completions = 0;
+    }
+
+    ahci_bench_reset(job, 1);
+
+    if (job->requests > AHCI_CCC_BENCH_READS)
+    {
+        job->requests = AHCI_CCC_BENCH_READS;
+    }
+
+    uint64_t start = ktime_ns();
+
+    while (!ahci_bench_step(job, true))
+    {
+    }
+
+    job->elapsed = ktime_ns() - start;
+
+    serial_print(label);
+    serial_print_dec(job->elapsed ? job->done * NSEC_PER_SEC / job->elapsed : 0);
+    serial_print(job->failed ? " IOPS (with errors)\n  " : " IOPS\n  ");
+    ahci_print_interrupt_stats();
+}
+
+/**
+ * @brief Shows how much command completion coalescing saves at QD32.
+ * The first SATA port reads AHCI_CCC_BENCH_SECTORS at a time with 32
+ * commands in flight, once with an interrupt per completion and once
+ * with CCC raising one per AHCI_CCC_BENCH_COMPLETIONS. The port is in
+ * interrupt mode for both runs, so every completion is an interrupt's.
+ * Built with EXTRA_CFLAGS=-DAHCI_CCC_BENCHMARK.
+ */
+void ahci_ccc_benchmark(void)
+{
+    ahci_port *ap = NULL;
+
+    for (int i = 0; i < AHCI_MAX_PORTS && ap == NULL; i++)
+    {
+        ap = ahci_get_port(i);
+    }
+
+    if (ap == NULL || ahci_set_completion_mode(ap, AHCI_COMPLETION_IRQ) != 0)
+    {
+        serial_print("CCC benchmark: needs a SATA port with interrupts\n");
+        return;
+    }
+
+    unsigned int order = pmm_order_for(AHCI_CCC_BENCH_SECTORS * AHCI_SECTOR_SIZE);
+    ahci_bench_job *job = &ahci_bench_jobs[0];
+
+    job->ap = ap;
+    job->cpu = 0;
+    job->buf = pmm_alloc(order);
+    job->count = AHCI_CCC_BENCH_SECTORS;
+    job->depth = AHCI_CCC_BENCH_DEPTH;
+
+    if (job->buf == 0)
+    {
+        serial_print("CCC benchmark: not enough memory\n");
+        ahci_set_completion_mode(ap, AHCI_COMPLETION_ADAPTIVE);
+        return;
+    }
+
+    serial_print("CCC benchmark, port ");
+    serial_print_hex8((uint8_t)ap->port_no);
+    serial_print(", queue depth ");
+    serial_print_dec(ap->queue_depth);
+    serial_print("\n");
+
+    ahci_ccc_bench_run(job, "  CCC off: ");
+
+    if (ahci_ccc_enable(1U << ap->port_no, AHCI_CCC_BENCH_COMPLETIONS, AHCI_CCC_BENCH_TIMEOUT_MS) == 0)
+    {
+        ahci_ccc_bench_run(job, "  CCC on: ");
+        ahci_ccc_disable();
+    }
+    else
+    {
+        serial_print("  CCC on: not supported by the HBA\n");
+    }
+
+    ahci_print_stats(ap);
+
+    ahci_set_completion_mode(ap, AHCI_COMPLETION_ADAPTIVE);
+    pmm_free(job->buf, order);
+}
\ No newline at end of file
@@ -0,0 +1,294 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "acpi.h"
+#include "cpu.h"
+#include "idt.h"
+#include "ktime.h"
+#include "memory.h"
+#include "ports.h"
+#include "driver/apic.h"
+#include "driver/serial.h"
+
+static uintptr_t lapic_base;
+static uintptr_t ioapic_base;
+static uint8_t ioapic_entries;
+
+// TSC-deadline mode needs no conversion, one-shot mode counts bus clocks
+static bool lapic_tsc_deadline;
+static uint64_t lapic_timer_hz;
+
+/**
+ * @brief Moves the legacy 8259 PICs off the exception vectors and masks them.
+ * After reset the PICs deliver IRQ 0-7 on vectors 8-15, which collide with
+ * CPU exceptions. Even masked they can raise a spurious IRQ 7/15, so they
+ * are remapped to PIC_VECTOR_BASE before everything is routed through the APICs.
+ */
+static void pic_disable(void)
+{
+    // ICW1: start initialization, expect ICW4
+    outb(PIC1_COMMAND, 0x11);
+    outb(PIC2_COMMAND, 0x11);
+
+    // ICW2: vector offsets
+    outb(PIC1_DATA, PIC_VECTOR_BASE);
+    outb(PIC2_DATA, PIC_VECTOR_BASE + 8);
+
+    // ICW3: slave on IRQ 2 of the master
+    outb(PIC1_DATA, 0x04);
+    outb(PIC2_DATA, 0x02);
+
+    // ICW4: 8086 mode
+    outb(PIC1_DATA, 0x01);
+    outb(PIC2_DATA, 0x01);
+
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
+
+static uint32_t ioapic_read(uint8_t reg)
+{
+    mmio_write32(ioapic_base, IOAPIC_REGSEL, reg);
+    return mmio_read32(ioapic_base, IOAPIC_WINDOW);
+}
+
+static void ioapic_write(uint8_t reg, uint32_t value)
+{
+    mmio_write32(ioapic_base, IOAPIC_REGSEL, reg);
+    mmio_write32(ioapic_base, IOAPIC_WINDOW, value);
+}
+
+void lapic_eoi(void)
+{
+    mmio_write32(lapic_base, LAPIC_EOI, 0);
+}
+
+uint8_t lapic_id(void)
+{
+    return (uint8_t)(mmio_read32(lapic_base, LAPIC_ID) >> 24);
+}
+
+/**
+ * @brief Points an IOAPIC input at a vector on one CPU.
+ * Each redirection entry is 64 bits split over two registers; the
+ * destination APIC ID lives in the top byte of the high half.
+ */
+void ioapic_route(uint8_t gsi, uint8_t vector, uint8_t apic_id, bool masked)
+{
+    if (gsi >= ioapic_entries)
+    {
+        return;
+    }
+
+    uint8_t reg = IOAPIC_REG_REDTBL + gsi * 2;
+
+    ioapic_write(reg + 1, (uint32_t)apic_id << 24);
+    ioapic_write(reg, vector | (masked ? IOAPIC_REDTBL_MASKED : 0));
+}
+
+/**
+ * @brief Turns on the calling CPU's local APIC.
+ * Every CPU has its own, all at the same physical address. The BSP
+ * finds and maps that address in apic_init, each AP only has to
+ * software-enable its APIC through the spurious vector register.
+ */
+void lapic_enable(void)
+{
+    wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_ENABLE);
+
+    mmio_write32(lapic_base, LAPIC_TPR, 0);
+    mmio_write32(lapic_base, LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+/**
+ * @brief Sends an inter-processor interrupt and waits until it left.
+ * The destination goes into ICR high first, writing ICR low sends. The
+ * delivery status bit stays set until the APIC has accepted the IPI.
+ */
+void lapic_send_ipi(uint8_t apic_id, uint32_t command)
+{
+    mmio_write32(lapic_base, LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    mmio_write32(lapic_base, LAPIC_ICR_LOW, command);
+
+    while (mmio_read32(lapic_base, LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+    {
+        __asm__ __volatile__("pause");
+    }
+}
+
+/**
+ * @brief Finds the IOAPIC that handles GSI 0 in the ACPI MADT.
+ * ioapic_route numbers its inputs from 0, so only that IOAPIC is used.
+ * @return Its physical address, the architectural default without a MADT.
+ */
+static uintptr_t ioapic_find_base(void)
+{
+    const acpi_madt *madt = (const acpi_madt *)acpi_find_table("APIC");
+
+    if (madt == NULL)
+    {
+        return IOAPIC_DEFAULT_BASE;
+    }
+
+    const uint8_t *entry = (const uint8_t *)madt + sizeof(acpi_madt);
+    const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+
+    while (entry + sizeof(acpi_madt_entry) <= end)
+    {
+        const acpi_madt_entry *header = (const acpi_madt_entry *)entry;
+
+        if (header->length < sizeof(acpi_madt_entry) || entry + header->length > end)
+        {
+            break;
+        }
+
+        entry += header->length;
+
+        if (header->type != ACPI_MADT_IOAPIC || header->length < sizeof(acpi_madt_ioapic))
+        {
+            continue;
+        }
+
+        const acpi_madt_ioapic *ioapic = (const acpi_madt_ioapic *)header;
+
+        if (ioapic->gsi_base == 0)
+        {
+            return ioapic->address;
+        }
+    }
+
+    return IOAPIC_DEFAULT_BASE;
+}
+
+/**
+ * @brief Switches interrupt delivery from the 8259 PICs to the APICs.
+ * The local APIC receives MSIs and must be software-enabled through the
+ * spurious vector register. Every IOAPIC input starts masked; drivers
+ * route the ones they need. Needs acpi_init for the IOAPIC address.
+ */
+void apic_init(void)
+{
+    pic_disable();
+
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+
+    lapic_base = (uintptr_t)(base & ~0xFFFULL);
+    map_mmio_region(lapic_base, 0x1000, MEM_UC);
+
+    lapic_enable();
+
+    ioapic_base = ioapic_find_base();
+    map_mmio_region(ioapic_base, 0x1000, MEM_UC);
+    ioapic_entries = (uint8_t)(((ioapic_read(IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1);
+
+    for (uint8_t gsi = 0; gsi < ioapic_entries; gsi++)
+    {
+        ioapic_route(gsi, 0, 0, true);
+    }
+
+    serial_print("Local APIC ");
+    serial_print_hex8(lapic_id());
+    serial_print(" enabled, IOAPIC with ");
+    serial_print_dec(ioapic_entries);
+    serial_print(" inputs\n");
+}
+
+/**
+ * @brief Sets up the local APIC timer as a one-shot event source.
+ * Preferred is TSC-deadline mode, where the deadline is an absolute TSC
+ * value and nothing needs calibrating. Otherwise the timer runs one-shot
+ * from the bus clock divided by 16, measured here against ktime. It is
+ * never periodic; the owner arms it for its next deadline each time.
+ */
+void lapic_timer_init(uint8_t vector)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    lapic_tsc_deadline = (ecx & CPUID_TSC_DEADLINE) != 0;
+
+    if (lapic_tsc_deadline)
+    {
+        mmio_write32(lapic_base, LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | vector);
+
+        // The LVT write must be visible before the first WRMSR (SDM 10.5.4.1)
+        __asm__ __volatile__("mfence" : : : "memory");
+
+        serial_print("LAPIC timer: TSC-deadline mode\n");
+        return;
+    }
+
+    mmio_write32(lapic_base, LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+
+    // Every CPU's timer runs off the same bus clock, measuring once is enough
+    if (lapic_timer_hz != 0)
+    {
+        mmio_write32(lapic_base, LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | vector);
+        return;
+    }
+
+    mmio_write32(lapic_base, LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_ONESHOT | vector);
+    mmio_write32(lapic_base, LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+
+    mdelay(KTIME_CALIBRATE_MS);
+
+    uint32_t elapsed = 0xFFFFFFFF - mmio_read32(lapic_base, LAPIC_TIMER_CURRENT);
+
+    mmio_write32(lapic_base, LAPIC_TIMER_INITIAL, 0);
+    mmio_write32(lapic_base, LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | vector);
+
+    lapic_timer_hz = (uint64_t)elapsed * 1000 / KTIME_CALIBRATE_MS;
+
+    serial_print("LAPIC timer: one-shot mode, ");
+    serial_print_dec(lapic_timer_hz / 1000);
+    serial_print(" kHz\n");
+}
+
+/**
+ * @brief Fires the timer interrupt once at deadline_ns (ktime_ns time).
+ * A deadline already in the past fires right away. In one-shot mode a
+ * deadline more than a second out is cut short, the interrupt handler
+ * simply finds nothing due and arms again.
+ */
+void lapic_timer_arm(uint64_t deadline_ns)
+{
+    if (lapic_tsc_deadline)
+    {
+        wrmsr(IA32_TSC_DEADLINE_MSR, ktime_ns_to_tsc(deadline_ns));
+        return;
+    }
+
+    uint64_t now = ktime_ns();
+    uint64_t delta = deadline_ns > now ? deadline_ns - now : 0;
+
+    if (delta > NSEC_PER_SEC)
+    {
+        delta = NSEC_PER_SEC;
+    }
+
+    uint64_t ticks = delta * lapic_timer_hz / NSEC_PER_SEC;
+
+    // A count of 0 would stop the timer instead of firing it
+    if (ticks == 0)
+    {
+        ticks = 1;
+    }
+
+    if (ticks > 0xFFFFFFFF)
+    {
+        ticks = 0xFFFFFFFF;
+    }
+
+    mmio_write32(lapic_base, LAPIC_TIMER_INITIAL, (uint32_t)ticks);
+}
+
+void lapic_timer_disarm(void)
+{
+    if (lapic_tsc_deadline)
+    {
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    }
+    else
+    {
+        mmio_write32(lapic_base, LAPIC_TIMER_INITIAL, 0);
+    }
+}
\ No newline at end of file
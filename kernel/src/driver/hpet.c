@@ -0,0 +1,75 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "acpi.h"
+#include "memory.h"
+#include "ports.h"
+#include "driver/hpet.h"
+#include "driver/serial.h"
+
+static uintptr_t hpet_base;
+static uint64_t hpet_period;
+static bool hpet_64bit;
+
+/**
+ * @brief Finds the HPET through ACPI and starts its main counter.
+ * Only the free running counter is used, as a reference clock to
+ * calibrate the TSC against; none of the comparators are set up.
+ * @return false if there is no usable HPET.
+ */
+bool hpet_init(void)
+{
+    const acpi_hpet *table = (const acpi_hpet *)acpi_find_table("HPET");
+
+    if (table == NULL || table->address.address_space != 0 || table->address.address == 0)
+    {
+        return false;
+    }
+
+    map_mmio_region(table->address.address, HPET_REGISTER_SIZE, MEM_UC);
+
+    uintptr_t base = (uintptr_t)table->address.address;
+    uint64_t capabilities = mmio_read64(base, HPET_GENERAL_CAPABILITIES);
+    uint64_t period = capabilities >> HPET_CAP_PERIOD_SHIFT;
+
+    if (period == 0 || period > HPET_MAX_PERIOD_FS)
+    {
+        serial_print("HPET: invalid counter period\n");
+        return false;
+    }
+
+    mmio_write64(base, HPET_GENERAL_CONFIG, mmio_read64(base, HPET_GENERAL_CONFIG) | HPET_CONFIG_ENABLE);
+
+    hpet_base = base;
+    hpet_period = period;
+    hpet_64bit = (capabilities & HPET_CAP_COUNTER_64BIT) != 0;
+
+    serial_print("HPET at ");
+    serial_print_hex((uint32_t)base);
+    serial_print(", period ");
+    serial_print_dec(period);
+    serial_print(" fs\n");
+
+    return true;
+}
+
+bool hpet_available(void)
+{
+    return hpet_base != 0;
+}
+
+/**
+ * A 32-bit counter wraps after a few minutes at the usual 14.3 MHz,
+ * callers only ever use it over short intervals.
+ */
+uint64_t hpet_read_counter(void)
+{
+    uint64_t value = mmio_read64(hpet_base, HPET_MAIN_COUNTER);
+
+    return hpet_64bit ? value : (uint32_t)value;
+}
+
+uint64_t hpet_period_fs(void)
+{
+    return hpet_period;
+}
@@ -1,17 +1,31 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include "acpi.h"
+#include "idt.h"
+#include "ktime.h"
+#include "memory.h"
 #include "ports.h"
+#include "slab.h"
 #include "driver/pci.h"
 #include "driver/serial.h"
 #include "driver/vga.h"
 #include "driver/ahci.h"
+#include "driver/apic.h"
 
-#define MAX_PCI_DEVICES 64
-
-static pci_device pci_devices[MAX_PCI_DEVICES];
+// Devices in discovery order, allocated as they are found
+static pci_device *pci_devices;
+static pci_device *pci_devices_tail;
 static uint32_t pci_device_count = 0;
 
+// One bit per bus number already walked by pci_scan_bus
+static uint32_t pci_buses_scanned[8];
+static uint32_t pci_bus_count;
+
+// ECAM windows from the MCFG table, NULL when only port I/O is available
+static pci_ecam_region *pci_ecam;
+static uint32_t pci_ecam_count;
+
 static uint32_t pci_config_address(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset)
 {
     return (uint32_t)
@@ -24,56 +38,200 @@ static uint32_t pci_config_address(uint8_t bus, uint8_t device, uint8_t function
     );
 }
 
-uint32_t pci_config_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset)
+/**
+ * @brief Finds the memory mapped address of a config register.
+ * ECAM gives every function 4 KiB at base + (bus << 20 | device << 15 |
+ * function << 12), so an access is one load or store of the register's
+ * own width instead of an address write plus a data port access.
+ * @return The address, or 0 if no ECAM window covers the bus.
+ */
+static uintptr_t pci_ecam_address(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset)
+{
+    for (uint32_t i = 0; i < pci_ecam_count; i++)
+    {
+        const pci_ecam_region *region = &pci_ecam[i];
+
+        if (region->segment == 0 && bus >= region->start_bus && bus <= region->end_bus)
+        {
+            return (uintptr_t)(region->base +
+                (((uint64_t)bus << 20) | ((uint64_t)device << 15) | ((uint64_t)function << 12) | (offset & 0xFFF)));
+        }
+    }
+
+    return 0;
+}
+
+uint32_t pci_config_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset)
 {
-    uint32_t address = pci_config_address(bus, device, function, offset);
+    uintptr_t ecam = pci_ecam_address(bus, device, function, offset & ~3);
+
+    if (ecam != 0)
+    {
+        return *(volatile uint32_t *)ecam;
+    }
+
+    // Extended config space is only reachable through ECAM
+    if (offset >= PCI_CONFIG_SPACE_SIZE)
+    {
+        return 0xFFFFFFFF;
+    }
+
+    uint32_t address = pci_config_address(bus, device, function, (uint8_t)offset);
     outl(PCI_CONFIG_ADDRESS, address);
     return inl(PCI_CONFIG_DATA);
 }
 
-uint16_t pci_config_read_word(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset)
+uint16_t pci_config_read_word(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset)
 {
-    uint32_t address = pci_config_address(bus, device, function, offset);
-    outl(PCI_CONFIG_ADDRESS, address);
-    return (uint16_t)((inl(PCI_CONFIG_DATA) >> ((offset & 2) * 8)) & 0xFFFF);
+    uintptr_t ecam = pci_ecam_address(bus, device, function, offset & ~1);
+
+    if (ecam != 0)
+    {
+        return *(volatile uint16_t *)ecam;
+    }
+
+    return (uint16_t)((pci_config_read_dword(bus, device, function, offset) >> ((offset & 2) * 8)) & 0xFFFF);
 }
 
-uint8_t pci_config_read_byte(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset)
+uint8_t pci_config_read_byte(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset)
 {
-    uint32_t address = pci_config_address(bus, device, function, offset);
-    outl(PCI_CONFIG_ADDRESS, address);
-    return (uint8_t)((inl(PCI_CONFIG_DATA) >> ((offset & 3) * 8)) & 0xFF);
+    uintptr_t ecam = pci_ecam_address(bus, device, function, offset);
+
+    if (ecam != 0)
+    {
+        return *(volatile uint8_t *)ecam;
+    }
+
+    return (uint8_t)((pci_config_read_dword(bus, device, function, offset) >> ((offset & 3) * 8)) & 0xFF);
 }
 
-void pci_config_write_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value)
+void pci_config_write_dword(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint32_t value)
 {
-    uint32_t address = pci_config_address(bus, device, function, offset);
+    uintptr_t ecam = pci_ecam_address(bus, device, function, offset & ~3);
+
+    if (ecam != 0)
+    {
+        *(volatile uint32_t *)ecam = value;
+        return;
+    }
+
+    if (offset >= PCI_CONFIG_SPACE_SIZE)
+    {
+        return;
+    }
+
+    uint32_t address = pci_config_address(bus, device, function, (uint8_t)offset);
     outl(PCI_CONFIG_ADDRESS, address);
     outl(PCI_CONFIG_DATA, value);
 }
 
-void pci_config_write_word(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint16_t value)
+/**
+ * Through ECAM narrow writes go straight to the register. The port
+ * interface only moves whole dwords, there the neighbouring bytes have
+ * to be read and written back unchanged.
+ */
+void pci_config_write_word(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint16_t value)
 {
-    uint32_t address = pci_config_address(bus, device, function, offset);
-    uint32_t old_value = pci_config_read_dword(bus, device, function, offset & 0xFC);
+    uintptr_t ecam = pci_ecam_address(bus, device, function, offset & ~1);
+
+    if (ecam != 0)
+    {
+        *(volatile uint16_t *)ecam = value;
+        return;
+    }
+
+    uint32_t old_value = pci_config_read_dword(bus, device, function, offset & ~3);
     uint32_t shift = (offset & 2) * 8;
     uint32_t mask = 0xFFFF << shift;
     uint32_t new_value = (old_value & ~mask) | ((uint32_t)value << shift);
     
-    outl(PCI_CONFIG_ADDRESS, address);
-    outl(PCI_CONFIG_DATA, new_value);
+    pci_config_write_dword(bus, device, function, offset & ~3, new_value);
 }
 
-void pci_config_write_byte(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint8_t value)
+void pci_config_write_byte(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint8_t value)
 {
-    uint32_t address = pci_config_address(bus, device, function, offset);
-    uint32_t old_value = pci_config_read_dword(bus, device, function, offset & 0xFC);
+    uintptr_t ecam = pci_ecam_address(bus, device, function, offset);
+
+    if (ecam != 0)
+    {
+        *(volatile uint8_t *)ecam = value;
+        return;
+    }
+
+    uint32_t old_value = pci_config_read_dword(bus, device, function, offset & ~3);
     uint32_t shift = (offset & 3) * 8;
     uint32_t mask = 0xFF << shift;
     uint32_t new_value = (old_value & ~mask) | ((uint32_t)value << shift);
     
-    outl(PCI_CONFIG_ADDRESS, address);
-    outl(PCI_CONFIG_DATA, new_value);
+    pci_config_write_dword(bus, device, function, offset & ~3, new_value);
+}
+
+/**
+ * @brief Maps the ECAM windows the firmware lists in the MCFG table.
+ * Only segment 0 is used, the config helpers have no segment argument.
+ * Each bus takes 1 MiB of UC mappings, which large pages keep cheap.
+ * @return true if at least one window was set up.
+ */
+static bool pci_ecam_init(void)
+{
+    const acpi_mcfg *mcfg = (const acpi_mcfg *)acpi_find_table("MCFG");
+
+    pci_ecam = NULL;
+    pci_ecam_count = 0;
+
+    if (mcfg == NULL)
+    {
+        serial_print("PCI: No MCFG table, using port I/O config access\n");
+        return false;
+    }
+
+    uint32_t count = (mcfg->header.length - sizeof(acpi_mcfg)) / sizeof(acpi_mcfg_allocation);
+    const acpi_mcfg_allocation *allocations = (const acpi_mcfg_allocation *)(mcfg + 1);
+    pci_ecam_region *regions = kmalloc(count * sizeof(pci_ecam_region));
+
+    if (regions == NULL)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const acpi_mcfg_allocation *alloc = &allocations[i];
+
+        if (alloc->segment != 0 || alloc->end_bus < alloc->start_bus)
+        {
+            continue;
+        }
+
+        uint64_t start = alloc->base_address + ((uint64_t)alloc->start_bus << 20);
+        uint64_t size = (uint64_t)(alloc->end_bus - alloc->start_bus + 1) << 20;
+
+        map_mmio_region(start, size, MEM_UC);
+
+        regions[pci_ecam_count].base = alloc->base_address;
+        regions[pci_ecam_count].segment = alloc->segment;
+        regions[pci_ecam_count].start_bus = alloc->start_bus;
+        regions[pci_ecam_count].end_bus = alloc->end_bus;
+        pci_ecam_count++;
+
+        serial_print("PCI: ECAM at ");
+        serial_print_hex((uint32_t)start);
+        serial_print(" for buses ");
+        serial_print_hex8(alloc->start_bus);
+        serial_print("-");
+        serial_print_hex8(alloc->end_bus);
+        serial_print("\n");
+    }
+
+    if (pci_ecam_count == 0)
+    {
+        kfree(regions);
+        return false;
+    }
+
+    pci_ecam = regions;
+
+    return true;
 }
 
 bool pci_device_exists(uint8_t bus, uint8_t device, uint8_t function)
@@ -97,39 +255,116 @@ void pci_read_device_info(uint8_t bus, uint8_t device, uint8_t function, pci_dev
     dev->header_type = pci_config_read_byte(bus, device, function, PCI_HEADER_TYPE);
     dev->interrupt_line = pci_config_read_byte(bus, device, function, PCI_INTERRUPT_LINE);
     dev->interrupt_pin = pci_config_read_byte(bus, device, function, PCI_INTERRUPT_PIN);
+    dev->secondary_bus = 0;
+    dev->subordinate_bus = 0;
+
+    // The bus numbers of a bridge sit where BAR2 would be, sizing them
+    // like a BAR would renumber the buses behind it
+    if ((dev->header_type & PCI_HEADER_TYPE_MASK) == PCI_HEADER_TYPE_BRIDGE)
+    {
+        dev->bar_count = PCI_BRIDGE_BAR_COUNT;
+        dev->secondary_bus = pci_config_read_byte(bus, device, function, PCI_SECONDARY_BUS);
+        dev->subordinate_bus = pci_config_read_byte(bus, device, function, PCI_SUBORDINATE_BUS);
+    }
+    else
+    {
+        dev->bar_count = PCI_NORMAL_BAR_COUNT;
+    }
 
     for (uint8_t i = 0; i < 6; i++) 
     {
-        dev->bar[i] = pci_config_read_dword(bus, device, function, PCI_BAR0 + (i * 4));
+        dev->bar[i] = (i < dev->bar_count) ? pci_config_read_dword(bus, device, function, PCI_BAR0 + (i * 4)) : 0;
     }
 }
 
-uint32_t pci_get_bar_size(pci_device *dev, uint8_t bar_num)
+/**
+ * A 64-bit memory BAR spans two registers, the next one holds the upper
+ * half of the address and is not a BAR of its own.
+ */
+bool pci_bar_is_64bit(pci_device *dev, uint8_t bar_num)
+{
+    uint32_t bar = dev->bar[bar_num];
+
+    return bar_num + 1 < dev->bar_count && !(bar & PCI_BAR_TYPE_IO) &&
+        (bar & PCI_BAR_MEM_TYPE_MASK) == PCI_BAR_MEM_TYPE_64;
+}
+
+uint64_t pci_get_bar_address(pci_device *dev, uint8_t bar_num)
 {
-    if (bar_num >= 6) 
+    if (bar_num >= dev->bar_count) 
     {
         return 0;
     }
 
-    uint8_t bar_offset = PCI_BAR0 + (bar_num * 4);
-    uint32_t original = pci_config_read_dword(dev->bus, dev->device, dev->function, bar_offset);
+    uint32_t bar = dev->bar[bar_num];
 
-    pci_config_write_dword(dev->bus, dev->device, dev->function, bar_offset, 0xFFFFFFFF);
+    if (bar & PCI_BAR_TYPE_IO)
+    {
+        return bar & PCI_BAR_IO_MASK;
+    }
 
-    uint32_t size_mask = pci_config_read_dword(dev->bus, dev->device, dev->function, bar_offset);
+    uint64_t address = bar & PCI_BAR_MMIO_MASK;
 
+    if (pci_bar_is_64bit(dev, bar_num))
+    {
+        address |= (uint64_t)dev->bar[bar_num + 1] << 32;
+    }
+
+    return address;
+}
+
+/**
+ * @brief Sizes a BAR by writing all ones and reading back which bits stick.
+ * For a 64-bit BAR both halves are sized together. Decoding is turned off
+ * meanwhile, otherwise the all-ones address could claim cycles meant for
+ * other devices.
+ * @return The size in bytes, or 0 for an unimplemented BAR.
+ */
+uint64_t pci_get_bar_size(pci_device *dev, uint8_t bar_num)
+{
+    if (bar_num >= dev->bar_count) 
+    {
+        return 0;
+    }
+
+    uint16_t bar_offset = PCI_BAR0 + (bar_num * 4);
+    bool is_64bit = pci_bar_is_64bit(dev, bar_num);
+    uint16_t command = pci_config_read_word(dev->bus, dev->device, dev->function, PCI_COMMAND);
+
+    pci_config_write_word(dev->bus, dev->device, dev->function, PCI_COMMAND,
+        command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+
+    uint32_t original = pci_config_read_dword(dev->bus, dev->device, dev->function, bar_offset);
+    pci_config_write_dword(dev->bus, dev->device, dev->function, bar_offset, 0xFFFFFFFF);
+    uint64_t size_mask = pci_config_read_dword(dev->bus, dev->device, dev->function, bar_offset);
     pci_config_write_dword(dev->bus, dev->device, dev->function, bar_offset, original);
 
+    if (is_64bit)
+    {
+        uint32_t original_high = pci_config_read_dword(dev->bus, dev->device, dev->function, bar_offset + 4);
+        pci_config_write_dword(dev->bus, dev->device, dev->function, bar_offset + 4, 0xFFFFFFFF);
+        size_mask |= (uint64_t)pci_config_read_dword(dev->bus, dev->device, dev->function, bar_offset + 4) << 32;
+        pci_config_write_dword(dev->bus, dev->device, dev->function, bar_offset + 4, original_high);
+    }
+    else
+    {
+        // Upper bits a 32-bit BAR cannot decode
+        size_mask |= 0xFFFFFFFF00000000ULL;
+    }
+
+    pci_config_write_word(dev->bus, dev->device, dev->function, PCI_COMMAND, command);
+
     if (original & PCI_BAR_TYPE_IO) 
     {
-        size_mask &= PCI_BAR_IO_MASK;
+        size_mask &= ~(uint64_t)~PCI_BAR_IO_MASK;
+        size_mask |= 0xFFFF0000;
     } 
     else 
     {
-        size_mask &= PCI_BAR_MMIO_MASK;
+        size_mask &= ~(uint64_t)~PCI_BAR_MMIO_MASK;
     }
     
-    if (size_mask == 0) 
+    if ((uint32_t)size_mask == 0 && (size_mask >> 32) == 0xFFFFFFFF) 
     {
         return 0;
     }
@@ -158,13 +393,401 @@ void pci_enable_io_space(pci_device *dev)
     pci_config_write_word(dev->bus, dev->device, dev->function, PCI_COMMAND, command);
 }
 
+/**
+ * @brief Walks the capability list for a capability ID.
+ * Capabilities are a linked list in config space starting at offset 0x34,
+ * each entry holding its ID and the offset of the next. The bottom two
+ * bits of every pointer are reserved and must be masked off.
+ * @return The config space offset of the capability, or 0 if absent.
+ */
+uint8_t pci_find_capability(pci_device *dev, uint8_t cap_id)
+{
+    uint16_t status = pci_config_read_word(dev->bus, dev->device, dev->function, PCI_STATUS);
+
+    if (!(status & PCI_STATUS_CAP_LIST))
+    {
+        return 0;
+    }
+
+    uint8_t offset = pci_config_read_byte(dev->bus, dev->device, dev->function, PCI_CAPABILITY_LIST) & 0xFC;
+
+    // 48 is the most entries that fit in the 192 bytes after the header,
+    // this bounds the walk if a broken device loops its list.
+    for (int i = 0; i < 48 && offset != 0; i++)
+    {
+        if (pci_config_read_byte(dev->bus, dev->device, dev->function, offset) == cap_id)
+        {
+            return offset;
+        }
+
+        offset = pci_config_read_byte(dev->bus, dev->device, dev->function, offset + 1) & 0xFC;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Walks the capability list once and records the ones drivers use.
+ * Done during enumeration so later lookups of MSI, MSI-X, PCIe and power
+ * management do not have to chase the list through config space again.
+ */
+void pci_read_capabilities(pci_device *dev)
+{
+    dev->cap_pm = 0;
+    dev->cap_msi = 0;
+    dev->cap_msix = 0;
+    dev->cap_pcie = 0;
+    dev->msix_table = 0;
+    dev->msix_entries = 0;
+
+    uint16_t status = pci_config_read_word(dev->bus, dev->device, dev->function, PCI_STATUS);
+
+    if (!(status & PCI_STATUS_CAP_LIST))
+    {
+        return;
+    }
+
+    uint8_t offset = pci_config_read_byte(dev->bus, dev->device, dev->function, PCI_CAPABILITY_LIST) & 0xFC;
+
+    for (int i = 0; i < 48 && offset != 0; i++)
+    {
+        switch (pci_config_read_byte(dev->bus, dev->device, dev->function, offset))
+        {
+            case PCI_CAP_ID_PM: dev->cap_pm = offset; break;
+            case PCI_CAP_ID_MSI: dev->cap_msi = offset; break;
+            case PCI_CAP_ID_MSIX: dev->cap_msix = offset; break;
+            case PCI_CAP_ID_PCIE: dev->cap_pcie = offset; break;
+            default: break;
+        }
+
+        offset = pci_config_read_byte(dev->bus, dev->device, dev->function, offset + 1) & 0xFC;
+    }
+}
+
+/**
+ * @brief Moves a device between D-states through its PM capability.
+ * Leaving D3hot resets most of the function and takes up to 10 ms before
+ * config space is usable again (PCI PM 1.2, 5.6.1).
+ * @return false if the device has no power management capability.
+ */
+bool pci_set_power_state(pci_device *dev, uint8_t state)
+{
+    if (dev->cap_pm == 0)
+    {
+        return false;
+    }
+
+    uint16_t control = pci_config_read_word(dev->bus, dev->device, dev->function, dev->cap_pm + PCI_PM_CTRL);
+    uint8_t current = control & PCI_PM_CTRL_STATE_MASK;
+
+    if (current == state)
+    {
+        return true;
+    }
+
+    control = (control & ~PCI_PM_CTRL_STATE_MASK) | (state & PCI_PM_CTRL_STATE_MASK);
+    pci_config_write_word(dev->bus, dev->device, dev->function, dev->cap_pm + PCI_PM_CTRL, control);
+
+    if (current == PCI_PM_D3HOT || state == PCI_PM_D3HOT)
+    {
+        mdelay(10);
+    }
+
+    return true;
+}
+
+static void pci_disable_intx(pci_device *dev)
+{
+    uint16_t command = pci_config_read_word(dev->bus, dev->device, dev->function, PCI_COMMAND);
+    command |= PCI_COMMAND_INTX_DISABLE;
+    pci_config_write_word(dev->bus, dev->device, dev->function, PCI_COMMAND, command);
+}
+
+/**
+ * @brief Programs the MSI capability for 2^log2_count vectors from vector on.
+ * An MSI is a posted memory write of the data word to the LAPIC window;
+ * the address selects the destination CPU and the data the vector. With
+ * more than one message the device ORs the message number into the low
+ * bits of the data, which is why the block must be aligned.
+ */
+static void pci_msi_program(pci_device *dev, uint8_t vector, uint8_t log2_count, uint8_t apic_id)
+{
+    uint8_t cap = dev->cap_msi;
+    uint16_t control = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_CONTROL);
+
+    pci_config_write_dword(dev->bus, dev->device, dev->function, cap + PCI_MSI_ADDRESS_LOW, MSI_ADDRESS_BASE | ((uint32_t)apic_id << 12));
+
+    if (control & PCI_MSI_CONTROL_64BIT)
+    {
+        pci_config_write_dword(dev->bus, dev->device, dev->function, cap + PCI_MSI_ADDRESS_HIGH, 0);
+        pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_DATA_64, vector);
+    }
+    else
+    {
+        pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_DATA_32, vector);
+    }
+
+    control &= ~PCI_MSI_CONTROL_MME_MASK;
+    control |= ((uint16_t)log2_count << PCI_MSI_CONTROL_MME_SHIFT) & PCI_MSI_CONTROL_MME_MASK;
+    control |= PCI_MSI_CONTROL_ENABLE;
+    pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_CONTROL, control);
+
+    // Legacy INTx is disabled so the device cannot raise both
+    pci_disable_intx(dev);
+}
+
+/**
+ * @brief Switches a device from INTx to a single, caller chosen MSI vector.
+ * @return false if the device has no MSI capability.
+ */
+bool pci_enable_msi(pci_device *dev, uint8_t vector, uint8_t apic_id)
+{
+    if (dev->cap_msi == 0)
+    {
+        return false;
+    }
+
+    pci_msi_program(dev, vector, 0, apic_id);
+
+    return true;
+}
+
+/**
+ * @brief Allocates up to count MSI vectors and enables them.
+ * The device advertises how many messages it can use (MMC); the request
+ * is cut down to that and to a power of two, then halved until a free
+ * aligned block of vectors is found. All messages go to the same CPU,
+ * per-vector steering needs MSI-X.
+ * @return The number of vectors granted, with the first in first_vector,
+ * or 0 if the device has no MSI or no vector is free.
+ */
+int pci_alloc_msi(pci_device *dev, int count, uint8_t apic_id, uint8_t *first_vector)
+{
+    if (dev->cap_msi == 0 || count <= 0)
+    {
+        return 0;
+    }
+
+    uint16_t control = pci_config_read_word(dev->bus, dev->device, dev->function, dev->cap_msi + PCI_MSI_CONTROL);
+    uint8_t log2_count = (control & PCI_MSI_CONTROL_MMC_MASK) >> PCI_MSI_CONTROL_MMC_SHIFT;
+
+    // MSI tops out at 32 messages, larger encodings are reserved
+    if (log2_count > 5)
+    {
+        log2_count = 5;
+    }
+
+    while (log2_count > 0 && (1 << log2_count) > count)
+    {
+        log2_count--;
+    }
+
+    for (;;)
+    {
+        int vector = idt_alloc_vectors(1 << log2_count);
+
+        if (vector >= 0)
+        {
+            pci_msi_program(dev, (uint8_t)vector, log2_count, apic_id);
+            *first_vector = (uint8_t)vector;
+            return 1 << log2_count;
+        }
+
+        if (log2_count == 0)
+        {
+            return 0;
+        }
+
+        log2_count--;
+    }
+}
+
+/**
+ * @brief Moves every MSI message of a device to another CPU.
+ * The messages share one address register, so they can only move
+ * together. The vector and message count in use are read back and
+ * programmed again with the new destination.
+ * @return false if MSI is not enabled on the device.
+ */
+bool pci_msi_route(pci_device *dev, uint8_t apic_id)
+{
+    if (dev->cap_msi == 0)
+    {
+        return false;
+    }
+
+    uint8_t cap = dev->cap_msi;
+    uint16_t control = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_CONTROL);
+
+    if (!(control & PCI_MSI_CONTROL_ENABLE))
+    {
+        return false;
+    }
+
+    uint8_t data_reg = (control & PCI_MSI_CONTROL_64BIT) ? PCI_MSI_DATA_64 : PCI_MSI_DATA_32;
+    uint16_t vector = pci_config_read_word(dev->bus, dev->device, dev->function, cap + data_reg);
+    uint8_t log2_count = (control & PCI_MSI_CONTROL_MME_MASK) >> PCI_MSI_CONTROL_MME_SHIFT;
+
+    pci_msi_program(dev, (uint8_t)vector, log2_count, apic_id);
+
+    return true;
+}
+
+/**
+ * @brief Cuts an enabled MSI block down to its first message.
+ * With MME at 0 the device sends every interrupt as message 0, so the
+ * vectors behind the other messages can be freed.
+ * @return false if MSI is not enabled on the device.
+ */
+bool pci_msi_single(pci_device *dev)
+{
+    if (dev->cap_msi == 0)
+    {
+        return false;
+    }
+
+    uint8_t cap = dev->cap_msi;
+    uint16_t control = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_CONTROL);
+
+    if (!(control & PCI_MSI_CONTROL_ENABLE))
+    {
+        return false;
+    }
+
+    uint8_t data_reg = (control & PCI_MSI_CONTROL_64BIT) ? PCI_MSI_DATA_64 : PCI_MSI_DATA_32;
+    uint16_t vector = pci_config_read_word(dev->bus, dev->device, dev->function, cap + data_reg);
+    uint32_t address = pci_config_read_dword(dev->bus, dev->device, dev->function, cap + PCI_MSI_ADDRESS_LOW);
+
+    pci_msi_program(dev, (uint8_t)vector, 0, (uint8_t)(address >> 12));
+
+    return true;
+}
+
+static uintptr_t pci_msix_entry(pci_device *dev, uint16_t entry)
+{
+    return dev->msix_table + (uintptr_t)entry * PCI_MSIX_ENTRY_SIZE;
+}
+
+/**
+ * @brief Points one MSI-X table entry at a vector on a CPU.
+ * The entry is masked while it is rewritten, a message sent halfway
+ * through could otherwise combine the old address with the new data.
+ * @return false if MSI-X is not enabled or the entry does not exist.
+ */
+bool pci_msix_route(pci_device *dev, uint16_t entry, uint8_t vector, uint8_t apic_id)
+{
+    if (dev->msix_table == 0 || entry >= dev->msix_entries)
+    {
+        return false;
+    }
+
+    uintptr_t base = pci_msix_entry(dev, entry);
+
+    mmio_write32(base, PCI_MSIX_ENTRY_VECTOR_CONTROL, PCI_MSIX_ENTRY_MASKED);
+    mmio_write32(base, PCI_MSIX_ENTRY_ADDRESS_LOW, MSI_ADDRESS_BASE | ((uint32_t)apic_id << 12));
+    mmio_write32(base, PCI_MSIX_ENTRY_ADDRESS_HIGH, 0);
+    mmio_write32(base, PCI_MSIX_ENTRY_DATA, vector);
+    mmio_write32(base, PCI_MSIX_ENTRY_VECTOR_CONTROL, 0);
+
+    return true;
+}
+
+void pci_msix_mask(pci_device *dev, uint16_t entry, bool masked)
+{
+    if (dev->msix_table == 0 || entry >= dev->msix_entries)
+    {
+        return;
+    }
+
+    mmio_write32(pci_msix_entry(dev, entry), PCI_MSIX_ENTRY_VECTOR_CONTROL, masked ? PCI_MSIX_ENTRY_MASKED : 0);
+}
+
+/**
+ * @brief Enables MSI-X with one vector per table entry, up to count entries.
+ * The table lives in one of the device's memory BARs at the offset the
+ * capability gives. Unlike MSI every entry has its own address, so
+ * pci_msix_route can later move single entries to other CPUs. Entries
+ * beyond the ones granted stay masked.
+ * @return The number of entries set up, their vectors in vectors[], or 0
+ * if the device has no MSI-X or no vector could be allocated.
+ */
+int pci_alloc_msix(pci_device *dev, int count, uint8_t apic_id, uint8_t *vectors)
+{
+    if (dev->cap_msix == 0 || count <= 0)
+    {
+        return 0;
+    }
+
+    uint8_t cap = dev->cap_msix;
+    uint16_t control = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CONTROL);
+    uint32_t table = pci_config_read_dword(dev->bus, dev->device, dev->function, cap + PCI_MSIX_TABLE);
+    uint16_t size = (control & PCI_MSIX_CONTROL_SIZE_MASK) + 1;
+    uint8_t bir = table & PCI_MSIX_BIR_MASK;
+    uint64_t bar = pci_get_bar_address(dev, bir);
+
+    if (bar == 0 || (dev->bar[bir] & PCI_BAR_TYPE_IO))
+    {
+        return 0;
+    }
+
+    uint64_t table_phys = bar + (table & ~(uint32_t)PCI_MSIX_BIR_MASK);
+
+    map_mmio_region(table_phys & ~0xFFFULL, ((table_phys & 0xFFF) + (uint64_t)size * PCI_MSIX_ENTRY_SIZE + 0xFFF) & ~0xFFFULL, MEM_UC);
+
+    dev->msix_table = (uintptr_t)table_phys;
+    dev->msix_entries = size;
+
+    // Hold off every message while the table is filled in
+    control |= PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_FUNCTION_MASK;
+    pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CONTROL, control);
+
+    int granted = 0;
+
+    for (uint16_t i = 0; i < size; i++)
+    {
+        int vector = (granted < count) ? idt_alloc_vectors(1) : -1;
+
+        if (vector < 0)
+        {
+            pci_msix_mask(dev, i, true);
+            continue;
+        }
+
+        pci_msix_route(dev, i, (uint8_t)vector, apic_id);
+        vectors[granted++] = (uint8_t)vector;
+    }
+
+    if (granted == 0)
+    {
+        control &= ~(PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_FUNCTION_MASK);
+        pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CONTROL, control);
+        dev->msix_table = 0;
+        dev->msix_entries = 0;
+        return 0;
+    }
+
+    // MSI and MSI-X must not both be on
+    if (dev->cap_msi != 0)
+    {
+        uint16_t msi_control = pci_config_read_word(dev->bus, dev->device, dev->function, dev->cap_msi + PCI_MSI_CONTROL);
+        pci_config_write_word(dev->bus, dev->device, dev->function, dev->cap_msi + PCI_MSI_CONTROL, msi_control & ~PCI_MSI_CONTROL_ENABLE);
+    }
+
+    pci_disable_intx(dev);
+
+    control &= ~PCI_MSIX_CONTROL_FUNCTION_MASK;
+    pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_CONTROL, control);
+
+    return granted;
+}
+
 pci_device* pci_find_device(uint16_t vendor_id, uint16_t device_id)
 {
-    for (uint32_t i = 0; i < pci_device_count; i++) 
+    for (pci_device *dev = pci_devices; dev != NULL; dev = dev->next) 
     {
-        if (pci_devices[i].vendor_id == vendor_id && pci_devices[i].device_id == device_id) 
+        if (dev->vendor_id == vendor_id && dev->device_id == device_id) 
         {
-            return &pci_devices[i];
+            return dev;
         }
     }
 
@@ -173,11 +796,11 @@ pci_device* pci_find_device(uint16_t vendor_id, uint16_t device_id)
 
 pci_device* pci_find_device_by_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if)
 {
-    for (uint32_t i = 0; i < pci_device_count; i++) 
+    for (pci_device *dev = pci_devices; dev != NULL; dev = dev->next) 
     {
-        if (pci_devices[i].class_code == class_code && pci_devices[i].subclass == subclass && pci_devices[i].prog_if == prog_if) 
+        if (dev->class_code == class_code && dev->subclass == subclass && dev->prog_if == prog_if) 
         {
-            return &pci_devices[i];
+            return dev;
         }
     }
 
@@ -204,68 +827,214 @@ static void pci_print_device(pci_device *dev)
     serial_print_hex8(dev->prog_if);
     serial_print("\n");
 
-    for (uint8_t i = 0; i < 6; i++) 
+    if ((dev->header_type & PCI_HEADER_TYPE_MASK) == PCI_HEADER_TYPE_BRIDGE)
+    {
+        serial_print("Bridge to buses ");
+        serial_print_hex8(dev->secondary_bus);
+        serial_print("-");
+        serial_print_hex8(dev->subordinate_bus);
+        serial_print("\n");
+    }
+
+    for (uint8_t i = 0; i < dev->bar_count; i++) 
     {
-        if (dev->bar[i] != 0 && dev->bar[i] != 0xFFFFFFFF) 
+        bool is_64bit = pci_bar_is_64bit(dev, i);
+        uint64_t address = pci_get_bar_address(dev, i);
+
+        if (address != 0 && dev->bar[i] != 0xFFFFFFFF) 
         {
             serial_print("BAR");
             serial_print_hex8(i);
             serial_print(": ");
-            serial_print_hex(dev->bar[i]);
+
+            if (is_64bit)
+            {
+                serial_print_hex((uint32_t)(address >> 32));
+            }
+
+            serial_print_hex((uint32_t)address);
+            serial_print(is_64bit ? " 64-bit" : "");
+            serial_print((dev->bar[i] & PCI_BAR_PREFETCHABLE) && !(dev->bar[i] & PCI_BAR_TYPE_IO) ? " prefetchable" : "");
             
-            uint32_t size = pci_get_bar_size(dev, i);
+            uint64_t size = pci_get_bar_size(dev, i);
             if (size > 0) 
             {
                 serial_print(" (Size: ");
-                serial_print_hex(size);
+
+                if (size >> 32)
+                {
+                    serial_print_hex((uint32_t)(size >> 32));
+                }
+
+                serial_print_hex((uint32_t)size);
                 serial_print(")");
             }
 
             serial_print("\n");
         }
+
+        // The upper half of a 64-bit BAR is not a BAR of its own
+        if (is_64bit)
+        {
+            i++;
+        }
+    }
+
+    if (dev->cap_pm || dev->cap_msi || dev->cap_msix || dev->cap_pcie)
+    {
+        serial_print("Capabilities:");
+        serial_print(dev->cap_pm ? " PM" : "");
+        serial_print(dev->cap_msi ? " MSI" : "");
+        serial_print(dev->cap_msix ? " MSI-X" : "");
+        serial_print(dev->cap_pcie ? " PCIe" : "");
+        serial_print("\n");
+    }
+}
+
+static void pci_scan_bus(uint8_t bus);
+
+/**
+ * @brief Records one function and descends into it if it is a bridge.
+ * The firmware has already numbered the buses, a PCI-to-PCI bridge
+ * forwards config cycles for its secondary through subordinate bus, so
+ * the secondary bus is the only place new devices can appear.
+ * @return false if no memory was left for the device record.
+ */
+static bool pci_scan_function(uint8_t bus, uint8_t device, uint8_t function)
+{
+    pci_device *dev = kmalloc(sizeof(pci_device));
+
+    if (dev == NULL) 
+    {
+        serial_print("Warning: No memory for PCI device\n");
+        return false;
+    }
+
+    pci_read_device_info(bus, device, function, dev);
+    pci_read_capabilities(dev);
+    dev->next = NULL;
+
+    if (pci_devices_tail != NULL)
+    {
+        pci_devices_tail->next = dev;
+    }
+    else
+    {
+        pci_devices = dev;
+    }
+
+    pci_devices_tail = dev;
+    pci_device_count++;
+
+    if (dev->class_code == PCI_CLASS_BRIDGE && dev->subclass == PCI_SUBCLASS_PCI_BRIDGE &&
+        (dev->header_type & PCI_HEADER_TYPE_MASK) == PCI_HEADER_TYPE_BRIDGE &&
+        dev->secondary_bus > bus)
+    {
+        pci_scan_bus(dev->secondary_bus);
+    }
+
+    return true;
+}
+
+static void pci_scan_device(uint8_t bus, uint8_t device)
+{
+    if (!pci_device_exists(bus, device, 0)) 
+    {
+        return;
+    }
+
+    uint8_t header_type = pci_config_read_byte(bus, device, 0, PCI_HEADER_TYPE);
+    uint8_t function_count = (header_type & PCI_HEADER_TYPE_MULTIFUNCTION) ? 8 : 1;
+
+    for (uint8_t function = 0; function < function_count; function++) 
+    {
+        if (function != 0 && !pci_device_exists(bus, device, function)) 
+        {
+            continue;
+        }
+
+        if (!pci_scan_function(bus, device, function))
+        {
+            return;
+        }
     }
 }
 
+/**
+ * A bridge with a secondary bus number that was already visited is
+ * misprogrammed, the bitmap keeps such a loop from recursing forever.
+ */
+static void pci_scan_bus(uint8_t bus)
+{
+    if (pci_buses_scanned[bus / 32] & (1U << (bus % 32)))
+    {
+        return;
+    }
+
+    pci_buses_scanned[bus / 32] |= 1U << (bus % 32);
+    pci_bus_count++;
+
+    for (uint8_t device = 0; device < 32; device++) 
+    {
+        pci_scan_device(bus, device);
+    }
+}
+
+/**
+ * @brief Finds every device by walking down from the host bridges.
+ * Only buses that a host bridge or a PCI-to-PCI bridge leads to are
+ * probed, instead of all 256 buses with 32 devices each. A single host
+ * bridge roots bus 0. If device 0 on bus 0 is multi-function, every
+ * function is a host bridge and its function number is its bus.
+ */
 void pci_enumerate(void)
 {
     serial_print("Starting PCI enumeration...\n\n");
     
+    pci_devices = NULL;
+    pci_devices_tail = NULL;
     pci_device_count = 0;
+    pci_bus_count = 0;
 
-    for (uint16_t bus = 0; bus < 256; bus++) 
+    for (int i = 0; i < 8; i++)
     {
-        for (uint8_t device = 0; device < 32; device++) 
-        {
-            if (!pci_device_exists(bus, device, 0)) 
-            {
-                continue;
-            }
+        pci_buses_scanned[i] = 0;
+    }
 
-            uint8_t header_type = pci_config_read_byte(bus, device, 0, PCI_HEADER_TYPE);
-            uint8_t function_count = (header_type & 0x80) ? 8 : 1;
+    uint64_t start = ktime_ns();
+    uint8_t header_type = pci_config_read_byte(0, 0, 0, PCI_HEADER_TYPE);
 
-            for (uint8_t function = 0; function < function_count; function++) 
+    if (!(header_type & PCI_HEADER_TYPE_MULTIFUNCTION))
+    {
+        pci_scan_bus(0);
+    }
+    else
+    {
+        for (uint8_t function = 0; function < 8; function++)
+        {
+            if (pci_device_exists(0, 0, function))
             {
-                if (!pci_device_exists(bus, device, function)) 
-                {
-                    continue;
-                }
-                
-                if (pci_device_count >= MAX_PCI_DEVICES) 
-                {
-                    serial_print("Warning: Maximum PCI device limit reached\n");
-                    return;
-                }
-                
-                pci_device *dev = &pci_devices[pci_device_count++];
-                pci_read_device_info(bus, device, function, dev);
-                pci_print_device(dev);
+                pci_scan_bus(function);
             }
         }
     }
-    
+
+    // Printing is kept out of the timed scan, the serial port is far
+    // slower than config space
+    uint64_t elapsed = ktime_ns() - start;
+
+    for (pci_device *dev = pci_devices; dev != NULL; dev = dev->next)
+    {
+        pci_print_device(dev);
+    }
+
     serial_print("\nTotal devices found: ");
-    serial_print_hex8(pci_device_count);
+    serial_print_dec(pci_device_count);
+    serial_print(" on ");
+    serial_print_dec(pci_bus_count);
+    serial_print(" buses in ");
+    serial_print_dec(elapsed / NSEC_PER_USEC);
+    serial_print(" us\n");
 
     serial_print("\nSearching for AHCI controller...\n");
     pci_device *ahci = pci_find_device_by_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_SATA, PCI_PROG_IF_AHCI);
@@ -279,6 +1048,9 @@ void pci_enumerate(void)
         serial_print_hex16(ahci->device_id);
         serial_print("\n\n");
 
+        // Leaving D3hot resets the command register, so wake it up first
+        pci_set_power_state(ahci, PCI_PM_D0);
+
         serial_print("Enabling bus mastering and memory space...\n");
         pci_enable_bus_mastering(ahci);
         pci_enable_memory_space(ahci);
@@ -298,13 +1070,16 @@ void pci_init(void)
 {
     serial_print("Initializing PCI subsystem...\n");
 
-    outl(PCI_CONFIG_ADDRESS, 0x80000000);
-    uint32_t test = inl(PCI_CONFIG_ADDRESS);
-    
-    if (test != 0x80000000) 
+    if (!pci_ecam_init())
     {
-        serial_print("ERROR: PCI not available!\n");
-        return;
+        outl(PCI_CONFIG_ADDRESS, 0x80000000);
+        uint32_t test = inl(PCI_CONFIG_ADDRESS);
+        
+        if (test != 0x80000000) 
+        {
+            serial_print("ERROR: PCI not available!\n");
+            return;
+        }
     }
     
     serial_print("PCI subsystem detected\n");
@@ -1,64 +1,53 @@
+#include "cpu.h"
 #include "ports.h"
 #include "driver/pit_timer.h"
 
 /**
- * @brief Performs a synchronous wait for a specified number of milliseconds.
- * EHCI initialization requires specific delays (e.g., waiting for the 
- * HCRESET bit to clear). Since we may not have an interrupt-driven scheduler 
- * yet, this function uses the Programmable Interval Timer (PIT) in a polling mode.
- * @param ms The number of milliseconds to wait.
+ * @brief Counts TSC cycles across a fixed number of PIT ticks.
+ * Used once at boot to calibrate the TSC, after that nothing touches
+ * the PIT. Channel 2 is used because its gate and OUT pin are wired to
+ * port 0x61, so the end of the count can be polled without an IRQ and
+ * without the read-back command.
+ * The TSC rate is not known yet, so the poll gives up after the cycles
+ * the fastest plausible TSC would count in twice the interval, in case
+ * OUT2 never rises (no PIT, or port 0x61 not wired to it).
+ * @param ticks Length of the measurement in 1.193182 MHz ticks.
+ * @return The number of TSC cycles that passed, 0 if OUT2 never went high.
  */
-void pit_wait(uint32_t ms) 
+uint64_t pit_measure_tsc(uint16_t ticks) 
 {
-    // The PIT frequency is fixed at 1.193182 MHz.
-    // Calculation: (ms * 1,193,182) / 1000 converts time to oscillator ticks.
-    uint32_t total_ticks = (uint32_t)((uint32_t)ms * PIT_BASE_FREQ / 1000);
+    uint8_t port_b = inb(PIT_PORT_B);
 
-    while (total_ticks > 0) 
-    {
-        // The PIT channel counters are only 16 bits wide (max 65535).
-        // To wait for periods longer than ~55ms, we must break the wait into 
-        // smaller chunks that fit into the hardware registers.
-        uint16_t current_chunk;
+    // Gate on, speaker off
+    outb(PIT_PORT_B, (port_b & ~PIT_PORT_B_SPEAKER) | PIT_PORT_B_GATE2);
 
-        if (total_ticks > 0xFFFF) 
-        {
-            current_chunk = 0xFFFF;
-        } 
-        else 
+    /**
+     * PIT command byte: 0xB0 (10 11 000 0)
+     * 10 - Select channel 2
+     * 11 - Access mode: lobyte/hibyte
+     * 000 - Mode 0: Interrupt on terminal count (OUT goes high at zero)
+     * 0 - Binary mode
+     */
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CHANNEL_2, (uint8_t)(ticks & 0xFF));
+    outb(PIT_CHANNEL_2, (uint8_t)((ticks >> 8) & 0xFF));
+
+    // Counting starts with the high byte of the count
+    uint64_t start = rdtsc();
+    uint64_t budget = 2 * (uint64_t)ticks * (PIT_MAX_TSC_HZ / PIT_BASE_FREQ);
+
+    while (!(inb(PIT_PORT_B) & PIT_PORT_B_OUT2))
+    {
+        if (rdtsc() - start > budget)
         {
-            current_chunk = (uint16_t) total_ticks;
+            outb(PIT_PORT_B, port_b);
+            return 0;
         }
+    }
 
-        /**
-         * PIT command byte: 0x34 (00 11 010 0)
-         * 00 - Select channel 0
-         * 11 - Access mode: lobyte/hibyte
-         * 010 - Mode 2: Rate generator (counts down and resets)
-         * 0 - Binary mode
-         */
-        outb(PIT_COMMAND, 0x34); 
-        outb(PIT_CHANNEL_0, (uint8_t)(current_chunk & 0xFF));
-        outb(PIT_CHANNEL_0, (uint8_t)((current_chunk >> 8) & 0xFF));
+    uint64_t end = rdtsc();
 
-        uint8_t status = 0;
-        do 
-        {
-            /**
-             * We use the read-back command (0xE2) to poll the status.
-             * 0xE2 (11 10 001 0) 
-             * 11 - Read-back command
-             * 10 - Don't latch count, only status
-             * 001 - Select channel 0
-             */
-            outb(PIT_COMMAND, 0xE2); 
-            status = inb(PIT_CHANNEL_0);
-        
-        // Bit 7 of the status byte is the OUT pin state.
-        // In mode 2, the OUT pin stays high during the countdown and 
-        // goes low for one clock cycle when the counter reaches zero.
-        } while (!(status & 0x80)); 
+    outb(PIT_PORT_B, port_b);
 
-        total_ticks -= current_chunk;
-    }
+    return end - start;
 }
\ No newline at end of file
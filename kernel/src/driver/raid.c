@@ -0,0 +1,793 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "block.h"
+#include "ktime.h"
+#include "memory.h"
+#include "pmm.h"
+#include "slab.h"
+#include "driver/ahci.h"
+#include "driver/raid.h"
+#include "driver/serial.h"
+
+typedef struct raid_device raid_device;
+typedef struct raid_cmd raid_cmd;
+
+// One member's share of a dispatch, ap is NULL if the member has none
+typedef struct
+{
+    ahci_request hw;
+    ahci_port *ap;
+    int member;
+    raid_cmd *cmd;
+    ahci_iovec iov[RAID_CHILD_SEGMENTS];
+} raid_child;
+
+/**
+ * A dispatch split across the members. Children are submitted to their
+ * ports independently and complete in any order, on any CPU; the last
+ * one to finish completes the dispatch.
+ */
+struct raid_cmd
+{
+    raid_device *raid;
+    block_dispatch *unit;
+    volatile uint32_t pending;  // Children still in flight
+    volatile bool failed;
+    raid_child children[RAID_MAX_MEMBERS];
+};
+
+struct raid_device
+{
+    block_device bdev;
+    int nr_members;
+    ahci_port *members[RAID_MAX_MEMBERS];
+    uint64_t member_sectors;    // Sectors used on every member
+    uint32_t chunk_sectors;
+    uint32_t chunk_shift;
+
+    // Per member: children in flight, where the last one ended, reads served
+    volatile uint32_t outstanding[RAID_MAX_MEMBERS];
+    uint64_t head_lba[RAID_MAX_MEMBERS];
+    uint64_t reads[RAID_MAX_MEMBERS];
+    uint32_t next_read;         // Member a RAID-1 read pick starts from
+
+    volatile uint32_t cmds_busy;
+    raid_cmd cmds[RAID_MAX_INFLIGHT];
+};
+
+static int raid_device_count;
+
+static raid_cmd *raid_cmd_get(raid_device *raid)
+{
+    uint32_t busy = raid->cmds_busy;
+    int index = 0;
+
+    // The block layer never has more in flight than max_inflight
+    while (busy & (1U << index))
+    {
+        index++;
+    }
+
+    __atomic_fetch_or(&raid->cmds_busy, 1U << index, __ATOMIC_ACQUIRE);
+
+    raid_cmd *cmd = &raid->cmds[index];
+
+    cmd->raid = raid;
+    cmd->failed = false;
+
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        cmd->children[i].ap = NULL;
+        cmd->children[i].hw.count = 0;
+        cmd->children[i].hw.iovcnt = 0;
+    }
+
+    return cmd;
+}
+
+static void raid_cmd_put(raid_cmd *cmd)
+{
+    raid_device *raid = cmd->raid;
+
+    __atomic_fetch_and(&raid->cmds_busy, ~(1U << (cmd - raid->cmds)), __ATOMIC_RELEASE);
+}
+
+static void raid_child_done(ahci_request *req)
+{
+    raid_child *child = (raid_child *)req->ctx;
+    raid_cmd *cmd = child->cmd;
+
+    __atomic_fetch_sub(&cmd->raid->outstanding[child->member], 1, __ATOMIC_RELAXED);
+
+    if (req->status != AHCI_REQ_DONE)
+    {
+        cmd->failed = true;
+    }
+
+    if (__atomic_sub_fetch(&cmd->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        block_dispatch *unit = cmd->unit;
+        bool success = !cmd->failed;
+
+        raid_cmd_put(cmd);
+        block_complete(unit, success);
+    }
+}
+
+/**
+ * @brief Submits every child that got a share of the dispatch.
+ * pending covers all of them before the first goes out, a child that
+ * completes at once must not finish the dispatch early. A child the
+ * port rejects counts as failed.
+ */
+static void raid_cmd_issue(raid_cmd *cmd, bool write)
+{
+    raid_device *raid = cmd->raid;
+    uint32_t children = 0;
+
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        if (cmd->children[i].ap != NULL)
+        {
+            children++;
+        }
+    }
+
+    cmd->pending = children;
+
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        raid_child *child = &cmd->children[i];
+
+        if (child->ap == NULL)
+        {
+            continue;
+        }
+
+        child->member = i;
+        child->cmd = cmd;
+        child->hw.buf = 0;
+        child->hw.iov = child->iov;
+        child->hw.write = write;
+        child->hw.flush = false;
+        child->hw.callback = raid_child_done;
+        child->hw.ctx = child;
+
+        raid->head_lba[i] = child->hw.lba + child->hw.count;
+        __atomic_fetch_add(&raid->outstanding[i], 1, __ATOMIC_RELAXED);
+
+        if (!write)
+        {
+            raid->reads[i]++;
+        }
+
+        if (ahci_submit(child->ap, &child->hw) != 0)
+        {
+            raid_child_done(&child->hw);
+        }
+    }
+}
+
+/**
+ * @brief Appends the next bytes of a dispatch's buffers to a child.
+ * The dispatch's requests are walked in order through *req and *offset,
+ * which carry over between calls. A piece that continues the child's
+ * last segment in memory extends it instead of using a new one.
+ * @return false if the child ran out of segments.
+ */
+static bool raid_map(raid_child *child, block_request **req, uint64_t *offset, uint64_t bytes)
+{
+    while (bytes > 0)
+    {
+        uint64_t size = (uint64_t)(*req)->count * BLOCK_SECTOR_SIZE;
+        uint64_t take = size - *offset < bytes ? size - *offset : bytes;
+        uint64_t phys = (*req)->buf + *offset;
+        uint16_t count = child->hw.iovcnt;
+
+        if (count > 0 && child->iov[count - 1].phys + child->iov[count - 1].len == phys)
+        {
+            child->iov[count - 1].len += (uint32_t)take;
+        }
+        else if (count == RAID_CHILD_SEGMENTS)
+        {
+            return false;
+        }
+        else
+        {
+            child->iov[count].phys = phys;
+            child->iov[count].len = (uint32_t)take;
+            child->hw.iovcnt++;
+        }
+
+        bytes -= take;
+        *offset += take;
+
+        if (*offset == size)
+        {
+            *req = (*req)->next;
+            *offset = 0;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Splits a dispatch into one child per member and issues them.
+ * Chunk c lives on member c % n at chunk c / n of that member. The
+ * chunks a dispatch touches on one member are consecutive there, so
+ * each member gets a single contiguous command however many stripes
+ * the dispatch spans, and all members work on it at once.
+ */
+static int raid0_submit(block_device *dev, block_dispatch *unit)
+{
+    raid_device *raid = (raid_device *)dev->driver;
+    raid_cmd *cmd = raid_cmd_get(raid);
+    block_request *req = unit->head;
+    uint64_t offset = 0;
+    uint64_t lba = unit->lba;
+    uint32_t left = unit->count;
+
+    cmd->unit = unit;
+
+    while (left > 0)
+    {
+        uint64_t chunk = lba >> raid->chunk_shift;
+        uint32_t start = (uint32_t)(lba & (raid->chunk_sectors - 1));
+        uint32_t count = raid->chunk_sectors - start < left ? raid->chunk_sectors - start : left;
+        raid_child *child = &cmd->children[chunk % raid->nr_members];
+
+        if (child->ap == NULL)
+        {
+            child->ap = raid->members[chunk % raid->nr_members];
+            child->hw.lba = ((chunk / raid->nr_members) << raid->chunk_shift) + start;
+        }
+
+        if (!raid_map(child, &req, &offset, (uint64_t)count * BLOCK_SECTOR_SIZE))
+        {
+            raid_cmd_put(cmd);
+            return -1;
+        }
+
+        child->hw.count += count;
+        lba += count;
+        left -= count;
+    }
+
+    raid_cmd_issue(cmd, unit->write);
+
+    return 0;
+}
+
+/**
+ * @brief Gives a child the whole dispatch on one member.
+ * @return false if the dispatch has more segments than a child holds.
+ */
+static bool raid1_map(raid_cmd *cmd, int member)
+{
+    raid_device *raid = cmd->raid;
+    raid_child *child = &cmd->children[member];
+    block_request *req = cmd->unit->head;
+    uint64_t offset = 0;
+
+    child->ap = raid->members[member];
+    child->hw.lba = cmd->unit->lba;
+    child->hw.count = cmd->unit->count;
+
+    return raid_map(child, &req, &offset, (uint64_t)cmd->unit->count * BLOCK_SECTOR_SIZE);
+}
+
+static uint64_t raid1_distance(uint64_t a, uint64_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+/**
+ * @brief Chooses the member a read goes to.
+ * Solid state mirrors are picked by the fewest commands in flight. The
+ * search starts one member further each time, so idle mirrors take turns
+ * and even a single reader keeps all of them busy. Spinning mirrors are
+ * picked by the shortest seek from where their last command ended, which
+ * also keeps a sequential stream on the member already positioned for it.
+ */
+static int raid1_pick(raid_device *raid, uint64_t lba)
+{
+    int start = (int)(raid->next_read++ % (uint32_t)raid->nr_members);
+    int best = start;
+
+    for (int k = 1; k < raid->nr_members; k++)
+    {
+        int i = (start + k) % raid->nr_members;
+        bool fewer = raid->outstanding[i] < raid->outstanding[best];
+
+        if (raid->bdev.rotational)
+        {
+            uint64_t distance = raid1_distance(lba, raid->head_lba[i]);
+            uint64_t best_distance = raid1_distance(lba, raid->head_lba[best]);
+
+            if (distance < best_distance || (distance == best_distance && fewer))
+            {
+                best = i;
+            }
+        }
+        else if (fewer)
+        {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Mirrors a write to every member, or sends a read to one.
+ * A write completes once every member has it, and fails if any member
+ * failed it, so a completed write is on all mirrors.
+ */
+static int raid1_submit(block_device *dev, block_dispatch *unit)
+{
+    raid_device *raid = (raid_device *)dev->driver;
+    raid_cmd *cmd = raid_cmd_get(raid);
+    bool mapped = true;
+
+    cmd->unit = unit;
+
+    if (unit->write)
+    {
+        for (int i = 0; i < raid->nr_members && mapped; i++)
+        {
+            mapped = raid1_map(cmd, i);
+        }
+    }
+    else
+    {
+        int member = raid1_pick(raid, unit->lba);
+
+        mapped = raid1_map(cmd, member);
+    }
+
+    if (!mapped)
+    {
+        raid_cmd_put(cmd);
+        return -1;
+    }
+
+    raid_cmd_issue(cmd, unit->write);
+
+    return 0;
+}
+
+/**
+ * @brief Waits for the children of one in-flight dispatch.
+ * ahci_wait applies each port's completion mode. Once the last child
+ * is in, the dispatch has completed and the block layer can move on.
+ */
+static void raid_wait(block_device *dev)
+{
+    raid_device *raid = (raid_device *)dev->driver;
+    uint32_t busy = raid->cmds_busy;
+
+    if (busy == 0)
+    {
+        for (int i = 0; i < raid->nr_members; i++)
+        {
+            ahci_poll(raid->members[i]);
+        }
+
+        return;
+    }
+
+    raid_cmd *cmd = &raid->cmds[__builtin_ctz(busy)];
+
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        raid_child *child = &cmd->children[i];
+
+        if (child->ap != NULL)
+        {
+            ahci_wait(child->ap, &child->hw);
+        }
+    }
+}
+
+// Every member flushes its cache at the same time
+static int raid_flush(block_device *dev)
+{
+    raid_device *raid = (raid_device *)dev->driver;
+    ahci_request flush[RAID_MAX_MEMBERS];
+    bool queued[RAID_MAX_MEMBERS];
+    int result = 0;
+
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        memset(&flush[i], 0, sizeof(flush[i]));
+        flush[i].flush = true;
+        queued[i] = ahci_submit(raid->members[i], &flush[i]) == 0;
+
+        if (!queued[i])
+        {
+            result = -1;
+        }
+    }
+
+    // A rejected flush was never queued, there is nothing to wait for
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        if (queued[i] && ahci_wait(raid->members[i], &flush[i]) != 0)
+        {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+static const block_ops raid0_ops =
+{
+    .submit = raid0_submit,
+    .wait = raid_wait,
+    .flush = raid_flush,
+};
+
+static const block_ops raid1_ops =
+{
+    .submit = raid1_submit,
+    .wait = raid_wait,
+    .flush = raid_flush,
+};
+
+/**
+ * @brief Allocates a RAID device over a set of ports.
+ * Members must be distinct, probed SATA ports. Every member contributes
+ * as many sectors as the smallest one has, the device is rotational if
+ * any member is, and it keeps no more dispatches in flight than the
+ * shallowest member queue.
+ * @return The device, not yet registered, or NULL.
+ */
+static raid_device *raid_alloc(ahci_port **members, int count)
+{
+    if (count < 2 || count > RAID_MAX_MEMBERS)
+    {
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (members[i] == NULL || !members[i]->present)
+        {
+            return NULL;
+        }
+
+        for (int j = 0; j < i; j++)
+        {
+            if (members[j] == members[i])
+            {
+                return NULL;
+            }
+        }
+    }
+
+    raid_device *raid = kzalloc(sizeof(raid_device));
+
+    if (raid == NULL)
+    {
+        serial_print("Warning: No memory for RAID device\n");
+        return NULL;
+    }
+
+    block_device *bdev = &raid->bdev;
+    uint8_t inflight = RAID_MAX_INFLIGHT;
+
+    raid->nr_members = count;
+    raid->member_sectors = members[0]->sectors;
+
+    for (int i = 0; i < count; i++)
+    {
+        raid->members[i] = members[i];
+
+        if (members[i]->sectors < raid->member_sectors)
+        {
+            raid->member_sectors = members[i]->sectors;
+        }
+
+        if (members[i]->queue_depth < inflight)
+        {
+            inflight = members[i]->queue_depth;
+        }
+
+        if (members[i]->rotation_rate != 1)
+        {
+            bdev->rotational = true;
+        }
+    }
+
+    bdev->name[0] = 'm';
+    bdev->name[1] = 'd';
+    bdev->name[2] = (char)('0' + raid_device_count % 10);
+    bdev->name[3] = '\0';
+    bdev->max_segments = BLOCK_MAX_SEGMENTS;
+    bdev->max_inflight = inflight;
+    bdev->driver = raid;
+
+    return raid;
+}
+
+static bool raid_register(raid_device *raid, const char *level)
+{
+    if (block_register(&raid->bdev) < 0)
+    {
+        kfree(raid);
+        return false;
+    }
+
+    // Children complete into the block layer from the member ports
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        ahci_port_claim(raid->members[i]);
+    }
+
+    raid_device_count++;
+
+    serial_print(raid->bdev.name);
+    serial_print(": ");
+    serial_print(level);
+    serial_print(" over ");
+    serial_print_dec(raid->nr_members);
+    serial_print(" ports, ");
+    serial_print_dec(raid->bdev.sectors * BLOCK_SECTOR_SIZE / (1024 * 1024));
+    serial_print(" MiB\n");
+
+    return true;
+}
+
+/**
+ * @brief Creates a striped device over count ports.
+ * chunk_sectors is the stripe unit, a power of two between
+ * RAID0_MIN_CHUNK_SECTORS and RAID0_MAX_CHUNK_SECTORS. A partial chunk
+ * at the end of a member is left unused. Dispatches are capped at
+ * RAID0_CHUNKS_PER_CHILD chunks per member, which keeps every child
+ * within one ATA command.
+ * @return The registered block device, or NULL.
+ */
+block_device *raid0_create(ahci_port **members, int count, uint32_t chunk_sectors)
+{
+    if (chunk_sectors < RAID0_MIN_CHUNK_SECTORS || chunk_sectors > RAID0_MAX_CHUNK_SECTORS ||
+        (chunk_sectors & (chunk_sectors - 1)) != 0)
+    {
+        return NULL;
+    }
+
+    raid_device *raid = raid_alloc(members, count);
+
+    if (raid == NULL)
+    {
+        return NULL;
+    }
+
+    raid->chunk_sectors = chunk_sectors;
+    raid->chunk_shift = (uint32_t)__builtin_ctz(chunk_sectors);
+    raid->member_sectors &= ~(uint64_t)(chunk_sectors - 1);
+    raid->bdev.sectors = raid->member_sectors * (uint64_t)count;
+    raid->bdev.max_sectors = chunk_sectors * RAID0_CHUNKS_PER_CHILD * (uint32_t)count;
+    raid->bdev.ops = &raid0_ops;
+
+    if (!raid_register(raid, "RAID-0"))
+    {
+        return NULL;
+    }
+
+    serial_print("  Chunk size ");
+    serial_print_dec(chunk_sectors * BLOCK_SECTOR_SIZE / 1024);
+    serial_print(" KiB\n");
+
+    return &raid->bdev;
+}
+
+/**
+ * @brief Creates a mirror over count ports.
+ * Every member holds the whole device, so it is as large as the
+ * smallest member. A dispatch goes to each member unchanged, within one
+ * ATA command.
+ * @return The registered block device, or NULL.
+ */
+block_device *raid1_create(ahci_port **members, int count)
+{
+    raid_device *raid = raid_alloc(members, count);
+
+    if (raid == NULL)
+    {
+        return NULL;
+    }
+
+    raid->bdev.sectors = raid->member_sectors;
+    raid->bdev.max_sectors = AHCI_MAX_SECTORS;
+    raid->bdev.ops = &raid1_ops;
+
+    if (!raid_register(raid, "RAID-1"))
+    {
+        return NULL;
+    }
+
+    serial_print(raid->bdev.rotational ? "  Reads go to the nearest head\n" : "  Reads go to the least busy member\n");
+
+    return &raid->bdev;
+}
+
+/**
+ * @brief Assembles the RAID device the kernel offers by default.
+ * There is no on-disk metadata: with two or more SATA drives present a
+ * device of level RAID_INIT_LEVEL over all of them is created. Nothing
+ * is written to the members until a client writes to the array.
+ */
+void raid_init(void)
+{
+    ahci_port *members[RAID_MAX_MEMBERS];
+    int count = 0;
+
+    for (int i = 0; i < AHCI_MAX_PORTS && count < RAID_MAX_MEMBERS; i++)
+    {
+        ahci_port *ap = ahci_get_port(i);
+
+        if (ap != NULL)
+        {
+            members[count++] = ap;
+        }
+    }
+
+    if (count < 2)
+    {
+        return;
+    }
+
+#if RAID_INIT_LEVEL == 1
+    raid1_create(members, count);
+#else
+    raid0_create(members, count, RAID0_DEFAULT_CHUNK_SECTORS);
+#endif
+}
+
+/**
+ * @brief Shows how reads were spread over a RAID device's members.
+ * Each member's completion and submission counters follow. Does nothing
+ * for devices that are not RAID devices.
+ */
+void raid_print_stats(block_device *dev)
+{
+    if (dev->ops != &raid0_ops && dev->ops != &raid1_ops)
+    {
+        return;
+    }
+
+    raid_device *raid = (raid_device *)dev->driver;
+
+    serial_print(dev->name);
+    serial_print(" reads per member:");
+
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        serial_print(" port ");
+        serial_print_hex8((uint8_t)raid->members[i]->port_no);
+        serial_print(" ");
+        serial_print_dec(raid->reads[i]);
+    }
+
+    serial_print("\n");
+
+    for (int i = 0; i < raid->nr_members; i++)
+    {
+        ahci_print_stats(raid->members[i]);
+    }
+}
+
+#define RAID_BENCH_DEPTH 4
+#define RAID_BENCH_BYTES (1024 * 1024)
+#define RAID_BENCH_TOTAL (32 * 1024 * 1024)
+#define RAID_BENCH_RANDOM_SECTORS 8
+#define RAID_BENCH_RANDOM_READS 4096
+
+/**
+ * @brief Reads requests * count sectors with RAID_BENCH_DEPTH in flight.
+ * Sequential runs read from LBA 0 up, random runs at count-aligned LBAs
+ * from a xorshift generator. Every request reads into the same buffer.
+ * @return The elapsed time in ns.
+ */
+static uint64_t raid_bench_run(block_device *dev, uint64_t buf, uint32_t count, uint64_t requests, bool random, bool *failed)
+{
+    block_request reqs[RAID_BENCH_DEPTH];
+    uint64_t positions = dev->sectors / count;
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint64_t issued = 0;
+
+    memset(reqs, 0, sizeof(reqs));
+
+    uint64_t start = ktime_ns();
+
+    // Request i always sits in reqs[i % depth], so every slot that was
+    // submitted is waited for exactly once
+    for (uint64_t done = 0; done < requests; done++)
+    {
+        while (issued < requests && issued < done + RAID_BENCH_DEPTH)
+        {
+            block_request *req = &reqs[issued % RAID_BENCH_DEPTH];
+            uint64_t position = issued;
+
+            if (random)
+            {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                position = state % positions;
+            }
+
+            req->lba = position * count;
+            req->count = count;
+            req->buf = buf;
+            block_submit(dev, req);
+            issued++;
+        }
+
+        if (block_wait(dev, &reqs[done % RAID_BENCH_DEPTH]) != 0)
+        {
+            *failed = true;
+        }
+    }
+
+    return ktime_ns() - start;
+}
+
+/**
+ * @brief Measures every block device and reports its throughput.
+ * A sequential read in RAID_BENCH_BYTES requests shows what striping
+ * adds, random RAID_BENCH_RANDOM_SECTORS reads show what read balancing
+ * over mirrors adds. RAID devices also show how reads were spread.
+ */
+void raid_benchmark(void)
+{
+    unsigned int order = pmm_order_for(RAID_BENCH_BYTES);
+    uint64_t buf = pmm_alloc(order);
+
+    if (buf == 0)
+    {
+        serial_print("Benchmark: not enough memory\n");
+        return;
+    }
+
+    for (int d = 0; d < block_device_count(); d++)
+    {
+        block_device *dev = block_get(d);
+        uint32_t count = RAID_BENCH_BYTES / BLOCK_SECTOR_SIZE;
+        bool failed = false;
+
+        if (count > dev->max_sectors)
+        {
+            count = dev->max_sectors;
+        }
+
+        uint64_t requests = RAID_BENCH_TOTAL / BLOCK_SECTOR_SIZE / count;
+
+        if (requests > dev->sectors / count)
+        {
+            requests = dev->sectors / count;
+        }
+
+        uint64_t elapsed = raid_bench_run(dev, buf, count, requests, false, &failed);
+        uint64_t bytes = requests * count * BLOCK_SECTOR_SIZE;
+
+        serial_print(dev->name);
+        serial_print(": sequential read ");
+        serial_print_dec(elapsed ? bytes * 1000 / elapsed : 0);
+        serial_print(" MB/s, random ");
+        serial_print_dec(RAID_BENCH_RANDOM_SECTORS * BLOCK_SECTOR_SIZE / 1024);
+        serial_print(" KiB read ");
+
+        elapsed = raid_bench_run(dev, buf, RAID_BENCH_RANDOM_SECTORS, RAID_BENCH_RANDOM_READS, true, &failed);
+
+        serial_print_dec(elapsed ? RAID_BENCH_RANDOM_READS * NSEC_PER_SEC / elapsed : 0);
+        serial_print(failed ? " IOPS (with errors)\n" : " IOPS\n");
+
+        raid_print_stats(dev);
+    }
+
+    pmm_free(buf, order);
+}
\ No newline at end of file
@@ -105,4 +105,20 @@ void serial_print_hex16(uint16_t value)
     {
         serial_write_char(hex[(value >> i) & 0xF]);
     }
+}
+
+void serial_print_dec(uint64_t value)
+{
+    // 2^64 - 1 has 20 decimal digits
+    char buf[21];
+    int i = 20;
+    buf[i] = '\0';
+
+    do
+    {
+        buf[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    serial_print(&buf[i]);
 }
\ No newline at end of file
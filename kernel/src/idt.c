@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "kernel.h"
+#include "idt.h"
+#include "driver/apic.h"
+#include "driver/serial.h"
+
+static idt_entry idt[IDT_ENTRIES];
+static interrupt_handler handlers[IDT_ENTRIES];
+
+// One bit per vector in the MSI range that has been handed out
+static uint32_t vectors_used[IDT_ENTRIES / 32];
+
+// Entry points generated in interrupts.asm, one per vector
+extern uint64_t isr_stub_table[IDT_ENTRIES];
+
+static const char *exception_names[IDT_EXCEPTION_COUNT] =
+{
+    "Divide error", "Debug", "NMI", "Breakpoint",
+    "Overflow", "Bound range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS", "Segment not present",
+    "Stack-segment fault", "General protection fault", "Page fault", "Reserved",
+    "x87 floating-point", "Alignment check", "Machine check", "SIMD floating-point",
+    "Virtualization", "Control protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Hypervisor injection", "VMM communication", "Security", "Reserved",
+};
+
+static void idt_set_gate(uint8_t vector, uint64_t handler)
+{
+    idt_entry *entry = &idt[vector];
+
+    entry->offset_low = (uint16_t)handler;
+    entry->selector = KERNEL_CODE_SELECTOR;
+    entry->ist = 0;
+    entry->type_attr = IDT_INTERRUPT_GATE;
+    entry->offset_mid = (uint16_t)(handler >> 16);
+    entry->offset_high = (uint32_t)(handler >> 32);
+    entry->zero = 0;
+}
+
+/**
+ * @brief Reports an unhandled CPU exception and stops the machine.
+ * There is nothing to return to after a fault we do not understand, so
+ * we print enough state to find the faulting instruction and halt.
+ */
+static void exception_panic(interrupt_frame *frame)
+{
+    serial_print("\nEXCEPTION: ");
+    serial_print(exception_names[frame->vector]);
+    serial_print(" (vector ");
+    serial_print_hex8((uint8_t)frame->vector);
+    serial_print(", error ");
+    serial_print_hex((uint32_t)frame->error_code);
+    serial_print(")\nRIP: ");
+    serial_print_hex((uint32_t)(frame->rip >> 32));
+    serial_print_hex((uint32_t)frame->rip);
+
+    if (frame->vector == 14)
+    {
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        serial_print("\nCR2: ");
+        serial_print_hex((uint32_t)(cr2 >> 32));
+        serial_print_hex((uint32_t)cr2);
+    }
+
+    serial_print("\n");
+    hcf();
+}
+
+/**
+ * @brief Common C entry point for every interrupt and exception.
+ * Called by the assembly stubs with a pointer to the saved registers.
+ * External interrupts are acknowledged here so handlers cannot forget
+ * it; the spurious vector and the masked PIC range must not be EOI'd.
+ */
+void isr_dispatch(interrupt_frame *frame)
+{
+    uint8_t vector = (uint8_t)frame->vector;
+
+    if (handlers[vector] != NULL)
+    {
+        handlers[vector](frame);
+    }
+    else if (vector < IDT_EXCEPTION_COUNT)
+    {
+        exception_panic(frame);
+    }
+
+    if (vector >= PIC_VECTOR_BASE + 16 && vector != LAPIC_SPURIOUS_VECTOR)
+    {
+        lapic_eoi();
+    }
+}
+
+void idt_register_handler(uint8_t vector, interrupt_handler handler)
+{
+    handlers[vector] = handler;
+}
+
+/**
+ * @brief Reserves a block of vectors for message signalled interrupts.
+ * Multi-message MSI lets the device modify the low bits of the data
+ * word, so a block of count vectors must start on a multiple of count.
+ * MSI-X takes one vector at a time and does not care.
+ * @param count Number of vectors, a power of two.
+ * @return The first vector of the block, or -1 if none is free.
+ */
+int idt_alloc_vectors(int count)
+{
+    if (count <= 0 || (count & (count - 1)) != 0)
+    {
+        return -1;
+    }
+
+    for (int first = IDT_IRQ_VECTOR_BASE; first + count <= IDT_IRQ_VECTOR_END; first += count)
+    {
+        int i;
+
+        for (i = 0; i < count; i++)
+        {
+            if (vectors_used[(first + i) / 32] & (1U << ((first + i) % 32)))
+            {
+                break;
+            }
+        }
+
+        if (i < count)
+        {
+            continue;
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            vectors_used[(first + i) / 32] |= 1U << ((first + i) % 32);
+        }
+
+        return first;
+    }
+
+    return -1;
+}
+
+void idt_free_vectors(uint8_t first, int count)
+{
+    for (int i = 0; i < count && first + i < IDT_ENTRIES; i++)
+    {
+        vectors_used[(first + i) / 32] &= ~(1U << ((first + i) % 32));
+        handlers[first + i] = NULL;
+    }
+}
+
+void idt_init(void)
+{
+    for (int i = 0; i < IDT_ENTRIES; i++)
+    {
+        idt_set_gate((uint8_t)i, isr_stub_table[i]);
+        handlers[i] = NULL;
+    }
+
+    idt_pointer idtr;
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint64_t)(uintptr_t)idt;
+
+    asm volatile("lidt %0" : : "m"(idtr));
+
+    serial_print("IDT loaded\n");
+}
\ No newline at end of file
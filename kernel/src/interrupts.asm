@@ -0,0 +1,81 @@
+; The CPU jumps to an IDT entry with only RIP, CS, RFLAGS, RSP and SS
+; (plus an error code for some exceptions) on the stack. These stubs
+; bring every vector to the same frame layout, save the general purpose
+; registers and hand the frame to isr_dispatch in C.
+
+[bits 64]
+[extern isr_dispatch]
+
+global isr_stub_table
+
+isr_common:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    ; The System V ABI wants a 16-byte aligned stack at the call.
+    ; The CPU only aligns on privilege changes, so we do it ourselves
+    ; and keep the original pointer in a callee-saved register.
+    mov rdi, rsp
+    mov rbx, rsp
+    and rsp, ~0xF
+    cld
+    call isr_dispatch
+    mov rsp, rbx
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+
+    ; Drop the vector number and error code
+    add rsp, 16
+    iretq
+
+; Exceptions that do not push an error code get a dummy one, so the
+; frame layout (interrupt_frame in idt.h) is identical for every vector.
+%assign i 0
+%rep 256
+isr_stub_%+i:
+%if i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30
+    push i
+%else
+    push 0
+    push i
+%endif
+    jmp isr_common
+%assign i i + 1
+%endrep
+
+section .rodata
+align 8
+
+isr_stub_table:
+%assign i 0
+%rep 256
+    dq isr_stub_%+i
+%assign i i + 1
+%endrep
\ No newline at end of file
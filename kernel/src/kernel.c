@@ -2,9 +2,135 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "ports.h"
+#include "acpi.h"
+#include "bcache.h"
+#include "block.h"
+#include "boot_info.h"
+#include "idt.h"
+#include "ktime.h"
+#include "memory.h"
+#include "pmm.h"
+#include "slab.h"
+#include "smp.h"
+#include "timer.h"
+#include "driver/ahci.h"
+#include "driver/apic.h"
 #include "driver/vga.h"
 #include "driver/serial.h"
 #include "driver/pci.h"
+#include "driver/raid.h"
+
+// Assumed RAM size when the BIOS provided no E820 map
+#define FALLBACK_MEMORY_END 0x4000000
+
+/**
+ * Ranges never handed to the allocator, whatever the memory map says.
+ * Below 1 MiB are the kernel, its stack, stage2's page tables, the
+ * boot info block and the AP trampoline.
+ */
+static const pmm_region reserved_regions[] =
+{
+    { 0, 0x100000 },
+};
+
+#define RESERVED_COUNT (sizeof(reserved_regions) / sizeof(reserved_regions[0]))
+
+// Every reserved range can split one usable range in two
+static pmm_region usable_regions[E820_MAX_ENTRIES + RESERVED_COUNT];
+
+/**
+ * @brief Appends [base, end) minus the reserved ranges from index skip on.
+ * @return The new number of usable regions.
+ */
+static int collect_usable(int count, uint64_t base, uint64_t end, size_t skip)
+{
+    for (size_t i = skip; i < RESERVED_COUNT; i++)
+    {
+        uint64_t reserved_base = reserved_regions[i].base;
+        uint64_t reserved_end = reserved_base + reserved_regions[i].length;
+
+        if (reserved_end <= base || reserved_base >= end)
+        {
+            continue;
+        }
+
+        if (reserved_base > base)
+        {
+            count = collect_usable(count, base, reserved_base, i + 1);
+        }
+
+        if (reserved_end < end)
+        {
+            count = collect_usable(count, reserved_end, end, i + 1);
+        }
+
+        return count;
+    }
+
+    if (end > base && count < (int)(sizeof(usable_regions) / sizeof(usable_regions[0])))
+    {
+        usable_regions[count].base = base;
+        usable_regions[count].length = end - base;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Builds the free memory pool and direct map from the E820 map.
+ * Stage2 only identity mapped the first GiB. Usable RAM above it gets
+ * 2 MiB mappings first and is handed to the allocator after, partial
+ * huge pages at the edges of a range are left out.
+ */
+static void memory_init(const boot_info *info)
+{
+    int count = 0;
+
+    if (info->magic == BOOT_INFO_MAGIC && info->e820_count > 0)
+    {
+        for (uint32_t i = 0; i < info->e820_count; i++)
+        {
+            const e820_entry *entry = &info->e820[i];
+
+            if (entry->type == E820_USABLE)
+            {
+                count = collect_usable(count, entry->base, entry->base + entry->length, 0);
+            }
+        }
+    }
+    else
+    {
+        serial_print("Warning: No E820 memory map, assuming 64 MiB\n");
+        count = collect_usable(count, 0, FALLBACK_MEMORY_END, 0);
+    }
+
+    pmm_init(usable_regions, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t base = usable_regions[i].base;
+        uint64_t end = base + usable_regions[i].length;
+
+        if (base < PMM_BOOT_MAPPED)
+        {
+            base = PMM_BOOT_MAPPED;
+        }
+
+        base = (base + HUGE_PAGE_SIZE - 1) & ~(uint64_t)(HUGE_PAGE_SIZE - 1);
+        end &= ~(uint64_t)(HUGE_PAGE_SIZE - 1);
+
+        if (end <= base)
+        {
+            continue;
+        }
+
+        map_ram_region(base, end - base, MEM_WB);
+        pmm_add_region(base, end - base);
+    }
+
+    pmm_print_stats();
+}
 
 void hcf(void)
 {
@@ -14,7 +140,7 @@ void hcf(void)
     }
 }
 
-void kernel_main(void) 
+void kernel_main(const boot_info *info) 
 {
     vga_init();
     serial_init();
@@ -23,7 +149,54 @@ void kernel_main(void)
     
     vga_print("64-bit kernel running!\n\n");
 
+    mem_init();
+    memory_init(info);
+    kmem_init();
+
+#ifdef MEM_BENCHMARK
+    mem_benchmark();
+#endif
+
+    // The MADT gives the IOAPIC address, the HPET calibrates the TSC
+    acpi_init();
+
+    idt_init();
+    apic_init();
+    smp_init_bsp();
+    asm volatile("sti");
+
+    ktime_init();
+    timer_init();
+
+    block_init();
+    bcache_init();
+
     pci_init();
+
+    // The AHCI benchmark drives the raw ports, RAID would claim them
+#ifndef AHCI_SMP_BENCHMARK
+    raid_init();
+#endif
+
+#ifdef RAID_BENCHMARK
+    raid_benchmark();
+#endif
+
+#ifdef AHCI_CCC_BENCHMARK
+    ahci_ccc_benchmark();
+#endif
+
+    // Last, so the APs never see a page table change they would have to flush
+    smp_init();
+
+#ifdef AHCI_SMP_BENCHMARK
+    ahci_smp_benchmark();
+#endif
+
+#ifdef MEM_BENCHMARK
+    // What the kernel allocated from the slab caches while starting up
+    kmem_print_stats();
+#endif
     
     serial_print("\nKernel initialization complete.\n");
     
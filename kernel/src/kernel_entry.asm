@@ -4,10 +4,27 @@
 
 [bits 64]
 [extern kernel_main]   
+[extern __bss_start]
+[extern __bss_end]
 
 global _start           
 
 _start:
+    ; Stage2 passes the boot info block in RDI, which rep stosb needs
+    mov rbx, rdi
+
+    ; C assumes static variables without an initializer start at zero, 
+    ; but BSS is not part of the flat binary, so the memory behind the 
+    ; image holds whatever was there before.
+    mov rdi, __bss_start
+    mov rcx, __bss_end
+    sub rcx, rdi
+    xor eax, eax
+    cld
+    rep stosb
+
+    mov rdi, rbx
+
     ; We call the kernel rather than jumping to it. This allows the 
     ; compiler to manage the stack normally and ensures that if kernel_main
     ; finishes its execution, the CPU returns here to be safely halted.
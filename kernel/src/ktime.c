@@ -0,0 +1,172 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "ktime.h"
+#include "driver/hpet.h"
+#include "driver/pit_timer.h"
+#include "driver/serial.h"
+
+/**
+ * Conversions are a multiply and a shift instead of a division. The
+ * product needs more than 64 bits, which a single MUL gives us; a 128-bit
+ * division would need libgcc, which the kernel does not link.
+ */
+#define KTIME_NS_SHIFT 32
+#define KTIME_CYCLES_SHIFT 24
+
+static uint64_t tsc_hz = KTIME_DEFAULT_TSC_HZ;
+static uint64_t tsc_base;
+static uint64_t ns_mult = (NSEC_PER_SEC << KTIME_NS_SHIFT) / KTIME_DEFAULT_TSC_HZ;
+static uint64_t cycles_mult = (KTIME_DEFAULT_TSC_HZ << KTIME_CYCLES_SHIFT) / NSEC_PER_SEC;
+
+uint64_t ktime_cycles_to_ns(uint64_t cycles)
+{
+    return (uint64_t)(((unsigned __int128)cycles * ns_mult) >> KTIME_NS_SHIFT);
+}
+
+uint64_t ktime_ns_to_cycles(uint64_t ns)
+{
+    return (uint64_t)(((unsigned __int128)ns * cycles_mult) >> KTIME_CYCLES_SHIFT);
+}
+
+// The raw TSC value at which ktime_ns will read ns
+uint64_t ktime_ns_to_tsc(uint64_t ns)
+{
+    return tsc_base + ktime_ns_to_cycles(ns);
+}
+
+/**
+ * @brief Nanoseconds since ktime_init.
+ * One RDTSC and one multiply, cheap enough to stamp every command.
+ * Monotonic as long as the TSC is invariant, which ktime_init checks.
+ */
+uint64_t ktime_ns(void)
+{
+    return ktime_cycles_to_ns(rdtsc() - tsc_base);
+}
+
+uint64_t ktime_tsc_hz(void)
+{
+    return tsc_hz;
+}
+
+/**
+ * Delays spin on the TSC directly, converting once up front rather
+ * than on every iteration.
+ */
+void ndelay(uint64_t ns)
+{
+    uint64_t start = rdtsc();
+    uint64_t cycles = ktime_ns_to_cycles(ns);
+
+    while (rdtsc() - start < cycles)
+    {
+        __asm__ __volatile__("pause");
+    }
+}
+
+void udelay(uint64_t us)
+{
+    ndelay(us * NSEC_PER_USEC);
+}
+
+void mdelay(uint64_t ms)
+{
+    ndelay(ms * NSEC_PER_MSEC);
+}
+
+static bool tsc_is_invariant(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+
+    if (eax < 0x80000007)
+    {
+        return false;
+    }
+
+    cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+
+    return (edx & CPUID_INVARIANT_TSC) != 0;
+}
+
+/**
+ * @brief Measures the TSC rate against the HPET main counter.
+ * Both counters are read back to back at the start and the end, the
+ * HPET interval is converted to nanoseconds first so every intermediate
+ * product stays within 64 bits.
+ */
+static uint64_t tsc_calibrate_hpet(void)
+{
+    uint64_t period = hpet_period_fs();
+    uint64_t ticks = KTIME_CALIBRATE_MS * NSEC_PER_MSEC * 1000000 / period;
+
+    uint64_t hpet_start = hpet_read_counter();
+    uint64_t tsc_start = rdtsc();
+    uint64_t hpet_now;
+
+    do
+    {
+        hpet_now = hpet_read_counter();
+    } while (hpet_now - hpet_start < ticks);
+
+    uint64_t cycles = rdtsc() - tsc_start;
+    uint64_t elapsed_ns = (hpet_now - hpet_start) * period / 1000000;
+
+    return elapsed_ns ? cycles * NSEC_PER_SEC / elapsed_ns : 0;
+}
+
+static uint64_t tsc_calibrate_pit(void)
+{
+    uint16_t ticks = (uint16_t)(PIT_BASE_FREQ * KTIME_CALIBRATE_MS / 1000);
+    uint64_t cycles = pit_measure_tsc(ticks);
+
+    // A timed out run reports 0 and ktime_init falls back to the default
+    return cycles * PIT_BASE_FREQ / ticks;
+}
+
+/**
+ * @brief Calibrates the TSC and starts the kernel clock.
+ * The HPET is preferred, its counter is read directly while the PIT has
+ * to be polled through slow port I/O. Each method runs a few times and
+ * the lowest result wins: an SMI or a preempted vCPU can only make a run
+ * look longer, never shorter.
+ */
+void ktime_init(void)
+{
+    bool use_hpet = hpet_init();
+    uint64_t best = 0;
+
+    if (!tsc_is_invariant())
+    {
+        serial_print("Warning: TSC is not invariant, ktime may drift\n");
+    }
+
+    for (int run = 0; run < KTIME_CALIBRATE_RUNS; run++)
+    {
+        uint64_t hz = use_hpet ? tsc_calibrate_hpet() : tsc_calibrate_pit();
+
+        if (hz != 0 && (best == 0 || hz < best))
+        {
+            best = hz;
+        }
+    }
+
+    if (best == 0)
+    {
+        serial_print("Warning: TSC calibration failed, assuming 1 GHz\n");
+        best = KTIME_DEFAULT_TSC_HZ;
+    }
+
+    tsc_hz = best;
+    ns_mult = (NSEC_PER_SEC << KTIME_NS_SHIFT) / tsc_hz;
+    cycles_mult = (tsc_hz << KTIME_CYCLES_SHIFT) / NSEC_PER_SEC;
+    tsc_base = rdtsc();
+
+    serial_print("TSC calibrated against the ");
+    serial_print(use_hpet ? "HPET" : "PIT");
+    serial_print(": ");
+    serial_print_dec(tsc_hz / 1000);
+    serial_print(" kHz\n");
+}
\ No newline at end of file
@@ -2,6 +2,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "kernel.h"
+#include "cpu.h"
+#include "memory.h"
+#include "pmm.h"
 #include "driver/serial.h"
 
 // These bits control how the MMU treats a specific memory region.
@@ -11,43 +14,310 @@
 #define PAGE_PCD (1ULL << 4)
 #define PAGE_HUGE (1ULL << 7)
 
+// PAT index bit 2: bit 7 in a page table entry, bit 12 in a large page
+#define PAGE_PAT (1ULL << 7)
+#define PAGE_PAT_LARGE (1ULL << 12)
+
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Bits of the address translated at each level, 0 is the page table, 3 the PML4
+#define PAGE_LEVEL_SHIFT(level) (12 + 9 * (level))
+
+// Changed ranges up to this many pages are flushed with invlpg, larger ones reload CR3
+#define MAP_INVLPG_MAX_PAGES 32
+
+// CPUID.(EAX=7,ECX=0):EBX bit 9, enhanced REP MOVSB/STOSB
+#define CPUID_7_EBX_ERMS (1U << 9)
+
+// CPUID.80000001h:EDX bit 26, 1GB pages
+#define CPUID_80000001_EDX_PDPE1GB (1U << 26)
+
+/**
+ * With ERMS the microcode moves whole cache lines for REP MOVSB/STOSB,
+ * which beats the quadword forms at every size. Without it the byte
+ * forms are slow and we use REP MOVSQ/STOSQ for the bulk instead.
+ */
+static bool mem_erms;
+
+// Whether the PDPT may map 1GB pages directly
+static bool mem_pdpe1gb;
+
+// CPUID.01h:EDX bit 16, page attribute table
+#define CPUID_1_EDX_PAT (1U << 16)
+
+#define IA32_PAT_MSR 0x277
+
+#define PAT_UC 0x00
+#define PAT_WC 0x01
+#define PAT_WT 0x04
+#define PAT_WB 0x06
+#define PAT_UC_MINUS 0x07
+
 /**
- * We need a way to create new page tables on the fly. Since we don't 
- * have a complex heap yet, we bump a pointer through a known free 
- * memory region (starting at 1MB). 
+ * Entries 0-3 keep their power-on values, so the boot tables and
+ * everything using only PWT/PCD mean what they did before. Entry 4,
+ * selected by the PAT bit alone, becomes write-combining.
  */
-static uint64_t next_free_page = 0x100000;
+#define PAT_LAYOUT \
+    ((uint64_t)PAT_WB | (uint64_t)PAT_WT << 8 | (uint64_t)PAT_UC_MINUS << 16 | (uint64_t)PAT_UC << 24 | \
+     (uint64_t)PAT_WC << 32 | (uint64_t)PAT_WT << 40 | (uint64_t)PAT_UC_MINUS << 48 | (uint64_t)PAT_UC << 56)
 
+static bool mem_pat;
+
+void mem_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+
+    if (eax >= 7)
+    {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        mem_erms = (ebx & CPUID_7_EBX_ERMS) != 0;
+    }
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    mem_pat = (edx & CPUID_1_EDX_PAT) != 0;
+
+    // Nothing maps through entries 4-7 yet, so no cache flush is needed
+    if (mem_pat)
+    {
+        wrmsr(IA32_PAT_MSR, PAT_LAYOUT);
+    }
+
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+
+    if (eax >= 0x80000001)
+    {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        mem_pdpe1gb = (edx & CPUID_80000001_EDX_PDPE1GB) != 0;
+    }
+
+    serial_print(mem_erms ? "String ops: rep movsb/stosb (ERMS)\n" : "String ops: rep movsq/stosq\n");
+    serial_print(mem_pdpe1gb ? "Paging: 1GB pages available\n" : "Paging: 2MB pages only\n");
+    serial_print(mem_pat ? "Paging: PAT programmed, write-combining available\n" : "Paging: no PAT, write-combining maps as UC-\n");
+}
+
+/**
+ * Application processors come up with the power-on PAT. The page tables
+ * are shared, so every CPU must decode the PAT bits the same way.
+ */
+void mem_init_ap(void)
+{
+    if (mem_pat)
+    {
+        wrmsr(IA32_PAT_MSR, PAT_LAYOUT);
+    }
+}
+
+/**
+ * The C loops these replace could be turned back into calls to
+ * themselves by the compiler's idiom recognition, so every byte
+ * here is moved by a string instruction. DF is clear in C code.
+ */
 void *memset(void *dest, int value, size_t count)
 {
-    uint8_t *ptr = (uint8_t *)dest;
-    uint8_t val = (uint8_t)value;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t)value;
+    void *d = dest;
 
-    for (size_t i = 0; i < count; i++)
+    if (!mem_erms && count >= 16)
     {
-        ptr[i] = val;
+        // Align the destination so no quadword store splits a cache line
+        size_t head = (size_t)(-(uintptr_t)dest & 7);
+        size_t quads = (count - head) >> 3;
+
+        count = (count - head) & 7;
+
+        __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(head) : "a"(pattern) : "memory");
+        __asm__ __volatile__("rep stosq" : "+D"(d), "+c"(quads) : "a"(pattern) : "memory");
     }
 
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(count) : "a"(pattern) : "memory");
+
     return dest;
-}  
+}
+
+void *memcpy(void *dest, const void *src, size_t count)
+{
+    void *d = dest;
+    const void *s = src;
+
+    if (!mem_erms && count >= 16)
+    {
+        size_t quads = count >> 3;
+
+        count &= 7;
+
+        __asm__ __volatile__("rep movsq" : "+D"(d), "+S"(s), "+c"(quads) : : "memory");
+    }
+
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(s), "+c"(count) : : "memory");
+
+    return dest;
+}
+
+/**
+ * @brief Copies between buffers that may overlap.
+ * Forward copying is only wrong when the destination starts inside the
+ * source, then the copy runs backwards (DF set): the odd trailing bytes
+ * first, then quadwords down to the start.
+ */
+void *memmove(void *dest, const void *src, size_t count)
+{
+    if ((uintptr_t)dest <= (uintptr_t)src || (uintptr_t)dest >= (uintptr_t)src + count)
+    {
+        return memcpy(dest, src, count);
+    }
+
+    uint8_t *d = (uint8_t *)dest + count - 1;
+    const uint8_t *s = (const uint8_t *)src + count - 1;
+    size_t tail = count & 7;
+    size_t quads = count >> 3;
+
+    __asm__ __volatile__(
+        "std\n\t"
+        "rep movsb\n\t"
+        "sub $7, %%rsi\n\t"
+        "sub $7, %%rdi\n\t"
+        "mov %[quads], %%rcx\n\t"
+        "rep movsq\n\t"
+        "cld"
+        : "+D"(d), "+S"(s), "+c"(tail)
+        : [quads] "r"(quads)
+        : "memory", "cc");
+
+    return dest;
+}
+
+typedef uint64_t __attribute__((may_alias)) mem_word;
+
+/**
+ * @brief Compares quadwords until one differs, then finds the byte.
+ * REPE CMPSB is microcoded one byte at a time on every CPU, so a word
+ * loop in C is the faster choice here.
+ */
+int memcmp(const void *a, const void *b, size_t count)
+{
+    const uint8_t *pa = (const uint8_t *)a;
+    const uint8_t *pb = (const uint8_t *)b;
+
+    while (count >= 8 && *(const mem_word *)pa == *(const mem_word *)pb)
+    {
+        pa += 8;
+        pb += 8;
+        count -= 8;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pa[i] != pb[i])
+        {
+            return pa[i] < pb[i] ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+#define MEM_BENCH_BYTES (1024 * 1024)
+#define MEM_BENCH_TOTAL (8 * 1024 * 1024)
+
+static void mem_bench_print(const char *name, uint64_t size, uint64_t bytes, uint64_t cycles)
+{
+    // Bytes per cycle with two decimals, without floating point
+    uint64_t hundredths = cycles ? bytes * 100 / cycles : 0;
+
+    serial_print(name);
+    serial_print(" ");
+    serial_print_dec(size);
+    serial_print(" B: ");
+    serial_print_dec(hundredths / 100);
+    serial_print(".");
+    serial_print_dec((hundredths / 10) % 10);
+    serial_print_dec(hundredths % 10);
+    serial_print(" bytes/cycle\n");
+}
+
+static void mem_bench_run(uint8_t *src, uint8_t *dst)
+{
+    for (uint64_t size = 64; size <= MEM_BENCH_BYTES; size <<= 2)
+    {
+        uint64_t rounds = MEM_BENCH_TOTAL / size;
+
+        uint64_t start = rdtsc();
+        for (uint64_t i = 0; i < rounds; i++)
+        {
+            memset(dst, (int)i, size);
+        }
+        mem_bench_print("memset", size, rounds * size, rdtsc() - start);
+
+        start = rdtsc();
+        for (uint64_t i = 0; i < rounds; i++)
+        {
+            memcpy(dst, src, size);
+        }
+        mem_bench_print("memcpy", size, rounds * size, rdtsc() - start);
+    }
+}
+
+/**
+ * @brief Measures memset and memcpy throughput from 64 B to 1 MiB.
+ * Each size moves the same total so the cache warms up the same way.
+ * On ERMS CPUs both strategies are run for comparison.
+ */
+void mem_benchmark(void)
+{
+    unsigned int order = pmm_order_for(MEM_BENCH_BYTES);
+    uint64_t src = pmm_alloc(order);
+    uint64_t dst = pmm_alloc(order);
+
+    if (src == 0 || dst == 0)
+    {
+        serial_print("Benchmark: not enough memory\n");
+    }
+    else
+    {
+        bool erms = mem_erms;
+
+        serial_print(erms ? "Benchmark (ERMS):\n" : "Benchmark (quadwords):\n");
+        mem_bench_run((uint8_t *)(uintptr_t)src, (uint8_t *)(uintptr_t)dst);
+
+        if (erms)
+        {
+            mem_erms = false;
+            serial_print("Benchmark (quadwords):\n");
+            mem_bench_run((uint8_t *)(uintptr_t)src, (uint8_t *)(uintptr_t)dst);
+            mem_erms = true;
+        }
+    }
+
+    if (src != 0)
+    {
+        pmm_free(src, order);
+    }
+
+    if (dst != 0)
+    {
+        pmm_free(dst, order);
+    }
+}
 
 /**
  * @brief Allocates and zeroes a 4KB block of memory for a new page table.
- * Page tables must be 4KB aligned. Stale data in 
- * a new table could be interpreted by the CPU as valid present mappings.
+ * Page tables must be 4KB aligned, which every order 0 frame is. Stale
+ * data in a new table could be interpreted by the CPU as valid present
+ * mappings.
  */
 static uint64_t alloc_page_table(void) 
 {
-    // Check if the current pointer is 4KB aligned (lower 12 bits must be 0)
-    if (next_free_page & 0xFFF) 
+    uint64_t addr = pmm_alloc(0);
+
+    if (addr == 0)
     {
-        serial_print("Page table allocation is not 4KB aligned\n");
+        serial_print("Out of memory for page tables\n");
         hcf(); 
     }
 
-    uint64_t addr = next_free_page;
-    next_free_page += 0x1000;
-
     uint64_t* pt = (uint64_t*)(uintptr_t)addr;
     memset((void*)pt, 0, 4096);
 
@@ -59,121 +329,250 @@ static inline void invlpg(uintptr_t addr)
     asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
-/**
- * @brief Walks the 4-level page hierarchy to map a virtual address to a physical one.
- * In 64-bit mode, the CPU doesn't know where a physical address is until 
- * we define it in the tables. This function goes through the levels:
- * PML4 -> PDPT -> PD -> PT.
- */
-void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) 
+static inline void reload_cr3(void)
 {
     uint64_t cr3;
-    asm volatile("mov %%cr3, %0" : "=r"(cr3));
-
-    uint64_t* pml4 = (uint64_t*)(cr3 & ~0xFFFULL);
-
-    // Calculate indices based on virtual address
-    uint64_t pml4_i = (virtual_addr >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virtual_addr >> 30) & 0x1FF;
-    uint64_t pd_i = (virtual_addr >> 21) & 0x1FF;
-    uint64_t pt_i = (virtual_addr >> 12) & 0x1FF;
+    asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) :: "memory");
+}
 
-    if (!(pml4[pml4_i] & PAGE_PRESENT)) 
+/**
+ * @brief Frees a page table and every table below it.
+ * Used when a large page replaces a range that was mapped in smaller pieces.
+ */
+static void free_page_table(uint64_t *table, int level)
+{
+    if (level > 0)
     {
-        pml4[pml4_i] = alloc_page_table() | PAGE_PRESENT | PAGE_WRITE;
+        for (int i = 0; i < 512; i++)
+        {
+            if ((table[i] & PAGE_PRESENT) && !(table[i] & PAGE_HUGE))
+            {
+                free_page_table((uint64_t *)(uintptr_t)(table[i] & PAGE_ADDR_MASK), level - 1);
+            }
+        }
     }
-    
-    uint64_t* pdpt = (uint64_t*)(uintptr_t)(pml4[pml4_i] & ~0xFFFULL);
 
-    if (!(pdpt[pdpt_i] & PAGE_PRESENT)) 
+    pmm_free((uint64_t)(uintptr_t)table, 0);
+}
+
+/**
+ * @brief Returns the table an entry points to, creating it if needed.
+ * A large page in the way is split into a table that maps the same
+ * memory with the same flags one level down, so the parts of it outside
+ * the new range keep working.
+ */
+static uint64_t *next_table(uint64_t *entry, int level, bool *flush)
+{
+    if (*entry & PAGE_PRESENT)
     {
-        pdpt[pdpt_i] = alloc_page_table() | PAGE_PRESENT | PAGE_WRITE;
+        if (!(*entry & PAGE_HUGE))
+        {
+            return (uint64_t *)(uintptr_t)(*entry & PAGE_ADDR_MASK);
+        }
+
+        uint64_t span = 1ULL << PAGE_LEVEL_SHIFT(level - 1);
+        uint64_t base = *entry & PAGE_ADDR_MASK & ~((span << 9) - 1);
+        uint64_t flags = *entry & ~PAGE_ADDR_MASK;
+        uint64_t table = alloc_page_table();
+        uint64_t *split = (uint64_t *)(uintptr_t)table;
+
+        // Bit 7 is PAGE_HUGE in a directory but PAGE_PAT in a page table entry
+        if (level == 1)
+        {
+            flags &= ~PAGE_HUGE;
+            flags |= (*entry & PAGE_PAT_LARGE) ? PAGE_PAT : 0;
+        }
+        else
+        {
+            flags |= *entry & PAGE_PAT_LARGE;
+        }
+
+        for (int i = 0; i < 512; i++)
+        {
+            split[i] = (base + i * span) | flags;
+        }
+
+        *entry = table | PAGE_PRESENT | PAGE_WRITE;
+        *flush = true;
+
+        return split;
     }
-    
-    uint64_t* pd = (uint64_t*)(uintptr_t)(pdpt[pdpt_i] & ~0xFFFULL);
 
-    if (!(pd[pd_i] & PAGE_PRESENT)) 
+    *entry = alloc_page_table() | PAGE_PRESENT | PAGE_WRITE;
+
+    return (uint64_t *)(uintptr_t)(*entry & PAGE_ADDR_MASK);
+}
+
+/**
+ * @brief Fills the entries of one table that cover [virt, end).
+ * Each entry becomes a leaf when the range covers all of it and both
+ * addresses are aligned to its size, otherwise the walk goes one level
+ * down, so every table on the path is visited once per range.
+ */
+static void map_level(uint64_t *table, int level, uint64_t virt, uint64_t phys, uint64_t end, uint64_t flags, bool pat, bool *flush)
+{
+    uint64_t span = 1ULL << PAGE_LEVEL_SHIFT(level);
+    bool leaf_allowed = level == 0 || level == 1 || (level == 2 && mem_pdpe1gb);
+
+    while (virt < end)
     {
-        pd[pd_i] = alloc_page_table() | PAGE_PRESENT | PAGE_WRITE;
+        uint64_t *entry = &table[(virt >> PAGE_LEVEL_SHIFT(level)) & 0x1FF];
+        uint64_t next = (virt & ~(span - 1)) + span;
+
+        if (next > end)
+        {
+            next = end;
+        }
+
+        if (leaf_allowed && next - virt == span && (phys & (span - 1)) == 0)
+        {
+            if (*entry & PAGE_PRESENT)
+            {
+                if (level > 0 && !(*entry & PAGE_HUGE))
+                {
+                    free_page_table((uint64_t *)(uintptr_t)(*entry & PAGE_ADDR_MASK), level - 1);
+                }
+
+                *flush = true;
+            }
+
+            if (level > 0)
+            {
+                *entry = phys | flags | PAGE_HUGE | (pat ? PAGE_PAT_LARGE : 0);
+            }
+            else
+            {
+                *entry = phys | flags | (pat ? PAGE_PAT : 0);
+            }
+        }
+        else
+        {
+            map_level(next_table(entry, level, flush), level - 1, virt, phys, next, flags, pat, flush);
+        }
+
+        phys += next - virt;
+        virt = next;
     }
-    
-    uint64_t* pt = (uint64_t*)(uintptr_t)(pd[pd_i] & ~0xFFFULL);
+}
 
-    // Virtual address index points to physical address
-    pt[pt_i] = (physical_addr & ~0xFFFULL) | flags;
+/**
+ * @brief Translates a memory type into the PWT, PCD and PAT entry bits.
+ * The PAT bit is reported separately because its position depends on
+ * the level of the entry.
+ */
+static uint64_t mem_type_flags(mem_type type, bool *pat)
+{
+    *pat = false;
 
-    invlpg(virtual_addr);
+    switch (type)
+    {
+        case MEM_WT:
+            return PAGE_PWT;
+        case MEM_WC:
+            if (mem_pat)
+            {
+                *pat = true;
+                return 0;
+            }
+            // UC- still lets a write-combining MTRR take effect
+            return PAGE_PCD;
+        case MEM_UC_MINUS:
+            return PAGE_PCD;
+        case MEM_UC:
+            return PAGE_PCD | PAGE_PWT;
+        case MEM_WB:
+        default:
+            return 0;
+    }
 }
 
 /**
- * @brief Maps a 2MB huge page by setting the PAGE_HUGE bit in the page directory.
- * This skips the 4th level (page table) entirely.
+ * @brief Maps [virt, virt + size) to phys with the largest pages that fit.
+ * The caching behaviour comes from type, flags only carry the rest.
+ * Addresses and size are rounded out to 4KB. 2MB pages are used wherever
+ * both addresses are aligned and 1GB pages too when the CPU has them.
+ * New entries over unmapped memory need no TLB maintenance; if existing
+ * ones changed, the TLB is flushed once for the whole range: page by page
+ * for short ranges, with a CR3 reload otherwise.
  */
-void map_huge_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) 
+void map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags, mem_type type)
 {
+    uint64_t start = virt & ~0xFFFULL;
+    uint64_t end = (virt + size + 0xFFF) & ~0xFFFULL;
+    bool flush = false;
+    bool pat;
+
+    flags = (flags & ~(PAGE_HUGE | PAGE_PAT_LARGE)) | mem_type_flags(type, &pat);
+
     uint64_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
 
-    uint64_t* pml4 = (uint64_t*)(cr3 & ~0xFFFULL);
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(cr3 & PAGE_ADDR_MASK);
 
-    // Calculate indices
-    uint64_t pml4_i = (virtual_addr >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virtual_addr >> 30) & 0x1FF;
-    uint64_t pd_i = (virtual_addr >> 21) & 0x1FF;
+    map_level(pml4, 3, start, phys & ~0xFFFULL, end, flags, pat, &flush);
 
-    // PML4 -> PDPT
-    if (!(pml4[pml4_i] & PAGE_PRESENT)) 
+    if (!flush)
     {
-        pml4[pml4_i] = alloc_page_table() | PAGE_PRESENT | PAGE_WRITE;
+        return;
     }
-    uint64_t* pdpt = (uint64_t*)(uintptr_t)(pml4[pml4_i] & ~0xFFFULL);
 
-    // PDPT -> PD
-    if (!(pdpt[pdpt_i] & PAGE_PRESENT)) 
+    if (end - start <= MAP_INVLPG_MAX_PAGES * 0x1000ULL)
     {
-        pdpt[pdpt_i] = alloc_page_table() | PAGE_PRESENT | PAGE_WRITE;
+        for (uint64_t addr = start; addr < end; addr += 0x1000)
+        {
+            invlpg(addr);
+        }
     }
-    uint64_t* pd = (uint64_t*)(uintptr_t)(pdpt[pdpt_i] & ~0xFFFULL);
+    else
+    {
+        reload_cr3();
+    }
+}
 
-    // For a huge page, the PD entry points to physical address, not a PT.
-    // Address must be 2MB aligned (masking lower 21 bits).
-    pd[pd_i] = (physical_addr & ~0x1FFFFFULL) | flags | PAGE_HUGE;
+/**
+ * @brief Maps a single 4KB page.
+ */
+void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) 
+{
+    map_range(virtual_addr, physical_addr, 0x1000, flags, MEM_WB);
+}
 
-    invlpg(virtual_addr);
+/**
+ * @brief Maps a 2MB huge page. Both addresses must be 2MB aligned.
+ */
+void map_huge_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) 
+{
+    map_range(virtual_addr & ~0x1FFFFFULL, physical_addr & ~0x1FFFFFULL, HUGE_PAGE_SIZE, flags, MEM_WB);
 }
 
 /**
  * @brief Maps a range of memory for Memory-Mapped I/O (MMIO).
  * Hardware like AHCI (SATA) is controlled via memory addresses. 
- * We must map these with PAGE_PCD (cache disable).
- * If we allowed the CPU to cache MMIO registers, we might read 
- * a stale status bit from the CPU cache instead of the actual hardware.
+ * Registers must be mapped MEM_UC: if we allowed the CPU to cache 
+ * MMIO registers, we might read a stale status bit from the CPU cache 
+ * instead of the actual hardware. Framebuffers and similar apertures 
+ * that are only written in bulk can use MEM_WC instead.
  */
-void map_mmio_region(uint64_t physical_addr, uint64_t size) 
+void map_mmio_region(uint64_t physical_addr, uint64_t size, mem_type type) 
 {
-    uint64_t addr = physical_addr & ~0xFFFULL;
-    uint64_t end = (physical_addr + size + 0xFFF) & ~0xFFFULL;
-    uint64_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_PCD | PAGE_PWT;
+    map_range(physical_addr, physical_addr, size, PAGE_PRESENT | PAGE_WRITE, type);
+
+    serial_print("MMIO region mapped successfully\n");
+}
 
-    while (addr < end) 
+/**
+ * @brief Identity maps RAM, normally MEM_WB.
+ * Also used to change the type of a buffer in place, e.g. to MEM_WC for
+ * a staging buffer the CPU only streams writes into for a device. Lines
+ * cached under the old type are written back first; the caller must
+ * switch the buffer back to MEM_WB before freeing it.
+ */
+void map_ram_region(uint64_t physical_addr, uint64_t size, mem_type type)
+{
+    if (type != MEM_WB)
     {
-        /**
-         * Mapping a 1GB AHCI BAR with 4KB pages requires 
-         * 262,144 page table entries. Using 2MB pages reduces 
-         * this to only 512 entries in the page 
-         * directory, improving TLB efficiency.
-         */
-        if ((addr % 0x200000 == 0) && (end - addr >= 0x200000)) 
-        {
-            map_huge_page(addr, addr, flags | PAGE_HUGE);
-            addr += 0x200000;
-        } 
-        else 
-        {
-            map_page(addr, addr, flags);
-            addr += 0x1000;
-        }
+        asm volatile("wbinvd" ::: "memory");
     }
 
-    serial_print("MMIO region mapped successfully\n");
+    map_range(physical_addr, physical_addr, size, PAGE_PRESENT | PAGE_WRITE, type);
 }
\ No newline at end of file
@@ -0,0 +1,341 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pmm.h"
+#include "memory.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "driver/serial.h"
+
+// Set on the first frame of a free block, the low bits hold its order
+#define PMM_FRAME_FREE 0x80
+
+/**
+ * Free blocks are linked through their own first bytes. The memory is
+ * unused by definition, so the lists cost nothing beyond their heads.
+ */
+typedef struct pmm_block pmm_block;
+
+struct pmm_block
+{
+    pmm_block *next;
+    pmm_block *prev;
+};
+
+static pmm_block *free_lists[PMM_MAX_ORDER + 1];
+static uint64_t free_counts[PMM_MAX_ORDER + 1];
+
+// One state byte per frame, carved out of the first region that can hold it
+static uint8_t *frame_state;
+static uint64_t frame_count;
+
+static uint64_t pages_total;
+static uint64_t pages_free;
+
+// Guards the free lists, frame states and counters against other CPUs
+static spinlock pmm_lock;
+
+static void free_list_push(uint64_t pfn, unsigned int order)
+{
+    pmm_block *block = (pmm_block *)(uintptr_t)(pfn << PMM_PAGE_SHIFT);
+
+    block->prev = NULL;
+    block->next = free_lists[order];
+
+    if (free_lists[order] != NULL)
+    {
+        free_lists[order]->prev = block;
+    }
+
+    free_lists[order] = block;
+    free_counts[order]++;
+    frame_state[pfn] = PMM_FRAME_FREE | order;
+}
+
+static void free_list_remove(uint64_t pfn, unsigned int order)
+{
+    pmm_block *block = (pmm_block *)(uintptr_t)(pfn << PMM_PAGE_SHIFT);
+
+    if (block->prev != NULL)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        free_lists[order] = block->next;
+    }
+
+    if (block->next != NULL)
+    {
+        block->next->prev = block->prev;
+    }
+
+    free_counts[order]--;
+    frame_state[pfn] = 0;
+}
+
+/**
+ * @brief Returns a block and merges it with its buddy for as long as the
+ * buddy is free and whole. A block's buddy differs from it only in the
+ * bit of its own order, so both the lookup and the merge are O(1) per
+ * order and a free is O(log n) overall.
+ */
+static void pmm_release(uint64_t pfn, unsigned int order)
+{
+    while (order < PMM_MAX_ORDER)
+    {
+        uint64_t buddy = pfn ^ (1ULL << order);
+
+        if (buddy >= frame_count || frame_state[buddy] != (PMM_FRAME_FREE | order))
+        {
+            break;
+        }
+
+        free_list_remove(buddy, order);
+
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+
+    free_list_push(pfn, order);
+}
+
+/**
+ * @brief Hands a range of usable RAM to the allocator.
+ * The range must already be identity mapped. It is cut into the largest
+ * naturally aligned blocks that fit, and each goes through the normal
+ * free path so that neighbouring ranges merge where their blocks are buddies.
+ */
+void pmm_add_region(uint64_t base, uint64_t length)
+{
+    uint64_t start = (base + PMM_PAGE_SIZE - 1) >> PMM_PAGE_SHIFT;
+    uint64_t end = (base + length) >> PMM_PAGE_SHIFT;
+
+    if (end > frame_count)
+    {
+        end = frame_count;
+    }
+
+    // Address 0 doubles as the allocation failure value
+    if (start == 0)
+    {
+        start = 1;
+    }
+
+    while (start < end)
+    {
+        unsigned int order = PMM_MAX_ORDER;
+
+        while ((start & ((1ULL << order) - 1)) != 0 || start + (1ULL << order) > end)
+        {
+            order--;
+        }
+
+        pmm_release(start, order);
+
+        pages_total += 1ULL << order;
+        pages_free += 1ULL << order;
+        start += 1ULL << order;
+    }
+}
+
+/**
+ * @brief Builds the free lists from a map of usable RAM.
+ * The frame state table covers every frame up to the highest usable
+ * address and lives at the start of the first region big enough for it.
+ * Only memory below PMM_BOOT_MAPPED is added here; the caller maps the
+ * rest and hands it over with pmm_add_region.
+ */
+void pmm_init(const pmm_region *regions, int count)
+{
+    uint64_t top = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t end = regions[i].base + regions[i].length;
+
+        if (end > top)
+        {
+            top = end;
+        }
+    }
+
+    frame_count = top >> PMM_PAGE_SHIFT;
+
+    uint64_t table_size = (frame_count + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+    int table_region = -1;
+
+    for (int i = 0; i < count && table_region < 0; i++)
+    {
+        uint64_t base = (regions[i].base + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+
+        if (base + table_size <= regions[i].base + regions[i].length && base + table_size <= PMM_BOOT_MAPPED)
+        {
+            frame_state = (uint8_t *)(uintptr_t)base;
+            table_region = i;
+        }
+    }
+
+    if (table_region < 0)
+    {
+        serial_print("No memory for the frame table\n");
+        hcf();
+    }
+
+    memset(frame_state, 0, frame_count);
+
+    for (int i = 0; i <= PMM_MAX_ORDER; i++)
+    {
+        free_lists[i] = NULL;
+        free_counts[i] = 0;
+    }
+
+    pages_total = 0;
+    pages_free = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t base = regions[i].base;
+        uint64_t length = regions[i].length;
+
+        if (i == table_region)
+        {
+            uint64_t table_end = (uint64_t)(uintptr_t)frame_state + table_size;
+
+            length -= table_end - base;
+            base = table_end;
+        }
+
+        if (base >= PMM_BOOT_MAPPED)
+        {
+            continue;
+        }
+
+        if (base + length > PMM_BOOT_MAPPED)
+        {
+            length = PMM_BOOT_MAPPED - base;
+        }
+
+        pmm_add_region(base, length);
+    }
+
+}
+
+/**
+ * @brief Allocates 2^order contiguous pages that end at or below limit.
+ * The smallest free block that fits is split in halves until it has the
+ * requested order, the unused halves go back on their lists. Devices
+ * limited to 32-bit DMA pass 4 GiB; any block on a list qualifies
+ * otherwise, which keeps the common case O(log n).
+ * @return The physical address, or 0 if no suitable block is free.
+ */
+uint64_t pmm_alloc_below(unsigned int order, uint64_t limit)
+{
+    if (order > PMM_MAX_ORDER)
+    {
+        return 0;
+    }
+
+    // Slab and block layer frees can run from interrupt handlers
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    for (unsigned int current = order; current <= PMM_MAX_ORDER; current++)
+    {
+        uint64_t block_size = (uint64_t)PMM_PAGE_SIZE << current;
+
+        for (pmm_block *block = free_lists[current]; block != NULL; block = block->next)
+        {
+            uint64_t phys = (uint64_t)(uintptr_t)block;
+
+            if (phys + block_size > limit)
+            {
+                continue;
+            }
+
+            uint64_t pfn = phys >> PMM_PAGE_SHIFT;
+            free_list_remove(pfn, current);
+
+            while (current > order)
+            {
+                current--;
+                free_list_push(pfn + (1ULL << current), current);
+            }
+
+            pages_free -= 1ULL << order;
+
+            spin_unlock_irqrestore(&pmm_lock, flags);
+
+            return phys;
+        }
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    return 0;
+}
+
+uint64_t pmm_alloc(unsigned int order)
+{
+    return pmm_alloc_below(order, ~0ULL);
+}
+
+/**
+ * @brief Frees a block from pmm_alloc. The order must be the one it was
+ * allocated with, the allocator keeps no record of it for used blocks.
+ */
+void pmm_free(uint64_t phys, unsigned int order)
+{
+    uint64_t pfn = phys >> PMM_PAGE_SHIFT;
+
+    if (phys == 0 || order > PMM_MAX_ORDER || (pfn & ((1ULL << order) - 1)) != 0 || pfn >= frame_count)
+    {
+        serial_print("Warning: Bad physical free\n");
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    pmm_release(pfn, order);
+    pages_free += 1ULL << order;
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/**
+ * @brief Smallest order whose block holds size bytes.
+ * Sizes above 4 MiB yield PMM_MAX_ORDER + 1, which pmm_alloc refuses.
+ */
+unsigned int pmm_order_for(size_t size)
+{
+    unsigned int order = 0;
+
+    while (order <= PMM_MAX_ORDER && ((uint64_t)PMM_PAGE_SIZE << order) < size)
+    {
+        order++;
+    }
+
+    return order;
+}
+
+uint64_t pmm_free_pages(void)
+{
+    return pages_free;
+}
+
+void pmm_print_stats(void)
+{
+    serial_print("Physical memory: ");
+    serial_print_dec(pages_free);
+    serial_print(" of ");
+    serial_print_dec(pages_total);
+    serial_print(" pages free, blocks per order:");
+
+    for (int i = 0; i <= PMM_MAX_ORDER; i++)
+    {
+        serial_print(" ");
+        serial_print_dec(free_counts[i]);
+    }
+
+    serial_print("\n");
+}
\ No newline at end of file
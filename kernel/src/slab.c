@@ -0,0 +1,399 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "slab.h"
+#include "cpu.h"
+#include "memory.h"
+#include "pmm.h"
+#include "driver/serial.h"
+
+#define KMEM_SLAB_MAGIC 0x534C4142
+#define KMEM_LARGE_MAGIC 0x4C415247
+
+// Allocations above the largest class get whole pages behind this header
+#define KMEM_LARGE_HEADER 64
+
+struct kmem_slab
+{
+    uint32_t magic;
+    uint32_t inuse;
+    kmem_cache *cache;
+    kmem_slab *next;
+    kmem_slab *prev;
+    void *free;                 // Free objects, linked through their first word
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t order;
+} kmem_large;
+
+// The cache of cache descriptors cannot come from itself
+static kmem_cache kmem_cache_cache;
+static kmem_cache kmalloc_caches[KMALLOC_CLASSES];
+static kmem_cache *kmem_caches;
+
+// Large allocations go straight to the frame allocator, only their counters need a lock
+static spinlock kmem_large_lock;
+static uint64_t kmem_large_allocs;
+static uint64_t kmem_large_pages;
+
+static const char *kmalloc_names[KMALLOC_CLASSES] =
+{
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+static void slab_list_push(kmem_slab **head, kmem_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+
+    if (*head != NULL)
+    {
+        (*head)->prev = slab;
+    }
+
+    *head = slab;
+}
+
+static void slab_list_remove(kmem_slab **head, kmem_slab *slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *head = slab->next;
+    }
+
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief Computes a cache's layout and links it into the cache list.
+ * The slab order is the smallest one that holds KMEM_MIN_OBJECTS, except
+ * for the kmalloc classes, whose slabs are always one page so kfree can
+ * find the header from any object.
+ */
+static void kmem_cache_setup(kmem_cache *cache, const char *name, size_t size, size_t align, bool single_page)
+{
+    // Free objects hold the free list link
+    if (align < sizeof(void *))
+    {
+        align = sizeof(void *);
+    }
+
+    if (size < sizeof(void *))
+    {
+        size = sizeof(void *);
+    }
+
+    cache->name = name;
+    spin_lock_init(&cache->lock);
+    cache->object_size = (uint32_t)((size + align - 1) & ~(align - 1));
+    cache->first_offset = (uint32_t)((sizeof(kmem_slab) + align - 1) & ~(align - 1));
+    cache->slab_order = 0;
+
+    while (!single_page && cache->slab_order < PMM_MAX_ORDER &&
+           (((uint64_t)PMM_PAGE_SIZE << cache->slab_order) - cache->first_offset) / cache->object_size < KMEM_MIN_OBJECTS)
+    {
+        cache->slab_order++;
+    }
+
+    cache->objects_per_slab = (uint32_t)((((uint64_t)PMM_PAGE_SIZE << cache->slab_order) - cache->first_offset) / cache->object_size);
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty_slabs = 0;
+    cache->slabs = 0;
+    cache->active_objects = 0;
+    cache->allocs = 0;
+    cache->frees = 0;
+
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+}
+
+static kmem_slab *kmem_slab_create(kmem_cache *cache)
+{
+    uint64_t phys = pmm_alloc(cache->slab_order);
+
+    if (phys == 0)
+    {
+        return NULL;
+    }
+
+    kmem_slab *slab = (kmem_slab *)(uintptr_t)phys;
+    uint8_t *object = (uint8_t *)slab + cache->first_offset;
+
+    slab->magic = KMEM_SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = cache;
+    slab->free = NULL;
+
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++)
+    {
+        *(void **)object = slab->free;
+        slab->free = object;
+        object += cache->object_size;
+    }
+
+    slab_list_push(&cache->partial, slab);
+    cache->empty_slabs++;
+    cache->slabs++;
+
+    return slab;
+}
+
+void kmem_init(void)
+{
+    kmem_caches = NULL;
+    kmem_large_allocs = 0;
+    kmem_large_pages = 0;
+
+    kmem_cache_setup(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache), sizeof(void *), false);
+
+    for (int i = 0; i < KMALLOC_CLASSES; i++)
+    {
+        kmem_cache_setup(&kmalloc_caches[i], kmalloc_names[i], (size_t)1 << (KMALLOC_MIN_SHIFT + i), sizeof(void *), true);
+    }
+}
+
+/**
+ * @brief Creates a named cache for one kind of object.
+ * Per-type caches keep equal objects together and show up on their own
+ * in the statistics, which makes leaks in one subsystem easy to spot.
+ * @param align Power of two, at least pointer alignment is always used.
+ * @return The cache, or NULL if no memory was left for its descriptor.
+ */
+kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align)
+{
+    kmem_cache *cache = kmem_cache_alloc(&kmem_cache_cache);
+
+    if (cache != NULL)
+    {
+        kmem_cache_setup(cache, name, size, align, false);
+    }
+
+    return cache;
+}
+
+/**
+ * @brief Takes an object from the first slab with space.
+ * The fast path only pops a free list: memory is identity mapped, so
+ * no page tables are touched, and a new slab is only needed when every
+ * existing one is full.
+ * @return The object, or NULL when out of memory. Contents are undefined.
+ */
+void *kmem_cache_alloc(kmem_cache *cache)
+{
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    kmem_slab *slab = cache->partial;
+
+    if (slab == NULL)
+    {
+        slab = kmem_slab_create(cache);
+
+        if (slab == NULL)
+        {
+            spin_unlock_irqrestore(&cache->lock, flags);
+            return NULL;
+        }
+    }
+
+    void *object = slab->free;
+    slab->free = *(void **)object;
+
+    if (slab->inuse++ == 0)
+    {
+        cache->empty_slabs--;
+    }
+
+    if (slab->free == NULL)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->active_objects++;
+    cache->allocs++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    return object;
+}
+
+/**
+ * @brief Returns an object to its slab.
+ * A slab that becomes empty is kept for reuse as long as the cache has
+ * fewer than KMEM_EMPTY_SLABS_KEPT of them, otherwise it goes back to
+ * the frame allocator so one burst cannot pin memory forever.
+ */
+void kmem_cache_free(kmem_cache *cache, void *object)
+{
+    uint64_t slab_bytes = (uint64_t)PMM_PAGE_SIZE << cache->slab_order;
+    kmem_slab *slab = (kmem_slab *)((uintptr_t)object & ~(uintptr_t)(slab_bytes - 1));
+
+    if (slab->magic != KMEM_SLAB_MAGIC || slab->cache != cache)
+    {
+        serial_print("Warning: Object freed to the wrong cache\n");
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    if (slab->free == NULL)
+    {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *(void **)object = slab->free;
+    slab->free = object;
+    slab->inuse--;
+
+    cache->active_objects--;
+    cache->frees++;
+
+    if (slab->inuse == 0)
+    {
+        if (cache->empty_slabs >= KMEM_EMPTY_SLABS_KEPT)
+        {
+            slab_list_remove(&cache->partial, slab);
+            slab->magic = 0;
+            cache->slabs--;
+            pmm_free((uint64_t)(uintptr_t)slab, cache->slab_order);
+        }
+        else
+        {
+            cache->empty_slabs++;
+        }
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * @brief General purpose allocation.
+ * Sizes up to 1 KiB come from the power of two class that fits, larger
+ * ones get whole pages from the frame allocator with a small header.
+ * @return The memory, or NULL for size 0 or when out of memory.
+ */
+void *kmalloc(size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    if (size <= ((size_t)1 << KMALLOC_MAX_SHIFT))
+    {
+        int index = 0;
+
+        while (((size_t)1 << (KMALLOC_MIN_SHIFT + index)) < size)
+        {
+            index++;
+        }
+
+        return kmem_cache_alloc(&kmalloc_caches[index]);
+    }
+
+    unsigned int order = pmm_order_for(size + KMEM_LARGE_HEADER);
+    uint64_t phys = pmm_alloc(order);
+
+    if (phys == 0)
+    {
+        return NULL;
+    }
+
+    kmem_large *large = (kmem_large *)(uintptr_t)phys;
+    large->magic = KMEM_LARGE_MAGIC;
+    large->order = order;
+
+    uint64_t flags = spin_lock_irqsave(&kmem_large_lock);
+    kmem_large_allocs++;
+    kmem_large_pages += 1ULL << order;
+    spin_unlock_irqrestore(&kmem_large_lock, flags);
+
+    return (uint8_t *)large + KMEM_LARGE_HEADER;
+}
+
+void *kzalloc(size_t size)
+{
+    void *ptr = kmalloc(size);
+
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Frees memory from kmalloc. Objects from named caches go back
+ * through kmem_cache_free, their slabs may span more than one page.
+ */
+void kfree(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    uintptr_t page = (uintptr_t)ptr & ~(uintptr_t)(PMM_PAGE_SIZE - 1);
+    kmem_slab *slab = (kmem_slab *)page;
+
+    if (slab->magic == KMEM_SLAB_MAGIC)
+    {
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    kmem_large *large = (kmem_large *)page;
+
+    if (large->magic != KMEM_LARGE_MAGIC || (uintptr_t)ptr != page + KMEM_LARGE_HEADER)
+    {
+        serial_print("Warning: kfree of a pointer kmalloc did not return\n");
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&kmem_large_lock);
+    kmem_large_allocs--;
+    kmem_large_pages -= 1ULL << large->order;
+    spin_unlock_irqrestore(&kmem_large_lock, flags);
+
+    large->magic = 0;
+    pmm_free(page, large->order);
+}
+
+void kmem_print_stats(void)
+{
+    for (kmem_cache *cache = kmem_caches; cache != NULL; cache = cache->next)
+    {
+        serial_print(cache->name);
+        serial_print(": ");
+        serial_print_dec(cache->active_objects);
+        serial_print(" of ");
+        serial_print_dec(cache->slabs * cache->objects_per_slab);
+        serial_print(" objects, ");
+        serial_print_dec(cache->slabs);
+        serial_print(" slabs, ");
+        serial_print_dec(cache->allocs);
+        serial_print(" allocs, ");
+        serial_print_dec(cache->frees);
+        serial_print(" frees\n");
+    }
+
+    serial_print("kmalloc-large: ");
+    serial_print_dec(kmem_large_allocs);
+    serial_print(" allocations, ");
+    serial_print_dec(kmem_large_pages);
+    serial_print(" pages\n");
+}
\ No newline at end of file
@@ -0,0 +1,294 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "acpi.h"
+#include "cpu.h"
+#include "idt.h"
+#include "ktime.h"
+#include "memory.h"
+#include "pmm.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "driver/apic.h"
+#include "driver/serial.h"
+
+/**
+ * Parameter block at the end of the trampoline, filled in by the BSP for
+ * each AP in turn. Must match the layout in smp_trampoline.asm.
+ */
+typedef struct
+{
+    uint64_t cr3;
+    uint64_t efer;
+    uint64_t stack;
+    uint64_t cpu;
+    uint64_t entry;
+    idt_pointer gdtr;           // Same layout as the IDT's, for sgdt/lgdt
+    idt_pointer idtr;
+} __attribute__((packed)) trampoline_params;
+
+extern const uint8_t smp_trampoline_start[];
+extern const uint8_t smp_trampoline_params[];
+extern const uint8_t smp_trampoline_end[];
+
+static cpu_info cpus[SMP_MAX_CPUS];
+static uint32_t cpu_count;
+
+static void smp_set_cpu(cpu_info *cpu)
+{
+    cpu->self = cpu;
+    wrmsr(IA32_GS_BASE_MSR, (uint64_t)(uintptr_t)cpu);
+}
+
+// The IPI only ends the HLT in the idle loop, isr_dispatch sends the EOI
+static void smp_wake_handler(interrupt_frame *frame)
+{
+    (void)frame;
+}
+
+/**
+ * @brief Idle loop of an application processor.
+ * Runs whatever smp_run_on left in its work slot with interrupts on,
+ * then sleeps until the next interrupt.
+ */
+static void smp_ap_idle(cpu_info *cpu)
+{
+    __asm__ __volatile__("cli");
+
+    for (;;)
+    {
+        smp_work_fn work = cpu->work;
+
+        if (work == NULL)
+        {
+            cpu_idle();
+            continue;
+        }
+
+        void *arg = cpu->work_arg;
+
+        __atomic_store_n(&cpu->work, NULL, __ATOMIC_RELEASE);
+
+        __asm__ __volatile__("sti");
+        work(arg);
+        __asm__ __volatile__("cli");
+    }
+}
+
+/**
+ * @brief C entry point of an application processor.
+ * The trampoline left it in long mode on the shared page tables, GDT and
+ * IDT with its own stack. What is per-CPU still needs setting up: GS,
+ * the PAT, the local APIC and its timer.
+ */
+static void smp_ap_main(cpu_info *cpu)
+{
+    smp_set_cpu(cpu);
+    mem_init_ap();
+    lapic_enable();
+    timer_init_ap();
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+
+    smp_ap_idle(cpu);
+}
+
+/**
+ * @brief Boots one AP with the INIT-SIPI-SIPI sequence.
+ * Only one AP runs the trampoline at a time, the parameter block is
+ * shared and the next AP gets it once this one reported online.
+ * @return true if the AP came up.
+ */
+static bool smp_start_ap(cpu_info *cpu)
+{
+    uint64_t stack = pmm_alloc(SMP_AP_STACK_ORDER);
+
+    if (stack == 0)
+    {
+        serial_print("SMP: Out of memory for an AP stack\n");
+        return false;
+    }
+
+    trampoline_params *params = (trampoline_params *)(uintptr_t)
+        (SMP_TRAMPOLINE_BASE + (smp_trampoline_params - smp_trampoline_start));
+    uint64_t cr3;
+
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ __volatile__("sgdt %0" : "=m"(params->gdtr));
+    __asm__ __volatile__("sidt %0" : "=m"(params->idtr));
+
+    params->cr3 = cr3;
+    params->efer = rdmsr(IA32_EFER_MSR) & ~(uint64_t)EFER_LMA;
+    params->stack = stack + (PMM_PAGE_SIZE << SMP_AP_STACK_ORDER);
+    params->cpu = (uint64_t)(uintptr_t)cpu;
+    params->entry = (uint64_t)(uintptr_t)smp_ap_main;
+
+    cpu->stack = stack;
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    mdelay(SMP_INIT_DELAY_MS);
+
+    // A second SIPI only if the first was lost, an AP that is running ignores it
+    for (int i = 0; i < 2 && !__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE); i++)
+    {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE_BASE >> 12));
+        udelay(SMP_SIPI_DELAY_US);
+    }
+
+    uint64_t deadline = ktime_deadline(SMP_AP_TIMEOUT_MS * NSEC_PER_MSEC);
+
+    while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE))
+    {
+        if (ktime_expired(deadline))
+        {
+            // The AP may still be in the trampoline, its stack stays allocated
+            serial_print("SMP: APIC ");
+            serial_print_hex8(cpu->apic_id);
+            serial_print(" did not come up\n");
+            return false;
+        }
+
+        __asm__ __volatile__("pause");
+    }
+
+    return true;
+}
+
+/**
+ * @brief Makes the BSP cpus[0] and points GS at it.
+ * Needs the local APIC mapped for its ID; everything that calls
+ * this_cpu() must run after this.
+ */
+void smp_init_bsp(void)
+{
+    cpu_info *cpu = &cpus[0];
+
+    cpu->index = 0;
+    cpu->apic_id = lapic_id();
+    cpu->online = true;
+    spin_lock_init(&cpu->work_lock);
+    smp_set_cpu(cpu);
+
+    cpu_count = 1;
+}
+
+/**
+ * @brief Starts every enabled processor listed in the ACPI MADT.
+ * Runs after the drivers set up their mappings: APs share the page
+ * tables, and nothing here shoots down stale TLB entries on other CPUs.
+ */
+void smp_init(void)
+{
+    const acpi_madt *madt = (const acpi_madt *)acpi_find_table("APIC");
+
+    if (madt == NULL)
+    {
+        serial_print("SMP: No MADT, running on the BSP only\n");
+        return;
+    }
+
+    memcpy((void *)SMP_TRAMPOLINE_BASE, smp_trampoline_start, (size_t)(smp_trampoline_end - smp_trampoline_start));
+    idt_register_handler(SMP_WAKE_VECTOR, smp_wake_handler);
+
+    uint64_t start = ktime_ns();
+    const uint8_t *entry = (const uint8_t *)madt + sizeof(acpi_madt);
+    const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+
+    while (entry + sizeof(acpi_madt_entry) <= end)
+    {
+        const acpi_madt_entry *header = (const acpi_madt_entry *)entry;
+
+        if (header->length < sizeof(acpi_madt_entry))
+        {
+            break;
+        }
+
+        entry += header->length;
+
+        if (header->type != ACPI_MADT_LOCAL_APIC || header->length < sizeof(acpi_madt_local_apic))
+        {
+            continue;
+        }
+
+        const acpi_madt_local_apic *lapic = (const acpi_madt_local_apic *)header;
+
+        if (!(lapic->flags & ACPI_MADT_LAPIC_ENABLED) || lapic->apic_id == cpus[0].apic_id)
+        {
+            continue;
+        }
+
+        if (cpu_count == SMP_MAX_CPUS)
+        {
+            serial_print("SMP: Too many processors, ignoring the rest\n");
+            break;
+        }
+
+        cpu_info *cpu = &cpus[cpu_count];
+
+        cpu->index = cpu_count;
+        cpu->apic_id = lapic->apic_id;
+        spin_lock_init(&cpu->work_lock);
+
+        if (smp_start_ap(cpu))
+        {
+            cpu_count++;
+        }
+    }
+
+    serial_print("SMP: ");
+    serial_print_dec(cpu_count);
+    serial_print(cpu_count == 1 ? " CPU online in " : " CPUs online in ");
+    serial_print_dec((ktime_ns() - start) / NSEC_PER_USEC);
+    serial_print(" us\n");
+}
+
+uint32_t smp_cpu_count(void)
+{
+    return cpu_count;
+}
+
+/**
+ * @return The CPU with that index, or NULL if it is not online.
+ */
+cpu_info *smp_cpu(uint32_t index)
+{
+    if (index >= cpu_count)
+    {
+        return NULL;
+    }
+
+    return &cpus[index];
+}
+
+/**
+ * @brief Hands a function to an idle AP and wakes it.
+ * The AP runs it once from its idle loop with interrupts enabled.
+ * @return 0 on success, -1 if the CPU is the BSP, not online or still
+ * busy with earlier work.
+ */
+int smp_run_on(uint32_t index, smp_work_fn fn, void *arg)
+{
+    if (index == 0 || index >= cpu_count || fn == NULL)
+    {
+        return -1;
+    }
+
+    cpu_info *cpu = &cpus[index];
+    uint64_t flags = spin_lock_irqsave(&cpu->work_lock);
+
+    if (cpu->work != NULL)
+    {
+        spin_unlock_irqrestore(&cpu->work_lock, flags);
+        return -1;
+    }
+
+    cpu->work_arg = arg;
+    __atomic_store_n(&cpu->work, fn, __ATOMIC_RELEASE);
+
+    spin_unlock_irqrestore(&cpu->work_lock, flags);
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_FIXED | SMP_WAKE_VECTOR);
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,105 @@
+; Application processors wake up from a SIPI in 16-bit real mode at the
+; start of a 4 KiB page below 1 MiB. smp.c copies this blob there, fills
+; in the parameter block at its end and sends the SIPI. The AP goes
+; straight from real mode to long mode (PE and PG set together), loads
+; the kernel's GDT and IDT and calls into C on its own stack.
+;
+; The blob is linked into the kernel image but runs from its copy, so
+; every absolute address goes through TRAMPOLINE(), which rebases a
+; label onto SMP_TRAMPOLINE_BASE (smp.h).
+
+%define SMP_TRAMPOLINE_BASE 0x2000
+%define TRAMPOLINE(label) (SMP_TRAMPOLINE_BASE + (label) - smp_trampoline_start)
+
+%define CR4_PAE (1 << 5)
+%define CR0_PE (1 << 0)
+%define CR0_PG (1 << 31)
+%define IA32_EFER 0xC0000080
+
+global smp_trampoline_start
+global smp_trampoline_params
+global smp_trampoline_end
+
+section .rodata
+
+[bits 16]
+
+smp_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    o32 lgdt [TRAMPOLINE(trampoline_gdt_descriptor)]
+
+    mov eax, cr4
+    or eax, CR4_PAE
+    mov cr4, eax
+
+    ; The BSP's PML4 lives below 4 GiB, stage2 built it in low memory
+    mov eax, [TRAMPOLINE(params_cr3)]
+    mov cr3, eax
+
+    ; EFER.LME (and NXE if the BSP uses it) before paging goes on
+    mov ecx, IA32_EFER
+    mov eax, [TRAMPOLINE(params_efer)]
+    mov edx, [TRAMPOLINE(params_efer) + 4]
+    wrmsr
+
+    mov eax, cr0
+    or eax, CR0_PE | CR0_PG
+    mov cr0, eax
+
+    jmp dword 0x08:TRAMPOLINE(trampoline_long_mode)
+
+[bits 64]
+
+trampoline_long_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Same selectors as the temporary GDT, so CS stays valid
+    lgdt [TRAMPOLINE(params_gdtr)]
+    lidt [TRAMPOLINE(params_idtr)]
+
+    mov rsp, [TRAMPOLINE(params_stack)]
+    mov rdi, [TRAMPOLINE(params_cpu)]
+    mov rax, [TRAMPOLINE(params_entry)]
+    call rax
+
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+align 8
+trampoline_gdt:
+    dq 0x0000000000000000
+    dq 0x00209A0000000000           ; 64-bit code, present, ring 0
+    dq 0x0000920000000000           ; Data, present, writable
+trampoline_gdt_end:
+
+trampoline_gdt_descriptor:
+    dw trampoline_gdt_end - trampoline_gdt - 1
+    dd TRAMPOLINE(trampoline_gdt)
+
+; Must match smp_trampoline_params in smp.c
+align 8
+smp_trampoline_params:
+params_cr3: dq 0
+params_efer: dq 0
+params_stack: dq 0
+params_cpu: dq 0
+params_entry: dq 0
+params_gdtr: dw 0
+    dq 0
+params_idtr: dw 0
+    dq 0
+
+smp_trampoline_end:
\ No newline at end of file
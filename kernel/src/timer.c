@@ -0,0 +1,314 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "idt.h"
+#include "ktime.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "driver/apic.h"
+#include "driver/serial.h"
+
+/**
+ * Pending timers form a binary min-heap on their deadline. Adding and
+ * cancelling are O(log n) and the next deadline is always heap[0]. There
+ * is no periodic tick: the LAPIC timer is armed for heap[0] only, so with
+ * nothing pending no timer interrupt happens at all.
+ *
+ * Every CPU has its own heap and its own LAPIC timer. A timer goes on
+ * the heap of the CPU that adds it, so the common case never touches
+ * another CPU's lock; only cancelling or moving a timer added elsewhere
+ * does.
+ */
+typedef struct
+{
+    spinlock lock;
+    ktimer *heap[TIMER_MAX_PENDING];
+    uint32_t heap_size;
+    uint64_t armed_deadline;    // Deadline the LAPIC timer is armed for, 0 when disarmed
+    uint64_t interrupts;
+    uint64_t fired;
+} timer_queue;
+
+static timer_queue timer_queues[SMP_MAX_CPUS];
+
+static void heap_set(timer_queue *queue, uint32_t index, ktimer *timer)
+{
+    queue->heap[index] = timer;
+    timer->heap_pos = index + 1;
+}
+
+static void heap_sift_up(timer_queue *queue, uint32_t index)
+{
+    ktimer *timer = queue->heap[index];
+
+    while (index > 0)
+    {
+        uint32_t parent = (index - 1) / 2;
+
+        if (queue->heap[parent]->deadline <= timer->deadline)
+        {
+            break;
+        }
+
+        heap_set(queue, index, queue->heap[parent]);
+        index = parent;
+    }
+
+    heap_set(queue, index, timer);
+}
+
+static void heap_sift_down(timer_queue *queue, uint32_t index)
+{
+    ktimer *timer = queue->heap[index];
+
+    for (;;)
+    {
+        uint32_t child = index * 2 + 1;
+
+        if (child >= queue->heap_size)
+        {
+            break;
+        }
+
+        if (child + 1 < queue->heap_size && queue->heap[child + 1]->deadline < queue->heap[child]->deadline)
+        {
+            child++;
+        }
+
+        if (timer->deadline <= queue->heap[child]->deadline)
+        {
+            break;
+        }
+
+        heap_set(queue, index, queue->heap[child]);
+        index = child;
+    }
+
+    heap_set(queue, index, timer);
+}
+
+static void heap_remove(timer_queue *queue, ktimer *timer)
+{
+    uint32_t index = timer->heap_pos - 1;
+    ktimer *last = queue->heap[--queue->heap_size];
+
+    timer->heap_pos = 0;
+
+    if (index == queue->heap_size)
+    {
+        return;
+    }
+
+    heap_set(queue, index, last);
+
+    // The moved timer may belong above or below its new position
+    heap_sift_up(queue, index);
+    heap_sift_down(queue, last->heap_pos - 1);
+}
+
+/**
+ * @brief Points this CPU's LAPIC timer at its earliest pending deadline.
+ * Only reprograms when that deadline moved earlier or the heap ran
+ * empty. A timer armed too early is harmless, the interrupt finds
+ * nothing due and arms again for what is left.
+ */
+static void timer_program(timer_queue *queue)
+{
+    if (queue->heap_size == 0)
+    {
+        if (queue->armed_deadline != 0)
+        {
+            lapic_timer_disarm();
+            queue->armed_deadline = 0;
+        }
+
+        return;
+    }
+
+    uint64_t next = queue->heap[0]->deadline;
+
+    if (queue->armed_deadline == 0 || next < queue->armed_deadline)
+    {
+        queue->armed_deadline = next;
+        lapic_timer_arm(next);
+    }
+}
+
+/**
+ * @brief Runs every timer on this CPU whose deadline has passed.
+ * Each one leaves the heap before its callback runs, so the callback can
+ * add it back for a later deadline. The lock is dropped around the
+ * callback, which is free to take its own locks and call timer_add.
+ */
+static void timer_irq_handler(interrupt_frame *frame)
+{
+    (void)frame;
+
+    timer_queue *queue = &timer_queues[this_cpu()->index];
+
+    spin_lock(&queue->lock);
+
+    queue->interrupts++;
+    queue->armed_deadline = 0;
+
+    uint64_t now = ktime_ns();
+
+    while (queue->heap_size > 0 && queue->heap[0]->deadline <= now)
+    {
+        ktimer *timer = queue->heap[0];
+
+        heap_remove(queue, timer);
+        queue->fired++;
+
+        if (timer->callback != NULL)
+        {
+            spin_unlock(&queue->lock);
+            timer->callback(timer);
+            spin_lock(&queue->lock);
+        }
+    }
+
+    timer_program(queue);
+
+    spin_unlock(&queue->lock);
+}
+
+/**
+ * @brief Locks the queue a timer is pending on.
+ * The timer can move between reading its cpu and taking that lock, so
+ * the check is repeated under the lock.
+ * @return The locked queue, or NULL with nothing locked if it is idle.
+ */
+static timer_queue *timer_lock_owner(ktimer *timer)
+{
+    for (;;)
+    {
+        if (__atomic_load_n(&timer->heap_pos, __ATOMIC_ACQUIRE) == 0)
+        {
+            return NULL;
+        }
+
+        timer_queue *queue = &timer_queues[__atomic_load_n(&timer->cpu, __ATOMIC_ACQUIRE)];
+
+        spin_lock(&queue->lock);
+
+        if (timer->heap_pos != 0 && &timer_queues[timer->cpu] == queue)
+        {
+            return queue;
+        }
+
+        spin_unlock(&queue->lock);
+    }
+}
+
+/**
+ * @brief Arms a timer for an absolute ktime_ns deadline on this CPU.
+ * A timer that is already pending is moved to the new deadline, and to
+ * this CPU if it was added on another one.
+ * @return 0 on success, -1 if TIMER_MAX_PENDING timers are pending here.
+ */
+int timer_add(ktimer *timer, uint64_t deadline)
+{
+    uint64_t flags = irq_save();
+    timer_queue *queue = &timer_queues[this_cpu()->index];
+    timer_queue *owner = timer_lock_owner(timer);
+
+    if (owner != NULL && owner != queue)
+    {
+        heap_remove(owner, timer);
+        spin_unlock(&owner->lock);
+        owner = NULL;
+    }
+
+    if (owner == NULL)
+    {
+        spin_lock(&queue->lock);
+    }
+    else
+    {
+        heap_remove(queue, timer);
+    }
+
+    if (queue->heap_size == TIMER_MAX_PENDING)
+    {
+        spin_unlock(&queue->lock);
+        irq_restore(flags);
+        return -1;
+    }
+
+    timer->deadline = deadline;
+    timer->cpu = this_cpu()->index;
+    heap_set(queue, queue->heap_size, timer);
+    queue->heap_size++;
+    heap_sift_up(queue, queue->heap_size - 1);
+
+    timer_program(queue);
+
+    spin_unlock(&queue->lock);
+    irq_restore(flags);
+
+    return 0;
+}
+
+/**
+ * Leaves the LAPIC timer armed even if this was the earliest timer,
+ * reprogramming costs more than the one early interrupt it saves. That
+ * also makes cancelling from another CPU safe, it never touches a LAPIC
+ * that is not its own.
+ * @return true if the timer was pending.
+ */
+bool timer_cancel(ktimer *timer)
+{
+    uint64_t flags = irq_save();
+    timer_queue *owner = timer_lock_owner(timer);
+
+    if (owner != NULL)
+    {
+        heap_remove(owner, timer);
+        spin_unlock(&owner->lock);
+    }
+
+    irq_restore(flags);
+
+    return owner != NULL;
+}
+
+bool timer_pending(const ktimer *timer)
+{
+    return timer->heap_pos != 0;
+}
+
+uint32_t timer_count(void)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++)
+    {
+        count += timer_queues[i].heap_size;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Sets up the timer queues and the BSP's LAPIC timer.
+ * Calibration happens here, once; the APs reuse the result.
+ */
+void timer_init(void)
+{
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++)
+    {
+        spin_lock_init(&timer_queues[i].lock);
+        timer_queues[i].heap_size = 0;
+        timer_queues[i].armed_deadline = 0;
+    }
+
+    idt_register_handler(LAPIC_TIMER_VECTOR, timer_irq_handler);
+    lapic_timer_init(LAPIC_TIMER_VECTOR);
+}
+
+void timer_init_ap(void)
+{
+    lapic_timer_init(LAPIC_TIMER_VECTOR);
+}
\ No newline at end of file